@@ -157,6 +157,9 @@ make_network_boxes.restype = POINTER(DETECTION)
 free_detections = lib.free_detections
 free_detections.argtypes = [POINTER(DETECTION), c_int]
 
+free_network_boxes = lib.free_network_boxes
+free_network_boxes.argtypes = [POINTER(DETECTION)]
+
 free_ptrs = lib.free_ptrs
 free_ptrs.argtypes = [POINTER(c_void_p), c_int]
 
@@ -289,7 +292,7 @@ def detect_image(net, meta, im, thresh=.5, hier_thresh=.5, nms=.45, debug= False
     if debug: print("did range")
     res = sorted(res, key=lambda x: -x[1])
     if debug: print("did sort")
-    free_detections(dets, num)
+    free_network_boxes(dets)
     if debug: print("freed detections")
     return res
 
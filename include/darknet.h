@@ -67,6 +67,9 @@ typedef struct detection detection;
 struct load_args;
 typedef struct load_args load_args;
 
+struct packed_dataset;
+typedef struct packed_dataset packed_dataset;
+
 struct data;
 typedef struct data data;
 
@@ -319,6 +322,15 @@ struct layer {
 
     float *weights;
     float *weight_updates;
+    float *winograd_weights;
+    int fused_shortcut;     // CPU inference: the following [shortcut] is added by the conv epilogue
+    int8_t *weights_int8;
+    float *weights_int8_scales;
+    int *weights_int8_sums;
+    float input_int8_scale;
+    int input_int8_zero_point;
+    const char *weights_map;    // .dsw mapping some of the buffers above point into, see is_weights_mapped()
+    size_t weights_map_size;
 
     float scale_x_y;
     float iou_normalizer;
@@ -625,6 +637,15 @@ typedef struct network {
     float *truth;
     float *delta;
     float *workspace;
+    float **output_arenas;  // shared layer outputs, see plan_network_memory()
+    int n_output_arenas;
+    void *weights_map;      // .dsw file the layer weights point into
+    size_t weights_map_size;
+    struct detection_buffer *dets_arena;    // get_network_boxes_into() without a buffer
+    float *tiles_input;     // network_predict_tiled() input batch
+    size_t tiles_input_size;
+    int allocated_batch;    // the layer outputs hold this many images, see set_inference_batch()
+    double *layer_times;    // if set, the forward pass stores each layer's time here, ms
     int train;
     int index;
     float *cost;
@@ -719,6 +740,16 @@ typedef struct detection{
     int sort_class;
 } detection;
 
+// network.h
+// Storage for get_network_boxes_into(): the detections and one contiguous
+// block with their prob and mask arrays, grown as needed and reused
+typedef struct detection_buffer {
+    detection *dets;
+    float *probs;
+    int size;       // detections it can hold
+    int stride;     // floats per detection in probs: classes, then mask
+} detection_buffer;
+
 // matrix.h
 typedef struct matrix {
     int rows, cols;
@@ -781,6 +812,7 @@ typedef struct load_args {
     image *resized;
     data_type type;
     tree *hierarchy;
+    packed_dataset *pack;
 } load_args;
 
 // data.h
@@ -822,11 +854,32 @@ LIB_API void do_nms_obj(detection *dets, int total, int classes, float thresh);
 // network.h
 LIB_API float *network_predict(network net, float *input);
 LIB_API float *network_predict_ptr(network *net, float *input);
+// the result is one block, freed with free_network_boxes()
 LIB_API detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter);
+LIB_API void free_network_boxes(detection *dets);
+// for detection arrays with one prob/mask allocation per box
 LIB_API void free_detections(detection *dets, int n);
+// fills buf, or the network's own arena if buf is NULL; the result stays
+// valid until the next call with the same buffer and is not freed by the caller
+LIB_API detection *get_network_boxes_into(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter, detection_buffer *buf);
+LIB_API void free_detection_buffer(detection_buffer *buf);
+// Runs im at its own resolution as overlapping net->w x net->h tiles, batched
+// through the network; overlap <= 0 picks 1/8 of the tile. Each box is kept by
+// the tile that owns its centre, then nms merges the seams. Boxes are relative
+// to im; the result is stored like get_network_boxes_into() does.
+LIB_API detection *network_predict_tiled(network *net, image im, int overlap, float thresh, float hier, float nms, int *num, detection_buffer *buf);
+// get_network_boxes_into() for image b of the last batched forward pass
+LIB_API detection *get_network_boxes_batch_into(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter, detection_buffer *buf);
 LIB_API void fuse_conv_batchnorm(network net);
+LIB_API void fuse_conv_shortcut(network net);
 LIB_API void calculate_binary_weights(network net);
+LIB_API void plan_network_memory(network *net);
+LIB_API void unplan_network_memory(network *net);
+LIB_API void free_network_weights_map(network *net);
 LIB_API char *detection_to_json(detection *dets, int nboxes, int classes, char **names, long long int frame_id, char *filename);
+// formats into *buf of *size bytes, reallocated only when the frame doesn't fit, and returns
+// the length; the caller keeps buf between frames and frees it
+LIB_API size_t detection_to_json_into(detection *dets, int nboxes, int classes, char **names, long long int frame_id, char *filename, char **buf, size_t *size);
 
 LIB_API layer* get_network_layer(network* net, int i);
 //LIB_API detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter);
@@ -70,6 +70,9 @@ extern "C" LIB_API void send_json_custom(char const* send_buf, int port, int tim
 class Detector {
     std::shared_ptr<void> detector_gpu_ptr;
     std::deque<std::vector<bbox_t>> prev_bbox_vec_deque;
+    // filter as for resize_bytes_into(): 0 - as resize_image(), 2 - as cv::resize()
+    std::vector<bbox_t> detect_resampled(const unsigned char *data, int w, int h, int c, int step, bool bgr, int filter,
+        float thresh, bool use_mean);
 public:
     const int cur_gpu_id;
     float nms = .4;
@@ -80,6 +83,14 @@ public:
 
     LIB_API std::vector<bbox_t> detect(std::string image_filename, float thresh = 0.2, bool use_mean = false);
     LIB_API std::vector<bbox_t> detect(image_t img, float thresh = 0.2, bool use_mean = false);
+    // 8-bit interleaved pixels (BGR if bgr, e.g. cv::Mat::data) resized straight into the network input,
+    // sampled at pixel centres as cv::resize() does
+    LIB_API std::vector<bbox_t> detect_bytes(const unsigned char *data, int w, int h, int c, int step, bool bgr,
+        float thresh = 0.2, bool use_mean = false);
+    LIB_API std::vector<std::vector<bbox_t>> detect_batch(std::vector<image_t> imgs, float thresh = 0.2);
+    // at the image's own size: overlapping network-sized tiles in one batch, boxes merged across
+    // the seams; overlap 0 - 1/8 of the network size
+    LIB_API std::vector<bbox_t> detect_tiled(image_t img, float thresh = 0.2, int overlap = 0);
     static LIB_API image_t load_image(std::string image_filename);
     static LIB_API void free_image(image_t m);
     LIB_API int get_net_width() const;
@@ -109,10 +120,20 @@ public:
     {
         if(mat.data == NULL)
             throw std::runtime_error("Image is empty");
+        if (mat.depth() == CV_8U && mat.channels() >= get_net_color_depth() && mat.channels() <= 4)
+            return detect_bytes(mat.data, mat.cols, mat.rows, mat.channels(), (int)mat.step, mat.channels() > 1, thresh, use_mean);
         auto image_ptr = mat_to_image_resize(mat);
         return detect_resized(*image_ptr, mat.cols, mat.rows, thresh, use_mean);
     }
 
+    std::vector<bbox_t> detect_tiled(cv::Mat mat, float thresh = 0.2, int overlap = 0)
+    {
+        if (mat.data == NULL)
+            throw std::runtime_error("Image is empty");
+        auto image_ptr = mat_to_image(mat);
+        return detect_tiled(*image_ptr, thresh, overlap);
+    }
+
     std::shared_ptr<image_t> mat_to_image_resize(cv::Mat mat) const
     {
         if (mat.data == NULL) return std::shared_ptr<image_t>(NULL);
@@ -227,6 +248,255 @@ public:
 // --------------------------------------------------------------------------------
 
 
+// CASA motility parameters of one track. Velocities are in px/s and ALH in px:
+// multiply them by the pixel size (um/px) for um/s and um.
+struct motility_t {
+    unsigned int track_id;
+    unsigned int obj_id;
+    unsigned int points;    // detections in the track
+    float duration;         // s, from the first to the last detection
+    float vcl;              // curvilinear velocity: length of the path / duration
+    float vsl;              // straight-line velocity: first to last point / duration
+    float vap;              // average path velocity: length of the smoothed path / its duration
+    float alh;              // amplitude of lateral head displacement: 2 x mean distance from the smoothed path
+    float alh_max;          // 2 x largest distance from the smoothed path
+    float lin;              // linearity VSL/VCL
+    float str;              // straightness VSL/VAP
+    float wob;              // wobble VAP/VCL
+};
+
+// Links the detections of consecutive frames into tracks by their centres and
+// keeps the motility parameters of every track up to date frame by frame.
+// Each detection is compared only with the tracks of the same class predicted
+// in its own and the 8 neighbouring cells of a max_dist hash grid, then the
+// closest pairs are matched first (greedy gated assignment). A frame with n
+// tracks and m detections costs O(n + m + k log k) for k candidate pairs.
+class track_motility_t
+{
+public:
+    struct point_t {
+        float x, y;     // centre, px
+        double time;    // s
+    };
+
+    struct track_t {
+        unsigned int track_id;
+        unsigned int obj_id;
+        std::vector<point_t> points;    // trajectory
+        int missed;                     // frames since the last detection
+        float vx, vy;                   // px/s, smoothed, for the prediction
+        double path;                    // length of the path
+        double sum_x, sum_y;            // sum of the last `smooth` points
+        point_t avg_first, avg_last;    // ends of the smoothed path
+        double avg_path;                // length of the smoothed path
+        int avg_points;
+        double dev_sum, dev_max;        // distance of the points from the smoothed path
+    };
+
+    float max_dist;     // px, the farthest a cell moves between two of its detections
+    int max_missed;     // frames without a detection before a track ends
+    int min_points;     // tracks with fewer detections are dropped when they end
+    int smooth;         // points in the moving average that gives the average path
+
+    std::vector<track_t> tracks;    // active
+    std::vector<track_t> finished;  // ended tracks with at least min_points detections
+
+    track_motility_t(float _max_dist = 20, int _max_missed = 2, int _min_points = 5, int _smooth = 5) :
+        max_dist(_max_dist), max_missed(_max_missed), min_points(_min_points), smooth(std::max(1, _smooth)),
+        track_id_counter(0)
+    {}
+
+    // detections of the frame taken at time_sec; returns them with track_id and
+    // frames_counter (detections in the track so far) set
+    std::vector<bbox_t> update(std::vector<bbox_t> cur_bbox_vec, double time_sec)
+    {
+        size_t const old_tracks = tracks.size();
+        build_grid(time_sec);
+
+        float const max_dist2 = max_dist * max_dist;
+        pairs.clear();
+        for (size_t i = 0; i < cur_bbox_vec.size(); ++i) {
+            bbox_t const& b = cur_bbox_vec[i];
+            float const x = b.x + b.w / 2.f, y = b.y + b.h / 2.f;
+            int const cx = get_cell(x), cy = get_cell(y);
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    for (int k = grid_head[get_bucket(cx + dx, cy + dy)]; k >= 0; k = grid_next[k]) {
+                        if (tracks[k].obj_id != b.obj_id || get_cell(pred[k].x) != cx + dx || get_cell(pred[k].y) != cy + dy) continue;
+                        float const ex = pred[k].x - x, ey = pred[k].y - y;
+                        float const dist2 = ex*ex + ey*ey;
+                        if (dist2 < max_dist2) pairs.push_back({ dist2, k, (int)i });
+                    }
+                }
+            }
+        }
+        std::sort(pairs.begin(), pairs.end(), [](match_t const& a, match_t const& b) {
+            if (a.dist2 != b.dist2) return a.dist2 < b.dist2;
+            return a.track < b.track || (a.track == b.track && a.det < b.det);
+        });
+        det_track.assign(cur_bbox_vec.size(), -1);
+        track_hit.assign(old_tracks, 0);
+        for (auto &p : pairs) {
+            if (det_track[p.det] >= 0 || track_hit[p.track]) continue;
+            det_track[p.det] = p.track;
+            track_hit[p.track] = 1;
+        }
+
+        for (size_t i = 0; i < cur_bbox_vec.size(); ++i) {
+            bbox_t &b = cur_bbox_vec[i];
+            int k = det_track[i];
+            if (k < 0) {
+                k = (int)tracks.size();
+                tracks.push_back(track_t());
+                tracks[k].track_id = ++track_id_counter;
+                tracks[k].obj_id = b.obj_id;
+            }
+            point_t const p = { b.x + b.w / 2.f, b.y + b.h / 2.f, time_sec };
+            add_point(tracks[k], p);
+            b.track_id = tracks[k].track_id;
+            b.frames_counter = tracks[k].points.size();
+        }
+
+        // the last track moves into the place of an ended one, it is either new or already visited
+        for (size_t k = old_tracks; k-- > 0;) {
+            if (track_hit[k] || ++tracks[k].missed <= max_missed) continue;
+            end_track(k);
+        }
+        return cur_bbox_vec;
+    }
+
+    // ends all the tracks, e.g. at the end of a video
+    void finish()
+    {
+        for (size_t k = tracks.size(); k-- > 0;) end_track(k);
+    }
+
+    // finished tracks, then the active ones with at least min_points detections
+    std::vector<motility_t> motility() const
+    {
+        std::vector<motility_t> result;
+        for (auto &t : finished) result.push_back(get_motility(t));
+        for (auto &t : tracks) {
+            if ((int)t.points.size() >= min_points) result.push_back(get_motility(t));
+        }
+        return result;
+    }
+
+    static motility_t get_motility(track_t const& t)
+    {
+        motility_t m = motility_t();
+        m.track_id = t.track_id;
+        m.obj_id = t.obj_id;
+        m.points = t.points.size();
+        if (t.points.size() < 2) return m;
+        point_t const& first = t.points.front();
+        point_t const& last = t.points.back();
+        m.duration = last.time - first.time;
+        if (m.duration <= 0) return m;
+        m.vcl = t.path / m.duration;
+        m.vsl = get_distance(first, last) / m.duration;
+        double const avg_duration = t.avg_last.time - t.avg_first.time;
+        if (t.avg_points > 1 && avg_duration > 0) m.vap = t.avg_path / avg_duration;
+        if (t.avg_points > 0) {
+            m.alh = 2 * t.dev_sum / t.avg_points;
+            m.alh_max = 2 * t.dev_max;
+        }
+        if (m.vcl > 0) m.lin = m.vsl / m.vcl, m.wob = m.vap / m.vcl;
+        if (m.vap > 0) m.str = m.vsl / m.vap;
+        return m;
+    }
+
+    static double get_distance(point_t const& a, point_t const& b) {
+        return sqrt((double)(a.x - b.x)*(a.x - b.x) + (double)(a.y - b.y)*(a.y - b.y));
+    }
+
+private:
+    struct match_t {
+        float dist2;
+        int track;
+        int det;
+    };
+
+    unsigned int track_id_counter;
+    std::vector<point_t> pred;      // where each track is expected at the current frame
+    std::vector<int> grid_head;     // first track in each bucket of the hash grid, -1 - none
+    std::vector<int> grid_next;     // next track in the same bucket
+    std::vector<match_t> pairs;
+    std::vector<int> det_track;
+    std::vector<char> track_hit;
+
+    int get_cell(float v) const { return (int)floorf(v / max_dist); }
+
+    size_t get_bucket(int cx, int cy) const {
+        return (((unsigned int)cx * 73856093u) ^ ((unsigned int)cy * 19349663u)) & (grid_head.size() - 1);
+    }
+
+    void build_grid(double time_sec)
+    {
+        size_t buckets = 64;
+        while (buckets < 2 * tracks.size()) buckets *= 2;
+        grid_head.assign(buckets, -1);
+        grid_next.resize(tracks.size());
+        pred.resize(tracks.size());
+        for (size_t k = 0; k < tracks.size(); ++k) {
+            track_t const& t = tracks[k];
+            point_t const& last = t.points.back();
+            float const dt = time_sec - last.time;
+            pred[k].x = last.x + t.vx * dt;
+            pred[k].y = last.y + t.vy * dt;
+            size_t const bucket = get_bucket(get_cell(pred[k].x), get_cell(pred[k].y));
+            grid_next[k] = grid_head[bucket];
+            grid_head[bucket] = k;
+        }
+    }
+
+    void add_point(track_t &t, point_t const& p)
+    {
+        if (!t.points.empty()) {
+            point_t const& last = t.points.back();
+            double const dt = p.time - last.time;
+            t.path += get_distance(last, p);
+            if (dt > 0) {
+                float const vx = (p.x - last.x) / dt, vy = (p.y - last.y) / dt;
+                bool const first = t.points.size() == 1;
+                t.vx = first ? vx : (t.vx + vx) / 2;
+                t.vy = first ? vy : (t.vy + vy) / 2;
+            }
+        }
+        t.points.push_back(p);
+        t.missed = 0;
+
+        // the moving average of the last `smooth` points is the average path,
+        // the middle point's distance from it is the lateral head displacement
+        size_t const n = t.points.size();
+        t.sum_x += p.x;
+        t.sum_y += p.y;
+        if (n > (size_t)smooth) {
+            t.sum_x -= t.points[n - 1 - smooth].x;
+            t.sum_y -= t.points[n - 1 - smooth].y;
+        }
+        if (n < (size_t)smooth) return;
+        point_t const& mid = t.points[n - 1 - smooth / 2];
+        point_t const avg = { (float)(t.sum_x / smooth), (float)(t.sum_y / smooth), mid.time };
+        if (t.avg_points) t.avg_path += get_distance(t.avg_last, avg);
+        else t.avg_first = avg;
+        t.avg_last = avg;
+        ++t.avg_points;
+        double const dev = get_distance(mid, avg);
+        t.dev_sum += dev;
+        t.dev_max = std::max(t.dev_max, dev);
+    }
+
+    void end_track(size_t k)
+    {
+        if ((int)tracks[k].points.size() >= min_points) finished.push_back(std::move(tracks[k]));
+        if (k + 1 != tracks.size()) tracks[k] = std::move(tracks.back());
+        tracks.pop_back();
+    }
+};
+// --------------------------------------------------------------------------------
+
+
 #if defined(TRACK_OPTFLOW) && defined(OPENCV) && defined(GPU)
 
 #include <opencv2/cudaoptflow.hpp>
@@ -35,6 +35,15 @@ void resize_avgpool_layer(avgpool_layer *l, int w, int h)
     l->w = w;
     l->h = h;
     l->inputs = h*w*l->c;
+    const int output_size = l->outputs * l->batch;
+    l->output = (float*)realloc(l->output, output_size * sizeof(float));
+    l->delta = (float*)realloc(l->delta, output_size * sizeof(float));
+#ifdef GPU
+    cuda_free(l->output_gpu);
+    cuda_free(l->delta_gpu);
+    l->output_gpu = cuda_make_array(l->output, output_size);
+    l->delta_gpu = cuda_make_array(l->delta, output_size);
+#endif
 }
 
 void forward_avgpool_layer(const avgpool_layer l, network_state state)
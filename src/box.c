@@ -1,5 +1,8 @@
 #include "box.h"
+#include "gemm.h"
+#include "utils.h"
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <stdlib.h>
 
@@ -422,9 +425,151 @@ int nms_comparator_v3(const void *pa, const void *pb)
     return 0;
 }
 
+// Scratch memory of the grid NMS, sized for one call of do_nms_sort()/do_nms_obj()
+typedef struct nms_grid {
+    int gw, gh;
+    int *cell;          // cell of each detection, -1 if it has no score
+    int *pos;           // position of each detection in the cell-ordered arrays
+    int *cell_start;    // gw*gh + 1
+    float *left, *top, *right, *bottom, *area, *keep;
+} nms_grid;
+
+static nms_grid make_nms_grid(int total)
+{
+    nms_grid g = { 0 };
+    int side = (int)sqrt((double)total) + 1;
+    g.cell = (int*)calloc(total, sizeof(int));
+    g.pos = (int*)calloc(total, sizeof(int));
+    g.cell_start = (int*)calloc(side*side + 1, sizeof(int));
+    g.left = (float*)calloc(total * 6, sizeof(float));
+    g.top = g.left + total;
+    g.right = g.top + total;
+    g.bottom = g.right + total;
+    g.area = g.bottom + total;
+    g.keep = g.area + total;
+    return g;
+}
+
+static void free_nms_grid(nms_grid g)
+{
+    free(g.cell);
+    free(g.pos);
+    free(g.cell_start);
+    free(g.left);
+}
+
+static float nms_score(detection *d, int k)
+{
+    return k < 0 ? d->objectness : d->prob[k];
+}
+
+// Greedy NMS for class k (objectness if k < 0) over dets already sorted by
+// that score: a box is suppressed when it overlaps an earlier kept box by
+// more than thresh, as in the all-pairs loop. Boxes are bucketed by center
+// into a grid whose cells are at least as large as the largest box, so two
+// overlapping boxes are always in neighbouring cells, and each box is only
+// checked against the kept boxes of its 3x3 neighbourhood.
+static void nms_sorted(nms_grid *g, detection *dets, int total, int k, int classes, float thresh)
+{
+    int i, j, m = 0;
+    float min_x = 0, min_y = 0, max_x = 0, max_y = 0, max_w = 0, max_h = 0;
+    for (i = 0; i < total; ++i) {
+        if (nms_score(&dets[i], k) == 0) continue;
+        box b = dets[i].bbox;
+        if (!m || b.x < min_x) min_x = b.x;
+        if (!m || b.x > max_x) max_x = b.x;
+        if (!m || b.y < min_y) min_y = b.y;
+        if (!m || b.y > max_y) max_y = b.y;
+        if (b.w > max_w) max_w = b.w;
+        if (b.h > max_h) max_h = b.h;
+        ++m;
+    }
+    if (!m) return;
+
+    // the margin keeps rounding of the cell index from separating two
+    // overlapping boxes by more than one cell
+    int side = (int)sqrt((double)total) + 1;
+    float cell_w = max_w * 1.001f + (fabs(min_x) + fabs(max_x)) * 1e-5f + 1e-20f;
+    float cell_h = max_h * 1.001f + (fabs(min_y) + fabs(max_y)) * 1e-5f + 1e-20f;
+    if ((max_x - min_x) / cell_w >= side) cell_w = (max_x - min_x) / (side - 1);
+    if ((max_y - min_y) / cell_h >= side) cell_h = (max_y - min_y) / (side - 1);
+    g->gw = constrain_int((int)((max_x - min_x) / cell_w) + 1, 1, side);
+    g->gh = constrain_int((int)((max_y - min_y) / cell_h) + 1, 1, side);
+    int ncells = g->gw * g->gh;
+
+    memset(g->cell_start, 0, (ncells + 1) * sizeof(int));
+    for (i = 0; i < total; ++i) {
+        g->cell[i] = -1;
+        if (nms_score(&dets[i], k) == 0) continue;
+        int cx = constrain_int((int)((dets[i].bbox.x - min_x) / cell_w), 0, g->gw - 1);
+        int cy = constrain_int((int)((dets[i].bbox.y - min_y) / cell_h), 0, g->gh - 1);
+        g->cell[i] = cy * g->gw + cx;
+        ++g->cell_start[g->cell[i] + 1];
+    }
+    for (i = 0; i < ncells; ++i) g->cell_start[i + 1] += g->cell_start[i];
+    for (i = 0; i < total; ++i) {
+        if (g->cell[i] < 0) continue;
+        int p = g->cell_start[g->cell[i]]++;
+        box b = dets[i].bbox;
+        g->pos[i] = p;
+        g->left[p] = b.x - b.w / 2;
+        g->right[p] = b.x + b.w / 2;
+        g->top[p] = b.y - b.h / 2;
+        g->bottom[p] = b.y + b.h / 2;
+        g->area[p] = b.w*b.h;
+        g->keep[p] = 0;
+    }
+    // the fill above advanced every start to the next cell's
+    for (i = ncells; i > 0; --i) g->cell_start[i] = g->cell_start[i - 1];
+    g->cell_start[0] = 0;
+
+    for (i = 0; i < total; ++i) {
+        if (g->cell[i] < 0 || nms_score(&dets[i], k) == 0) continue;
+        int p = g->pos[i];
+        int cx = g->cell[i] % g->gw;
+        int cy = g->cell[i] / g->gw;
+        int x0 = cx > 0 ? cx - 1 : 0;
+        int x1 = cx < g->gw - 1 ? cx + 1 : cx;
+        int y, suppressed = 0;
+        for (y = (cy > 0 ? cy - 1 : 0); y <= cy + 1 && y < g->gh && !suppressed; ++y) {
+            int first = g->cell_start[y * g->gw + x0];
+            int n = g->cell_start[y * g->gw + x1 + 1] - first;
+            suppressed = any_iou_above(g->left[p], g->top[p], g->right[p], g->bottom[p], g->area[p],
+                g->left + first, g->top + first, g->right + first, g->bottom + first, g->area + first, g->keep + first, n, thresh);
+        }
+        if (!suppressed) g->keep[p] = 1;
+        else if (k >= 0) dets[i].prob[k] = 0;
+        else {
+            dets[i].objectness = 0;
+            for (j = 0; j < classes; ++j) dets[i].prob[j] = 0;
+        }
+    }
+}
+
+// all-pairs version, still used for a negative thresh where even disjoint boxes suppress each other
+static void nms_sorted_all_pairs(detection *dets, int total, int k, int classes, float thresh)
+{
+    int i, j, c;
+    for (i = 0; i < total; ++i) {
+        if (nms_score(&dets[i], k) == 0) continue;
+        box a = dets[i].bbox;
+        for (j = i + 1; j < total; ++j) {
+            if (k < 0 && dets[j].objectness == 0) continue;
+            box b = dets[j].bbox;
+            if (box_iou(a, b) > thresh) {
+                if (k >= 0) dets[j].prob[k] = 0;
+                else {
+                    dets[j].objectness = 0;
+                    for (c = 0; c < classes; ++c) dets[j].prob[c] = 0;
+                }
+            }
+        }
+    }
+}
+
 void do_nms_obj(detection *dets, int total, int classes, float thresh)
 {
-    int i, j, k;
+    int i, k;
     k = total - 1;
     for (i = 0; i <= k; ++i) {
         if (dets[i].objectness == 0) {
@@ -442,25 +587,18 @@ void do_nms_obj(detection *dets, int total, int classes, float thresh)
     }
 
     qsort(dets, total, sizeof(detection), nms_comparator_v3);
-    for (i = 0; i < total; ++i) {
-        if (dets[i].objectness == 0) continue;
-        box a = dets[i].bbox;
-        for (j = i + 1; j < total; ++j) {
-            if (dets[j].objectness == 0) continue;
-            box b = dets[j].bbox;
-            if (box_iou(a, b) > thresh) {
-                dets[j].objectness = 0;
-                for (k = 0; k < classes; ++k) {
-                    dets[j].prob[k] = 0;
-                }
-            }
-        }
+    if (thresh < 0) {
+        nms_sorted_all_pairs(dets, total, -1, classes, thresh);
+        return;
     }
+    nms_grid g = make_nms_grid(total);
+    nms_sorted(&g, dets, total, -1, classes, thresh);
+    free_nms_grid(g);
 }
 
 void do_nms_sort(detection *dets, int total, int classes, float thresh)
 {
-    int i, j, k;
+    int i, k;
     k = total - 1;
     for (i = 0; i <= k; ++i) {
         if (dets[i].objectness == 0) {
@@ -473,23 +611,99 @@ void do_nms_sort(detection *dets, int total, int classes, float thresh)
     }
     total = k + 1;
 
+    nms_grid g = make_nms_grid(total);
     for (k = 0; k < classes; ++k) {
         for (i = 0; i < total; ++i) {
             dets[i].sort_class = k;
         }
         qsort(dets, total, sizeof(detection), nms_comparator_v3);
-        for (i = 0; i < total; ++i) {
-            //printf("  k = %d, \t i = %d \n", k, i);
-            if (dets[i].prob[k] == 0) continue;
-            box a = dets[i].bbox;
-            for (j = i + 1; j < total; ++j) {
-                box b = dets[j].bbox;
-                if (box_iou(a, b) > thresh) {
-                    dets[j].prob[k] = 0;
-                }
+        if (thresh < 0) nms_sorted_all_pairs(dets, total, k, classes, thresh);
+        else nms_sorted(&g, dets, total, k, classes, thresh);
+    }
+    free_nms_grid(g);
+}
+
+// the previous all-pairs do_nms_sort(), kept as the reference of benchmark_nms()
+static void do_nms_sort_all_pairs(detection *dets, int total, int classes, float thresh)
+{
+    int i, k;
+    k = total - 1;
+    for (i = 0; i <= k; ++i) {
+        if (dets[i].objectness == 0) {
+            detection swap = dets[i];
+            dets[i] = dets[k];
+            dets[k] = swap;
+            --k;
+            --i;
+        }
+    }
+    total = k + 1;
+    for (k = 0; k < classes; ++k) {
+        for (i = 0; i < total; ++i) dets[i].sort_class = k;
+        qsort(dets, total, sizeof(detection), nms_comparator_v3);
+        nms_sorted_all_pairs(dets, total, k, classes, thresh);
+    }
+}
+
+// Synthetic dense frames: n candidate boxes in clusters of 4 around small
+// objects, as YOLO emits them at a low -thresh. Runs the grid NMS and the
+// all-pairs reference on copies of each frame and checks they agree.
+void benchmark_nms(int frames, int n, int classes, float thresh)
+{
+    int f, i, k;
+    double grid_time = 0, ref_time = 0;
+    int mismatches = 0, kept = 0;
+    detection *a = (detection*)calloc(n, sizeof(detection));
+    detection *b = (detection*)calloc(n, sizeof(detection));
+    float *probs_a = (float*)calloc(n * classes, sizeof(float));
+    float *probs_b = (float*)calloc(n * classes, sizeof(float));
+    for (f = 0; f < frames; ++f) {
+        for (i = 0; i < n; ++i) {
+            if (i % 4 == 0) {
+                a[i].bbox.x = rand_uniform(0, 1);
+                a[i].bbox.y = rand_uniform(0, 1);
+                a[i].bbox.w = rand_uniform(.005, .03);
+                a[i].bbox.h = rand_uniform(.005, .03);
+            }
+            else {
+                box o = a[i - i % 4].bbox;
+                a[i].bbox.x = o.x + rand_uniform(-.3, .3) * o.w;
+                a[i].bbox.y = o.y + rand_uniform(-.3, .3) * o.h;
+                a[i].bbox.w = o.w * rand_uniform(.8, 1.25);
+                a[i].bbox.h = o.h * rand_uniform(.8, 1.25);
+            }
+            a[i].classes = classes;
+            a[i].prob = probs_a + i * classes;
+            a[i].objectness = rand_uniform(.05, 1);
+            for (k = 0; k < classes; ++k) a[i].prob[k] = (random_gen() % 3) ? a[i].objectness * rand_uniform(.05, 1) : 0;
+        }
+        memcpy(probs_b, probs_a, n * classes * sizeof(float));
+        for (i = 0; i < n; ++i) {
+            b[i] = a[i];
+            b[i].prob = probs_b + i * classes;
+        }
+
+        double start = get_time_point();
+        do_nms_sort(a, n, classes, thresh);
+        grid_time += get_time_point() - start;
+        start = get_time_point();
+        do_nms_sort_all_pairs(b, n, classes, thresh);
+        ref_time += get_time_point() - start;
+
+        for (i = 0; i < n; ++i) {
+            for (k = 0; k < classes; ++k) {
+                if (a[i].prob[k] != b[i].prob[k]) ++mismatches;
+                if (a[i].prob[k] > 0) ++kept;
             }
         }
     }
+    printf(" NMS of %d boxes x %d classes, %d frames: %d kept per frame \n", n, classes, frames, kept / frames);
+    printf(" grid: %.3f ms, all-pairs: %.3f ms per frame, %d mismatches \n",
+        grid_time / 1000 / frames, ref_time / 1000 / frames, mismatches);
+    free(a);
+    free(b);
+    free(probs_a);
+    free(probs_b);
 }
 
 void do_nms(box *boxes, float **probs, int total, int classes, float thresh)
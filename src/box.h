@@ -41,6 +41,7 @@ void do_nms(box *boxes, float **probs, int total, int classes, float thresh);
 void do_nms_sort_v2(box *boxes, float **probs, int total, int classes, float thresh);
 //LIB_API void do_nms_sort(detection *dets, int total, int classes, float thresh);
 //LIB_API void do_nms_obj(detection *dets, int total, int classes, float thresh);
+void benchmark_nms(int frames, int n, int classes, float thresh);
 box decode_box(box b, box anchor);
 box encode_box(box b, box anchor);
 
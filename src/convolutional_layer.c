@@ -863,6 +863,84 @@ void binary_align_weights(convolutional_layer *l)
     free(align_weights);
 }
 
+// inference only: 3x3 stride-1 FP32 layers get the Winograd F(4x4, 3x3) weights,
+// forward_convolutional_layer() uses them instead of GEMM
+void winograd_transform_weights(convolutional_layer *l)
+{
+    if (l->winograd_weights) {
+        // .dsw stores the transform of the fused weights, anything else may be stale after fuse_conv_batchnorm()
+        if (is_weights_mapped(*l, l->winograd_weights)) return;
+        free(l->winograd_weights);
+        l->winograd_weights = NULL;
+    }
+    if (l->type != CONVOLUTIONAL || l->size != 3 || l->stride != 1 || l->dilation != 1) return;
+    if (l->groups != 1 || l->xnor || l->binary || l->weights_int8) return;
+    if (l->c < 8) return;   // transforms cost more than they save for the first layer
+
+    l->winograd_weights = (float*)calloc((size_t)36 * l->n * l->c, sizeof(float));
+    winograd_transform_weights_4x4_3x3(l->weights, l->n, l->c, l->winograd_weights);
+}
+
+int can_quantize_convolutional_layer(convolutional_layer l)
+{
+    // the input layer (c=3) stays FP32: with a few MACs per output the int8 kernels don't pay off
+    return l.type == CONVOLUTIONAL && l.groups == 1 && !l.xnor && !l.binary && !l.share_layer && l.c >= 4;
+}
+
+// INT8 inference: weights are symmetric per output channel in [-63, 63] (7 bits, so that
+// _mm256_maddubs_epi16 can't saturate), the input is asymmetric uint8 over [input_min, input_max]
+// which comes from "detector calibrate". Batch-norm must be already fused into the weights.
+void quantize_convolutional_layer(convolutional_layer *l, float input_min, float input_max)
+{
+    const int size = l->nweights / l->n;
+    int8_t *weights = (int8_t*)calloc(l->nweights, sizeof(int8_t));
+    float *scales = (float*)calloc(l->n, sizeof(float));
+    int i, k;
+
+    if (input_min > 0) input_min = 0;   // zero must be exact: padding
+    if (input_max < 0) input_max = 0;
+    if (input_max - input_min < 1e-6f) input_max = input_min + 1e-6f;
+    const float input_scale = (input_max - input_min) / 255;
+    int input_zero_point = (int)roundf(-input_min / input_scale);
+    if (input_zero_point > 255) input_zero_point = 255;
+
+    for (k = 0; k < l->n; ++k) {
+        float max_abs = 0;
+        for (i = 0; i < size; ++i) max_abs = fmaxf(max_abs, fabsf(l->weights[k*size + i]));
+        scales[k] = (max_abs > 0) ? max_abs / 63 : 1;
+        for (i = 0; i < size; ++i) weights[k*size + i] = (int8_t)roundf(l->weights[k*size + i] / scales[k]);
+    }
+    make_convolutional_int8_weights(l, weights, scales, input_scale, input_zero_point);
+    free(weights);
+    free(scales);
+}
+
+// l->weights become the dequantized INT8 weights, so the FP32 and GPU paths compute the same model
+void make_convolutional_int8_weights(convolutional_layer *l, int8_t *weights, float *scales, float input_scale, int input_zero_point)
+{
+    const int size = l->nweights / l->n;
+    int i, k;
+    if (l->weights_int8 && !is_weights_mapped(*l, l->weights_int8)) free(l->weights_int8);
+    if (l->weights_int8_scales && !is_weights_mapped(*l, l->weights_int8_scales)) free(l->weights_int8_scales);
+    if (l->weights_int8_sums && !is_weights_mapped(*l, l->weights_int8_sums)) free(l->weights_int8_sums);
+    if (l->winograd_weights && !is_weights_mapped(*l, l->winograd_weights)) free(l->winograd_weights);
+    l->winograd_weights = NULL;
+
+    l->weights_int8 = (int8_t*)calloc(int8_weights_size(l->n, l->c, l->size), sizeof(int8_t));
+    l->weights_int8_scales = (float*)calloc(l->n, sizeof(float));
+    l->weights_int8_sums = (int*)calloc(l->n, sizeof(int));
+    pack_int8_weights(weights, l->n, l->c, l->size, l->weights_int8);
+    for (k = 0; k < l->n; ++k) {
+        l->weights_int8_scales[k] = scales[k];
+        for (i = 0; i < size; ++i) {
+            l->weights_int8_sums[k] += weights[k*size + i];
+            l->weights[k*size + i] = weights[k*size + i] * scales[k];
+        }
+    }
+    l->input_int8_scale = input_scale;
+    l->input_int8_zero_point = input_zero_point;
+}
+
 // binary transpose
 size_t binary_transpose_align_input(int k, int n, float *b, char **t_bit_input, size_t ldb_align, int bit_align)
 {
@@ -910,6 +988,13 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
     static int u = 0;
     u++;
 
+    // inference: bias, activation and the fused [shortcut] are applied by the kernels to each output tile
+    float *residual = l.fused_shortcut ? state.net.layers[state.net.layers[state.index + 1].index].output : NULL;
+    const int use_epilogue = !state.train && !l.batch_normalize && !l.xnor && !l.binary && can_apply_conv_epilogue(l.activation);
+    int epilogue_done = 0;
+    conv_epilogue epilogue;
+    epilogue.activation = l.activation;
+
     for(i = 0; i < l.batch; ++i)
     {
         for (j = 0; j < l.groups; ++j)
@@ -917,6 +1002,9 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
             float *a = l.weights +j*l.nweights / l.groups;
             float *b = state.workspace;
             float *c = l.output +(i*l.groups + j)*n*m;
+            epilogue.bias = l.biases + j*m;
+            epilogue.residual = residual ? residual + (i*l.groups + j)*n*m : NULL;
+            const conv_epilogue *e = use_epilogue ? &epilogue : NULL;
 
             //gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
             //gemm_nn_custom(m, n, k, 1, a, k, b, n, c, n);
@@ -1041,7 +1129,27 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
             else {
                 //printf(" l.index = %d - FP32 \n", l.index);
                 float *im = state.input + (i*l.groups + j)*(l.c / l.groups)*l.h*l.w;
-                if (l.size == 1) {
+                if (l.weights_int8 && !state.train) {
+                    convolution_2d_int8(im, l.c, l.h, l.w, l.size, l.stride, l.pad, l.dilation,
+                        l.weights_int8, l.weights_int8_scales, l.weights_int8_sums, l.n,
+                        l.input_int8_scale, l.input_int8_zero_point, c, e);
+                    epilogue_done = (e != NULL);
+                    continue;
+                }
+                if (l.winograd_weights && !state.train) {
+                    convolution_winograd_4x4_3x3(im, l.c, l.h, l.w, l.pad, l.winograd_weights, m, c, e);
+                    epilogue_done = (e != NULL);
+                    continue;
+                }
+                else if (is_fma_avx2()) {
+                    // direct convolution: GEMM panels are gathered from the image, no im2col workspace
+                    convolution_2d_packed(im, l.c / l.groups, l.h, l.w,
+                        l.size, l.stride, l.pad, l.dilation,
+                        a, m, c, e);
+                    epilogue_done = (e != NULL);
+                    continue;
+                }
+                else if (l.size == 1 && l.stride == 1 && l.pad == 0 && l.dilation == 1) {
                     b = im;
                 }
                 else {
@@ -1066,6 +1174,8 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
         }
     }
 
+    if (epilogue_done) return;
+
     if(l.batch_normalize){
         forward_batchnorm_layer(l, state);
     }
@@ -1074,6 +1184,7 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
     //activate_array(l.output, m*n*l.batch, l.activation);
     if (l.activation == SWISH) activate_array_swish(l.output, l.outputs*l.batch, l.output_sigmoid, l.output);
     else activate_array_cpu_custom(l.output, l.outputs*l.batch, l.activation);
+    if (residual) axpy_cpu(l.outputs*l.batch, 1, residual, 1, l.output, 1);
 
     if(l.binary || l.xnor) swap_binary(&l);
 }
@@ -41,6 +41,10 @@ void swap_binary(convolutional_layer *l);
 void binarize_weights2(float *weights, int n, int size, char *binary, float *scales);
 
 void binary_align_weights(convolutional_layer *l);
+void winograd_transform_weights(convolutional_layer *l);
+int can_quantize_convolutional_layer(convolutional_layer l);
+void quantize_convolutional_layer(convolutional_layer *l, float input_min, float input_max);
+void make_convolutional_int8_weights(convolutional_layer *l, int8_t *weights, float *scales, float input_scale, int input_zero_point);
 
 void backward_convolutional_layer(convolutional_layer layer, network_state state);
 
@@ -11,6 +11,8 @@
 #include "dark_cuda.h"
 #include "blas.h"
 #include "connected_layer.h"
+#include "box.h"
+#include "trace.h"
 
 
 extern void predict_classifier(char *datacfg, char *cfgfile, char *weightfile, char *filename, int top);
@@ -462,6 +464,10 @@ int main(int argc, char **argv)
     }
 #endif
 
+    // -trace trace.json: spans of the loader, layers, demo and mAP threads, see trace.h
+    char *trace_file = find_char_arg(argc, argv, "-trace", 0);
+    if (trace_file) trace_init(trace_file, find_int_arg(argc, argv, "-trace_spans", 0));
+
     if (0 == strcmp(argv[1], "average")){
         average(argc, argv);
     } else if (0 == strcmp(argv[1], "yolo")){
@@ -535,6 +541,12 @@ int main(int argc, char **argv)
         visualize(argv[2], (argc > 3) ? argv[3] : 0);
     } else if (0 == strcmp(argv[1], "imtest")){
         test_resize(argv[2]);
+    } else if (0 == strcmp(argv[1], "nms")){
+        int frames = find_int_arg(argc, argv, "-frames", 20);
+        int boxes = find_int_arg(argc, argv, "-boxes", 5000);
+        int classes = find_int_arg(argc, argv, "-classes", 1);
+        float thresh = find_float_arg(argc, argv, "-iou_thresh", .45);
+        benchmark_nms(frames, boxes, classes, thresh);
     } else {
         fprintf(stderr, "Not an option: %s\n", argv[1]);
     }
@@ -1,7 +1,9 @@
 #include "data.h"
 #include "utils.h"
 #include "image.h"
+#include "data_pack.h"
 #include "dark_cuda.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -344,14 +346,17 @@ void fill_truth_region(char *path, float *truth, int classes, int num_boxes, int
 }
 
 void fill_truth_detection(const char *path, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy,
-    int net_w, int net_h)
+    int net_w, int net_h, packed_dataset *pack)
 {
     char labelpath[4096];
     replace_image_to_label(path, labelpath);
 
     int count = 0;
     int i;
-    box_label *boxes = read_boxes(labelpath, &count);
+    box_label *boxes;
+    packed_record *record = pack ? find_packed_record(pack, path) : NULL;
+    if (record) boxes = read_packed_boxes(pack, record, &count);
+    else boxes = read_boxes(labelpath, &count);
     float lowest_w = 1.F / net_w;
     float lowest_h = 1.F / net_h;
     randomize_boxes(boxes, count);
@@ -805,19 +810,21 @@ void blend_truth(float *new_truth, int boxes, float *old_truth)
 #include "http_stream.h"
 
 data load_data_detection(int n, char **paths, int m, int w, int h, int c, int boxes, int classes, int use_flip, int use_blur, int use_mixup,
-    float jitter, float hue, float saturation, float exposure, int mini_batch, int track, int augment_speed, int letter_box, int show_imgs)
+    float jitter, float hue, float saturation, float exposure, int mini_batch, int track, int augment_speed, int letter_box, int show_imgs, packed_dataset *pack)
 {
     const int random_index = random_gen();
     c = c ? c : 3;
     char **random_paths;
     char **mixup_random_paths = NULL;
     if (track) random_paths = get_sequential_paths(paths, n, m, mini_batch, augment_speed);
+    else if (pack) random_paths = get_packed_random_paths(pack, n);
     else random_paths = get_random_paths(paths, n, m);
 
     int mixup = use_mixup ? random_gen() % 2 : 0;
     //printf("\n mixup = %d \n", mixup);
     if (mixup) {
         if (track) mixup_random_paths = get_sequential_paths(paths, n, m, mini_batch, augment_speed);
+        else if (pack) mixup_random_paths = get_packed_random_paths(pack, n);
         else mixup_random_paths = get_random_paths(paths, n, m);
     }
     int i;
@@ -841,8 +848,10 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
             const char *filename = (i_mixup) ? mixup_random_paths[i] : random_paths[i];
 
             int flag = (c >= 3);
+            packed_record *record = pack ? find_packed_record(pack, filename) : NULL;
             mat_cv *src;
-            src = load_image_mat_cv(filename, flag);
+            if (record) src = load_image_mat_cached(filename, packed_record_image(pack, record), record->image_bytes, flag);
+            else src = load_image_mat_cached(filename, NULL, 0, flag);
             if (src == NULL) {
                 if (check_mistakes) getchar();
                 continue;
@@ -914,7 +923,7 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
             float dy = ((float)ptop / oh) / sy;
 
 
-            fill_truth_detection(filename, boxes, truth, classes, flip, dx, dy, 1. / sx, 1. / sy, w, h);
+            fill_truth_detection(filename, boxes, truth, classes, flip, dx, dy, 1. / sx, 1. / sy, w, h, pack);
 
             image ai = image_data_augmentation(src, w, h, pleft, ptop, swidth, sheight, flip, dhue, dsat, dexp,
                 blur, boxes, d.y.vals[i]);
@@ -977,19 +986,21 @@ void blend_images(image new_img, float alpha, image old_img, float beta)
 }
 
 data load_data_detection(int n, char **paths, int m, int w, int h, int c, int boxes, int classes, int use_flip, int use_blur, int use_mixup, float jitter,
-    float hue, float saturation, float exposure, int mini_batch, int track, int augment_speed, int letter_box, int show_imgs)
+    float hue, float saturation, float exposure, int mini_batch, int track, int augment_speed, int letter_box, int show_imgs, packed_dataset *pack)
 {
     const int random_index = random_gen();
     c = c ? c : 3;
     char **random_paths;
     char **mixup_random_paths = NULL;
     if(track) random_paths = get_sequential_paths(paths, n, m, mini_batch, augment_speed);
+    else if (pack) random_paths = get_packed_random_paths(pack, n);
     else random_paths = get_random_paths(paths, n, m);
 
     int mixup = use_mixup ? random_gen() % 2 : 0;
     //printf("\n mixup = %d \n", mixup);
     if (mixup) {
         if (track) mixup_random_paths = get_sequential_paths(paths, n, m, mini_batch, augment_speed);
+        else if (pack) mixup_random_paths = get_packed_random_paths(pack, n);
         else mixup_random_paths = get_random_paths(paths, n, m);
     }
 
@@ -1013,7 +1024,10 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
             float *truth = (float*)calloc(5 * boxes, sizeof(float));
             char *filename = (i_mixup) ? mixup_random_paths[i] : random_paths[i];
 
-            image orig = load_image(filename, 0, 0, c);
+            packed_record *record = pack ? find_packed_record(pack, filename) : NULL;
+            image orig;
+            if (record) orig = load_image_stb_cached(filename, packed_record_image(pack, record), record->image_bytes, c);
+            else orig = load_image_stb_cached(filename, NULL, 0, c);
 
             int oh = orig.h;
             int ow = orig.w;
@@ -1085,7 +1099,7 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
             distort_image(sized, dhue, dsat, dexp);
             //random_distort_image(sized, hue, saturation, exposure);
 
-            fill_truth_detection(filename, boxes, truth, classes, flip, dx, dy, 1. / sx, 1. / sy, w, h);
+            fill_truth_detection(filename, boxes, truth, classes, flip, dx, dy, 1. / sx, 1. / sy, w, h, pack);
 
             if (i_mixup) {
                 image old_img = sized;
@@ -1137,11 +1151,11 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
 }
 #endif    // OPENCV
 
-void *load_thread(void *ptr)
+static void run_load_args(load_args a)
 {
+    unsigned long long span = trace_begin();
     //srand(time(0));
     //printf("Loading data: %d\n", random_gen());
-    load_args a = *(struct load_args*)ptr;
     if(a.exposure == 0) a.exposure = 1;
     if(a.saturation == 0) a.saturation = 1;
     if(a.aspect == 0) a.aspect = 1;
@@ -1158,7 +1172,7 @@ void *load_thread(void *ptr)
         *a.d = load_data_region(a.n, a.paths, a.m, a.w, a.h, a.num_boxes, a.classes, a.jitter, a.hue, a.saturation, a.exposure);
     } else if (a.type == DETECTION_DATA){
         *a.d = load_data_detection(a.n, a.paths, a.m, a.w, a.h, a.c, a.num_boxes, a.classes, a.flip, a.blur, a.mixup, a.jitter,
-            a.hue, a.saturation, a.exposure, a.mini_batch, a.track, a.augment_speed, a.letter_box, a.show_imgs);
+            a.hue, a.saturation, a.exposure, a.mini_batch, a.track, a.augment_speed, a.letter_box, a.show_imgs, a.pack);
     } else if (a.type == SWAG_DATA){
         *a.d = load_data_swag(a.paths, a.n, a.classes, a.jitter);
     } else if (a.type == COMPARE_DATA){
@@ -1172,6 +1186,12 @@ void *load_thread(void *ptr)
     } else if (a.type == TAG_DATA){
         *a.d = load_data_tag(a.paths, a.n, a.m, a.classes, a.flip, a.min, a.max, a.size, a.angle, a.aspect, a.hue, a.saturation, a.exposure);
     }
+    trace_end((a.type == IMAGE_DATA || a.type == LETTERBOX_DATA) ? "load image" : "load batch", span);
+}
+
+void *load_thread(void *ptr)
+{
+    run_load_args(*(struct load_args*)ptr);
     free(ptr);
     return 0;
 }
@@ -1185,6 +1205,19 @@ pthread_t load_data_in_thread(load_args args)
     return thread;
 }
 
+// concatenates the rows of n partial batches and frees their row arrays
+static data merge_datas(data *buffers, int n)
+{
+    int i;
+    data out = concat_datas(buffers, n);
+    out.shallow = 0;
+    for(i = 0; i < n; ++i){
+        buffers[i].shallow = 1;
+        free_data(buffers[i]);
+    }
+    return out;
+}
+
 void *load_threads(void *ptr)
 {
     //srand(time(0));
@@ -1204,12 +1237,7 @@ void *load_threads(void *ptr)
     for(i = 0; i < args.threads; ++i){
         pthread_join(threads[i], 0);
     }
-    *out = concat_datas(buffers, args.threads);
-    out->shallow = 0;
-    for(i = 0; i < args.threads; ++i){
-        buffers[i].shallow = 1;
-        free_data(buffers[i]);
-    }
+    *out = merge_datas(buffers, args.threads);
     free(buffers);
     free(threads);
     return 0;
@@ -1224,6 +1252,140 @@ pthread_t load_data(load_args args)
     return thread;
 }
 
+static thread_pool *load_pool;
+static pthread_mutex_t load_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// created on first use and kept for the life of the process, so training,
+// mAP validation and testing all reuse the same workers
+thread_pool *get_load_pool()
+{
+    pthread_mutex_lock(&load_pool_mutex);
+    if (!load_pool) load_pool = make_thread_pool(get_num_cpus() < 2 ? 2 : get_num_cpus());
+    pthread_mutex_unlock(&load_pool_mutex);
+    return load_pool;
+}
+
+static void load_args_task(void *arg, int worker)
+{
+    run_load_args(*(load_args*)arg);
+}
+
+void start_load_job(load_job *job, load_args args)
+{
+    job->args = args;
+    pool_group_init(&job->group);
+    thread_pool_submit(get_load_pool(), load_args_task, &job->args, &job->group);
+}
+
+void wait_load_job(load_job *job)
+{
+    pool_group_wait(&job->group);
+    pool_group_free(&job->group);
+}
+
+// one batch in flight: the per-task args and partial results are allocated
+// once and reused for every batch that goes through this slot
+typedef struct load_slot {
+    pool_group group;
+    load_args *args;
+    data *parts;
+    int n;
+    int capacity;
+} load_slot;
+
+struct data_loader {
+    load_args args;
+    load_slot *slots;
+    int prefetch;
+    int head;
+};
+
+static void start_load_slot(data_loader *dl, load_slot *s)
+{
+    int i;
+    load_args args = dl->args;
+    if (args.threads < 1) args.threads = 1;
+    if (args.threads > s->capacity) {
+        s->args = (load_args*)realloc(s->args, args.threads * sizeof(load_args));
+        s->parts = (data*)realloc(s->parts, args.threads * sizeof(data));
+        if (!s->args || !s->parts) error("data_loader: realloc failed");
+        s->capacity = args.threads;
+    }
+    s->n = args.threads;
+    thread_pool *pool = get_load_pool();
+    for (i = 0; i < s->n; ++i) {
+        s->args[i] = args;
+        s->args[i].d = s->parts + i;
+        s->args[i].n = (i + 1) * args.n / s->n - i * args.n / s->n;
+        thread_pool_submit(pool, load_args_task, s->args + i, &s->group);
+    }
+}
+
+static void discard_load_slot(load_slot *s)
+{
+    int i;
+    pool_group_wait(&s->group);
+    for (i = 0; i < s->n; ++i) free_data(s->parts[i]);
+    s->n = 0;
+}
+
+data_loader *make_data_loader(load_args args, int prefetch)
+{
+    int i;
+    if (prefetch < 1) prefetch = 1;
+    data_loader *dl = (data_loader*)calloc(1, sizeof(data_loader));
+    dl->args = args;
+    dl->prefetch = prefetch;
+    dl->slots = (load_slot*)calloc(prefetch, sizeof(load_slot));
+    for (i = 0; i < prefetch; ++i) {
+        pool_group_init(&dl->slots[i].group);
+        start_load_slot(dl, dl->slots + i);
+    }
+    return dl;
+}
+
+// blocks until the oldest batch is ready and queues a new one in its place
+data data_loader_next(data_loader *dl)
+{
+    load_slot *s = dl->slots + dl->head;
+    unsigned long long span = trace_begin();
+    pool_group_wait(&s->group);
+    trace_end("wait for batch", span);
+    data d = merge_datas(s->parts, s->n);
+    start_load_slot(dl, s);
+    dl->head = (dl->head + 1) % dl->prefetch;
+    return d;
+}
+
+// affects batches queued from now on; already prefetched ones are kept
+void set_data_loader_args(data_loader *dl, load_args args)
+{
+    dl->args = args;
+}
+
+// drops every prefetched batch, e.g. after the network input size changed
+void reset_data_loader(data_loader *dl, load_args args)
+{
+    int i;
+    for (i = 0; i < dl->prefetch; ++i) discard_load_slot(dl->slots + i);
+    dl->args = args;
+    dl->head = 0;
+    for (i = 0; i < dl->prefetch; ++i) start_load_slot(dl, dl->slots + i);
+}
+
+void free_data_loader(data_loader *dl)
+{
+    int i;
+    for (i = 0; i < dl->prefetch; ++i) {
+        discard_load_slot(dl->slots + i);
+        pool_group_free(&dl->slots[i].group);
+        free(dl->slots[i].args);
+        free(dl->slots[i].parts);
+    }
+    free(dl->slots);
+    free(dl);
+}
+
 data load_data_writing(char **paths, int n, int m, int w, int h, int out_w, int out_h)
 {
     if(m) paths = get_random_paths(paths, n, m);
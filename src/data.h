@@ -7,6 +7,7 @@
 #include "matrix.h"
 #include "list.h"
 #include "image.h"
+#include "thread_pool.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -82,12 +83,33 @@ pthread_t load_data(load_args args);
 
 pthread_t load_data_in_thread(load_args args);
 */
+
+// One load_args request (usually IMAGE_DATA or LETTERBOX_DATA) running on the
+// shared loader pool; start/wait replace pthread_create/pthread_join.
+typedef struct load_job {
+    pool_group group;
+    load_args args;
+} load_job;
+
+// Keeps up to `prefetch` batches of `args` loading on the shared pool,
+// each split into args.threads tasks.
+typedef struct data_loader data_loader;
+
+thread_pool *get_load_pool();
+void start_load_job(load_job *job, load_args args);
+void wait_load_job(load_job *job);
+
+data_loader *make_data_loader(load_args args, int prefetch);
+data data_loader_next(data_loader *dl);
+void set_data_loader_args(data_loader *dl, load_args args);
+void reset_data_loader(data_loader *dl, load_args args);
+void free_data_loader(data_loader *dl);
 void print_letters(float *pred, int n);
 data load_data_captcha(char **paths, int n, int m, int k, int w, int h);
 data load_data_captcha_encode(char **paths, int n, int m, int w, int h);
 data load_data_old(char **paths, int n, int m, char **labels, int k, int w, int h);
 data load_data_detection(int n, char **paths, int m, int w, int h, int c, int boxes, int classes, int use_flip, int use_blur, int use_mixup,
-    float jitter, float hue, float saturation, float exposure, int mini_batch, int track, int augment_speed, int letter_box, int show_imgs);
+    float jitter, float hue, float saturation, float exposure, int mini_batch, int track, int augment_speed, int letter_box, int show_imgs, packed_dataset *pack);
 data load_data_tag(char **paths, int n, int m, int k, int use_flip, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure);
 matrix load_image_augment_paths(char **paths, int n, int use_flip, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure);
 data load_data_super(char **paths, int n, int m, int w, int h, int scale);
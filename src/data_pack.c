@@ -0,0 +1,323 @@
+#include "data_pack.h"
+#include "data.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define PACK_MAGIC 0x31505344   // "DSP1"
+#define PACK_VERSION 1
+
+static pthread_mutex_t pack_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void shard_name(const char *filename, int shard, char *buff, size_t size)
+{
+    snprintf(buff, size, "%s.%03d", filename, shard);
+}
+
+static unsigned int hash_path(const char *path)
+{
+    unsigned int h = 5381;
+    while (*path) h = h * 33 + (unsigned char)*path++;
+    return h;
+}
+
+static unsigned char *read_whole_file(const char *filename, size_t *size)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *buf = (len > 0) ? (unsigned char*)malloc(len) : NULL;
+    if (buf && fread(buf, 1, len, fp) != (size_t)len) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    *size = buf ? (size_t)len : 0;
+    return buf;
+}
+
+int is_packed_dataset(const char *filename)
+{
+    unsigned int magic = 0;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return 0;
+    if (fread(&magic, sizeof(magic), 1, fp) != 1) magic = 0;
+    fclose(fp);
+    return magic == PACK_MAGIC;
+}
+
+// Records are shuffled before writing, so every shard is a random mix of
+// the list and a batch can be drawn from a single shard.
+void pack_dataset(char **paths, int n, const char *filename, size_t shard_bytes)
+{
+    int i;
+    char buff[4096];
+    int *order = (int*)calloc(n, sizeof(int));
+    packed_record *records = (packed_record*)calloc(n, sizeof(packed_record));
+    for (i = 0; i < n; ++i) order[i] = i;
+    for (i = n - 1; i > 0; --i) {
+        int j = random_gen() % (i + 1);
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    int count = 0, shard = 0;
+    size_t shard_used = 0, total = 0;
+    shard_name(filename, shard, buff, sizeof(buff));
+    FILE *fp = fopen(buff, "wb");
+    if (!fp) file_error(buff);
+    for (i = 0; i < n; ++i) {
+        char *path = paths[order[i]];
+        size_t image_bytes;
+        unsigned char *image_data = read_whole_file(path, &image_bytes);
+        if (!image_data) {
+            printf(" Can't read %s, skipped \n", path);
+            continue;
+        }
+        char labelpath[4096];
+        replace_image_to_label(path, labelpath);
+        int nboxes = 0;
+        box_label *boxes = read_boxes(labelpath, &nboxes);
+
+        size_t bytes = image_bytes + nboxes * sizeof(packed_box);
+        if (shard_used && shard_used + bytes > shard_bytes) {
+            fclose(fp);
+            shard_name(filename, ++shard, buff, sizeof(buff));
+            fp = fopen(buff, "wb");
+            if (!fp) file_error(buff);
+            shard_used = 0;
+        }
+
+        packed_record *r = records + count++;
+        r->path = path;
+        r->shard = shard;
+        r->offset = shard_used;
+        r->image_bytes = image_bytes;
+        r->nboxes = nboxes;
+
+        int k;
+        fwrite(image_data, 1, image_bytes, fp);
+        for (k = 0; k < nboxes; ++k) {
+            packed_box b;
+            b.id = boxes[k].id;
+            b.x = boxes[k].x;
+            b.y = boxes[k].y;
+            b.w = boxes[k].w;
+            b.h = boxes[k].h;
+            fwrite(&b, sizeof(b), 1, fp);
+        }
+        shard_used += bytes;
+        total += bytes;
+        free(boxes);
+        free(image_data);
+        if (count % 100 == 0) printf("\r %d / %d", count, n);
+    }
+    fclose(fp);
+    if (!count) error("Nothing to pack");
+
+    fp = fopen(filename, "wb");
+    if (!fp) file_error((char*)filename);
+    unsigned int header[4] = { PACK_MAGIC, PACK_VERSION, (unsigned int)shard + 1, (unsigned int)count };
+    fwrite(header, sizeof(unsigned int), 4, fp);
+    for (i = 0; i < count; ++i) {
+        packed_record *r = records + i;
+        unsigned long long offset = r->offset;
+        unsigned long long image_bytes = r->image_bytes;
+        unsigned int fields[3] = { (unsigned int)r->shard, (unsigned int)r->nboxes, (unsigned int)strlen(r->path) };
+        fwrite(&offset, sizeof(offset), 1, fp);
+        fwrite(&image_bytes, sizeof(image_bytes), 1, fp);
+        fwrite(fields, sizeof(unsigned int), 3, fp);
+        fwrite(r->path, 1, fields[2], fp);
+    }
+    fclose(fp);
+    printf("\r Packed %d images into %d shards, %d MB: %s \n", count, shard + 1, (int)(total / (1024 * 1024)), filename);
+    free(records);
+    free(order);
+}
+
+static int map_shard(packed_dataset *pd, const char *filename, int s)
+{
+    char buff[4096];
+    shard_name(filename, s, buff, sizeof(buff));
+#ifndef _WIN32
+    int fd = open(buff, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return 0;
+    }
+    pd->shard_size[s] = st.st_size;
+    void *p = st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) return 0;
+    pd->shard_data[s] = (unsigned char*)p;
+    pd->mapped = 1;
+#else
+    pd->shard_data[s] = read_whole_file(buff, &pd->shard_size[s]);
+    if (!pd->shard_data[s]) return 0;
+#endif
+    return 1;
+}
+
+packed_dataset *open_packed_dataset(const char *filename)
+{
+    int i;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) file_error((char*)filename);
+    unsigned int header[4];
+    if (fread(header, sizeof(unsigned int), 4, fp) != 4 || header[0] != PACK_MAGIC) {
+        fclose(fp);
+        return NULL;
+    }
+    if (header[1] != PACK_VERSION) error("Unsupported packed dataset version");
+
+    packed_dataset *pd = (packed_dataset*)calloc(1, sizeof(packed_dataset));
+    pd->nshards = header[2];
+    pd->n = header[3];
+    pd->records = (packed_record*)calloc(pd->n, sizeof(packed_record));
+    pd->paths = (char**)calloc(pd->n, sizeof(char*));
+    for (i = 0; i < pd->n; ++i) {
+        packed_record *r = pd->records + i;
+        unsigned long long offset, image_bytes;
+        unsigned int fields[3];
+        if (fread(&offset, sizeof(offset), 1, fp) != 1 ||
+            fread(&image_bytes, sizeof(image_bytes), 1, fp) != 1 ||
+            fread(fields, sizeof(unsigned int), 3, fp) != 3) error("Truncated packed dataset index");
+        r->offset = offset;
+        r->image_bytes = image_bytes;
+        r->shard = fields[0];
+        r->nboxes = fields[1];
+        r->path = (char*)calloc(fields[2] + 1, sizeof(char));
+        if (fread(r->path, 1, fields[2], fp) != fields[2]) error("Truncated packed dataset index");
+        if (r->shard >= pd->nshards || (i && r->shard < pd->records[i - 1].shard)) error("Corrupted packed dataset index");
+        pd->paths[i] = r->path;
+    }
+    fclose(fp);
+
+    pd->shard_data = (unsigned char**)calloc(pd->nshards, sizeof(unsigned char*));
+    pd->shard_size = (size_t*)calloc(pd->nshards, sizeof(size_t));
+    pd->shard_first = (int*)calloc(pd->nshards + 1, sizeof(int));
+    for (i = 0; i < pd->nshards; ++i) {
+        if (!map_shard(pd, filename, i)) {
+            char buff[4096];
+            shard_name(filename, i, buff, sizeof(buff));
+            file_error(buff);
+        }
+    }
+    // records are sorted by shard: the prefix sum of the counts is each shard's first record
+    for (i = 0; i < pd->n; ++i) ++pd->shard_first[pd->records[i].shard + 1];
+    for (i = 0; i < pd->nshards; ++i) pd->shard_first[i + 1] += pd->shard_first[i];
+    for (i = 0; i < pd->n; ++i) {
+        packed_record *r = pd->records + i;
+        if (r->offset + r->image_bytes + r->nboxes * sizeof(packed_box) > pd->shard_size[r->shard]) error("Corrupted packed dataset shard");
+    }
+
+    pd->table_size = 1;
+    while (pd->table_size < 2 * pd->n) pd->table_size *= 2;
+    pd->table = (int*)calloc(pd->table_size, sizeof(int));
+    for (i = 0; i < pd->table_size; ++i) pd->table[i] = -1;
+    for (i = 0; i < pd->n; ++i) {
+        unsigned int k = hash_path(pd->records[i].path) & (pd->table_size - 1);
+        while (pd->table[k] >= 0) k = (k + 1) & (pd->table_size - 1);
+        pd->table[k] = i;
+    }
+    printf(" Packed dataset: %d images in %d shards \n", pd->n, pd->nshards);
+    return pd;
+}
+
+void free_packed_dataset(packed_dataset *pd)
+{
+    int i;
+    if (!pd) return;
+    for (i = 0; i < pd->nshards; ++i) {
+#ifndef _WIN32
+        if (pd->shard_data[i]) munmap(pd->shard_data[i], pd->shard_size[i]);
+#else
+        free(pd->shard_data[i]);
+#endif
+    }
+    for (i = 0; i < pd->n; ++i) free(pd->records[i].path);
+    free(pd->records);
+    free(pd->paths);
+    free(pd->shard_data);
+    free(pd->shard_size);
+    free(pd->shard_first);
+    free(pd->table);
+    free(pd);
+}
+
+packed_record *find_packed_record(packed_dataset *pd, const char *path)
+{
+    unsigned int k = hash_path(path) & (pd->table_size - 1);
+    while (pd->table[k] >= 0) {
+        packed_record *r = pd->records + pd->table[k];
+        if (!strcmp(r->path, path)) return r;
+        k = (k + 1) & (pd->table_size - 1);
+    }
+    return NULL;
+}
+
+const unsigned char *packed_record_image(packed_dataset *pd, packed_record *r)
+{
+    return pd->shard_data[r->shard] + r->offset;
+}
+
+box_label *read_packed_boxes(packed_dataset *pd, packed_record *r, int *n)
+{
+    int i;
+    const unsigned char *src = packed_record_image(pd, r) + r->image_bytes;
+    box_label *boxes = (box_label*)calloc(r->nboxes ? r->nboxes : 1, sizeof(box_label));
+    for (i = 0; i < r->nboxes; ++i) {
+        packed_box b;
+        memcpy(&b, src + i * sizeof(packed_box), sizeof(packed_box));
+        boxes[i].id = b.id;
+        boxes[i].x = b.x;
+        boxes[i].y = b.y;
+        boxes[i].w = b.w;
+        boxes[i].h = b.h;
+        boxes[i].left = b.x - b.w / 2;
+        boxes[i].right = b.x + b.w / 2;
+        boxes[i].top = b.y - b.h / 2;
+        boxes[i].bottom = b.y + b.h / 2;
+    }
+    *n = r->nboxes;
+    return boxes;
+}
+
+char **get_packed_random_paths(packed_dataset *pd, int n)
+{
+    int i;
+    char **random_paths = (char**)calloc(n, sizeof(char*));
+    pthread_mutex_lock(&pack_mutex);
+    // shard_first[] is the prefix sum of the record counts: picking a record and taking its
+    // shard weights the shards by size, so a short last shard isn't oversampled
+    const int record = random_gen() % pd->n;
+    int lo = 0, hi = pd->nshards - 1;
+    while (lo < hi) {
+        const int mid = (lo + hi + 1) / 2;
+        if (pd->shard_first[mid] <= record) lo = mid;
+        else hi = mid - 1;
+    }
+    const int s = lo;
+    int first = pd->shard_first[s];
+    int count = pd->shard_first[s + 1] - first;
+    for (i = 0; i < n; ++i) random_paths[i] = pd->paths[first + random_gen() % count];
+    pthread_mutex_unlock(&pack_mutex);
+#ifndef _WIN32
+    // the whole shard is about to be touched; let the kernel read it ahead
+    if (pd->mapped) madvise(pd->shard_data[s], pd->shard_size[s], MADV_WILLNEED);
+#endif
+    return random_paths;
+}
@@ -0,0 +1,52 @@
+#ifndef DATA_PACK_H
+#define DATA_PACK_H
+#include <stddef.h>
+#include "darknet.h"
+
+// Packed training set written by `detector pack`: an index file plus
+// shards "<index>.000", "<index>.001", ... Each shard record holds the
+// encoded image file as-is followed by its labels as packed_box entries.
+typedef struct packed_box {
+    int id;
+    float x, y, w, h;
+} packed_box;
+
+typedef struct packed_record {
+    char *path;     // original image path, used as the sample key
+    int shard;
+    size_t offset;
+    size_t image_bytes;
+    int nboxes;
+} packed_record;
+
+struct packed_dataset {
+    char **paths;
+    packed_record *records;
+    int n;
+    int nshards;
+    unsigned char **shard_data;
+    size_t *shard_size;
+    int *shard_first;   // shard_first[s] .. shard_first[s+1]-1 are the records of shard s
+    int *table;         // open-addressing path -> record index
+    int table_size;
+    int mapped;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+int is_packed_dataset(const char *filename);
+void pack_dataset(char **paths, int n, const char *filename, size_t shard_bytes);
+packed_dataset *open_packed_dataset(const char *filename);
+void free_packed_dataset(packed_dataset *pd);
+
+packed_record *find_packed_record(packed_dataset *pd, const char *path);
+const unsigned char *packed_record_image(packed_dataset *pd, packed_record *r);
+box_label *read_packed_boxes(packed_dataset *pd, packed_record *r, int *n);
+
+// n sample paths drawn from one randomly chosen shard
+char **get_packed_random_paths(packed_dataset *pd, int n);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -7,6 +7,8 @@
 #include "box.h"
 #include "image.h"
 #include "demo.h"
+#include "trace.h"
+#include "spsc_ring.h"
 #ifdef WIN32
 #include <time.h>
 #include "gettimeofday.h"
@@ -19,81 +21,167 @@
 
 #include "http_stream.h"
 
+// The demo is a pipeline of persistent threads, one per stage:
+//   capture -> preprocess -> infer -> postprocess -> render (main thread)
+// connected by single-producer single-consumer rings. A fixed set of frames
+// circulates through it and back from render to capture, so nothing is
+// allocated or spawned per frame. A frame belongs to the one stage that has
+// popped it; the frames in flight are limited by the pipeline depth.
+enum { DEMO_CAPTURE, DEMO_PREPROCESS, DEMO_INFER, DEMO_POSTPROCESS, DEMO_RENDER, DEMO_STAGES };
+
+static const char *demo_stage_names[DEMO_STAGES] = { "capture", "preprocess", "infer", "postprocess", "render" };
+
+typedef struct demo_frame {
+    mat_cv *mat;        // the captured frame, the boxes are drawn on it
+    image input;        // network input, or the whole frame when tiling
+    detection_buffer dets_buffer;
+    detection *dets;
+    int nboxes;
+    long long id;
+    int eos;            // end of stream: carries no picture, every stage passes it on and exits
+    double start[DEMO_STAGES], end[DEMO_STAGES];  // get_time_point(), us
+} demo_frame;
+
+typedef struct demo_stage {
+    int index;
+    void (*run)(demo_frame *f);
+    spsc_ring *in, *out;
+    pthread_t thread;
+} demo_stage;
+
+typedef struct demo_stats {
+    double busy[DEMO_STAGES];   // ms spent in each stage
+    double latency;             // ms from the start of capture to the end of render
+    int count;
+} demo_stats;
+
 static char **demo_names;
 static image **demo_alphabet;
 static int demo_classes;
 
-static int nboxes = 0;
-static detection *dets = NULL;
-
 static network net;
-static image in_s ;
-static image det_s;
-
 static cap_cv *cap;
-static float fps = 0;
 static float demo_thresh = 0;
 static int demo_ext_output = 0;
 static long long int frame_id = 0;
 static int demo_json_port = -1;
 
-#define NFRAMES 3
-
-static float* predictions[NFRAMES];
-static int demo_index = 0;
-static image images[NFRAMES];
-static mat_cv* cv_images[NFRAMES];
-static float *avg;
-
-mat_cv* in_img;
-mat_cv* det_img;
-mat_cv* show_img;
-
 static volatile int flag_exit;
 static int letter_box = 0;
+static int demo_tile = 0;
+static int demo_tile_overlap = 0;
+static int demo_depth = 6;
 
-void *fetch_in_thread(void *ptr)
+void set_demo_tiling(int tile, int overlap)
 {
-    int dont_close_stream = 0;    // set 1 if your IP-camera periodically turns off and turns on video-stream
-    if(letter_box)
-        in_s = get_image_from_stream_letterbox(cap, net.w, net.h, net.c, &in_img, dont_close_stream);
-    else
-        in_s = get_image_from_stream_resize(cap, net.w, net.h, net.c, &in_img, dont_close_stream);
-    if(!in_s.data){
-        printf("Stream closed.\n");
-        flag_exit = 1;
-        //exit(EXIT_FAILURE);
-        return 0;
-    }
-    //in_s = resize_image(in, net.w, net.h);
-
-    return 0;
+    demo_tile = tile;
+    demo_tile_overlap = overlap;
 }
 
-void *detect_in_thread(void *ptr)
+void set_demo_pipeline_depth(int depth)
 {
-    layer l = net.layers[net.n-1];
-    float *X = det_s.data;
-    float *prediction = network_predict(net, X);
-
-    memcpy(predictions[demo_index], prediction, l.outputs*sizeof(float));
-    mean_arrays(predictions, NFRAMES, l.outputs, avg);
-    l.output = avg;
+    if (depth > 0) demo_depth = depth;
+}
 
-    free_image(det_s);
+static void capture_frame(demo_frame *f)
+{
+    if (flag_exit) {
+        f->eos = 1;
+        return;
+    }
+    f->mat = get_stream_frame_cv(cap, frame_id ? 0 : 100);  // the first frames of a webcam may be empty
+    if (!f->mat) {
+        printf("Stream closed.\n");
+        f->eos = 1;
+        return;
+    }
+    if (!frame_id) printf("Video stream: %d x %d \n", get_width_mat(f->mat), get_height_mat(f->mat));
+    f->id = ++frame_id;
+}
 
-    cv_images[demo_index] = det_img;
-    det_img = cv_images[(demo_index + NFRAMES / 2 + 1) % NFRAMES];
-    demo_index = (demo_index + 1) % NFRAMES;
+static void preprocess_frame(demo_frame *f)
+{
+    const int w = demo_tile ? get_width_mat(f->mat) : net.w;
+    const int h = demo_tile ? get_height_mat(f->mat) : net.h;
+    if (f->input.w != w || f->input.h != h) {
+        free_image(f->input);
+        f->input = make_image(w, h, net.c);
+    }
+    mat_to_image_resize_cv(f->mat, f->input, letter_box && !demo_tile);
+}
 
+static void infer_frame(demo_frame *f)
+{
+    if (demo_tile) {
+        // boxes of the whole frame, merged across the tile seams
+        f->dets = network_predict_tiled(&net, f->input, demo_tile_overlap, demo_thresh, demo_thresh, .45, &f->nboxes, &f->dets_buffer);
+        return;
+    }
+    network_predict(net, f->input.data);
+    // decoded here: the outputs of the network are overwritten by the next frame
     if (letter_box)
-        dets = get_network_boxes(&net, get_width_mat(in_img), get_height_mat(in_img), demo_thresh, demo_thresh, 0, 1, &nboxes, 1); // letter box
+        f->dets = get_network_boxes_into(&net, get_width_mat(f->mat), get_height_mat(f->mat), demo_thresh, demo_thresh, 0, 1, &f->nboxes, 1, &f->dets_buffer); // letter box
     else
-        dets = get_network_boxes(&net, net.w, net.h, demo_thresh, demo_thresh, 0, 1, &nboxes, 0); // resized
+        f->dets = get_network_boxes_into(&net, net.w, net.h, demo_thresh, demo_thresh, 0, 1, &f->nboxes, 0, &f->dets_buffer); // resized
+}
+
+static void postprocess_frame(demo_frame *f)
+{
+    float nms = .45;    // 0.4F
+    //if (nms) do_nms_obj(f->dets, f->nboxes, demo_classes, nms);    // bad results
+    if (nms && !demo_tile) do_nms_sort(f->dets, f->nboxes, demo_classes, nms);
+
+    printf("Objects:\n\n");
+    if (demo_json_port > 0) {
+        int timeout = 400000;
+        send_json(f->dets, f->nboxes, demo_classes, demo_names, f->id, demo_json_port, timeout);
+    }
+    draw_detections_cv_v3(f->mat, f->dets, f->nboxes, demo_thresh, demo_names, demo_alphabet, demo_classes, demo_ext_output);
+}
 
+static void *demo_stage_thread(void *ptr)
+{
+    demo_stage *s = (demo_stage *)ptr;
+    char name[32];
+    sprintf(name, "demo %s", demo_stage_names[s->index]);
+    trace_thread_name(name);
+#ifdef GPU
+    if (s->index == DEMO_INFER && gpu_index >= 0) cuda_set_device(gpu_index);
+#endif
+    while (1) {
+        demo_frame *f = (demo_frame *)spsc_ring_pop(s->in);
+        if (!f->eos) {
+            unsigned long long span = trace_begin();
+            f->start[s->index] = get_time_point();
+            s->run(f);
+            f->end[s->index] = get_time_point();
+            trace_end(demo_stage_names[s->index], span);
+        }
+        const int eos = f->eos;
+        spsc_ring_push(s->out, f);
+        if (eos) break;
+    }
     return 0;
 }
 
+static void add_demo_stats(demo_stats *st, demo_frame *f)
+{
+    int i;
+    for (i = 0; i < DEMO_STAGES; ++i) st->busy[i] += (f->end[i] - f->start[i]) / 1000;
+    st->latency += (f->end[DEMO_RENDER] - f->start[DEMO_CAPTURE]) / 1000;
+    ++st->count;
+}
+
+// mean ms per frame in each stage; the slowest one sets the frame rate
+static void print_demo_stats(demo_stats *st)
+{
+    int i;
+    if (!st->count) return;
+    printf("\n Pipeline, ms per frame:");
+    for (i = 0; i < DEMO_STAGES; ++i) printf(" %s %.1f,", demo_stage_names[i], st->busy[i] / st->count);
+    printf(" latency %.1f \n", st->latency / st->count);
+}
+
 double get_wall_time()
 {
     struct timeval walltime;
@@ -107,7 +195,6 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
     int frame_skip, char *prefix, char *out_filename, int mjpeg_port, int json_port, int dont_show, int ext_output, int letter_box_in)
 {
     letter_box = letter_box_in;
-    in_img = det_img = show_img = NULL;
     //skip = frame_skip;
     image **alphabet = load_alphabet();
     int delay = frame_skip;
@@ -124,6 +211,7 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
     }
     fuse_conv_batchnorm(net);
     calculate_binary_weights(net);
+    plan_network_memory(&net);
     srand(2222222);
 
     if(filename){
@@ -142,11 +230,7 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
     }
 
     layer l = net.layers[net.n-1];
-    int j;
-
-    avg = (float *) calloc(l.outputs, sizeof(float));
-    for(j = 0; j < NFRAMES; ++j) predictions[j] = (float *) calloc(l.outputs, sizeof(float));
-    for(j = 0; j < NFRAMES; ++j) images[j] = make_image(1,1,3);
+    int i, j;
 
     if (l.classes != demo_classes) {
         printf("Parameters don't match: in cfg-file classes=%d, in data-file classes=%d \n", l.classes, demo_classes);
@@ -154,137 +238,107 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
         exit(0);
     }
 
-
     flag_exit = 0;
-
-    pthread_t fetch_thread;
-    pthread_t detect_thread;
-
-    fetch_in_thread(0);
-    det_img = in_img;
-    det_s = in_s;
-
-    fetch_in_thread(0);
-    detect_in_thread(0);
-    det_img = in_img;
-    det_s = in_s;
-
-    for (j = 0; j < NFRAMES / 2; ++j) {
-        fetch_in_thread(0);
-        detect_in_thread(0);
-        det_img = in_img;
-        det_s = in_s;
+    frame_id = 0;
+
+    // rings[i] leads into stage i; rings[DEMO_CAPTURE] returns the rendered frames
+    spsc_ring rings[DEMO_STAGES];
+    demo_frame *frames = (demo_frame *)calloc(demo_depth, sizeof(demo_frame));
+    for (i = 0; i < DEMO_STAGES; ++i) spsc_ring_init(&rings[i], demo_depth);
+    for (j = 0; j < demo_depth; ++j) spsc_ring_push(&rings[DEMO_CAPTURE], &frames[j]);
+    printf(" Pipeline depth: %d frames \n", demo_depth);
+
+    void (*stage_run[DEMO_RENDER])(demo_frame *) = { capture_frame, preprocess_frame, infer_frame, postprocess_frame };
+    demo_stage stages[DEMO_RENDER];
+    for (i = 0; i < DEMO_RENDER; ++i) {
+        stages[i].index = i;
+        stages[i].run = stage_run[i];
+        stages[i].in = &rings[i];
+        stages[i].out = &rings[i + 1];
+        if (pthread_create(&stages[i].thread, 0, demo_stage_thread, &stages[i])) error("Thread creation failed");
     }
 
-    int count = 0;
     if(!prefix && !dont_show){
         int full_screen = 0;
         create_window_cv("Demo", full_screen, 1352, 1013);
     }
 
-
     write_cv* output_video_writer = NULL;
-    if (out_filename && !flag_exit)
-    {
-        int src_fps = 25;
-        src_fps = get_stream_fps_cpp_cv(cap);
-        output_video_writer =
-            create_video_writer(out_filename, 'D', 'I', 'V', 'X', src_fps, get_width_mat(det_img), get_height_mat(det_img), 1);
-
-        //'H', '2', '6', '4'
-        //'D', 'I', 'V', 'X'
-        //'M', 'J', 'P', 'G'
-        //'M', 'P', '4', 'V'
-        //'M', 'P', '4', '2'
-        //'X', 'V', 'I', 'D'
-        //'W', 'M', 'V', '2'
-    }
-
-    double before = get_wall_time();
+    demo_stats stats = { { 0 } };
+    float fps = 0;
+    int count = 0;
+    double before = get_time_point();
 
     while(1){
+        demo_frame *f = (demo_frame *)spsc_ring_pop(&rings[DEMO_RENDER]);
+        if (f->eos) break;
         ++count;
-        {
-            if(pthread_create(&fetch_thread, 0, fetch_in_thread, 0)) error("Thread creation failed");
-            if(pthread_create(&detect_thread, 0, detect_in_thread, 0)) error("Thread creation failed");
-
-            float nms = .45;    // 0.4F
-            int local_nboxes = nboxes;
-            detection *local_dets = dets;
-
-            //if (nms) do_nms_obj(local_dets, local_nboxes, l.classes, nms);    // bad results
-            if (nms) do_nms_sort(local_dets, local_nboxes, l.classes, nms);
-
-            //printf("\033[2J");
-            //printf("\033[1;1H");
-            //printf("\nFPS:%.1f\n", fps);
-            printf("Objects:\n\n");
-
-            ++frame_id;
-            if (demo_json_port > 0) {
-                int timeout = 400000;
-                send_json(local_dets, local_nboxes, l.classes, demo_names, frame_id, demo_json_port, timeout);
-            }
-
-            draw_detections_cv_v3(show_img, local_dets, local_nboxes, demo_thresh, demo_names, demo_alphabet, demo_classes, demo_ext_output);
-            free_detections(local_dets, local_nboxes);
-
-            printf("\nFPS:%.1f\n", fps);
-
-            if(!prefix){
-                if (!dont_show) {
-                    show_image_mat(show_img, "Demo");
-                    int c = wait_key_cv(1);
-                    if (c == 10) {
-                        if (frame_skip == 0) frame_skip = 60;
-                        else if (frame_skip == 4) frame_skip = 0;
-                        else if (frame_skip == 60) frame_skip = 4;
-                        else frame_skip = 0;
-                    }
-                    else if (c == 27 || c == 1048603) // ESC - exit (OpenCV 2.x / 3.x)
-                    {
-                        flag_exit = 1;
-                    }
+        unsigned long long span = trace_begin();
+        f->start[DEMO_RENDER] = get_time_point();
+        mat_cv *show_img = (delay == 0) ? f->mat : NULL;
+
+        printf("\nFPS:%.1f\n", fps);
+
+        if(!prefix){
+            if (!dont_show && show_img) {
+                show_image_mat(show_img, "Demo");
+                int c = wait_key_cv(1);
+                if (c == 10) {
+                    if (frame_skip == 0) frame_skip = 60;
+                    else if (frame_skip == 4) frame_skip = 0;
+                    else if (frame_skip == 60) frame_skip = 4;
+                    else frame_skip = 0;
+                }
+                else if (c == 27 || c == 1048603) // ESC - exit (OpenCV 2.x / 3.x)
+                {
+                    flag_exit = 1;  // capture ends the stream, the frames in flight are still rendered
                 }
-            }else{
-                char buff[256];
-                sprintf(buff, "%s_%08d.jpg", prefix, count);
-                if(show_img) save_cv_jpg(show_img, buff);
             }
+        }else{
+            char buff[256];
+            sprintf(buff, "%s_%08d.jpg", prefix, count);
+            if(show_img) save_cv_jpg(show_img, buff);
+        }
 
-            // if you run it with param -mjpeg_port 8090  then open URL in your web-browser: http://localhost:8090
-            if (mjpeg_port > 0 && show_img) {
-                int port = mjpeg_port;
-                int timeout = 400000;
-                int jpeg_quality = 40;    // 1 - 100
-                send_mjpeg(show_img, port, timeout, jpeg_quality);
-            }
+        // if you run it with param -mjpeg_port 8090  then open URL in your web-browser: http://localhost:8090
+        if (mjpeg_port > 0 && show_img) {
+            int port = mjpeg_port;
+            int timeout = 400000;
+            int jpeg_quality = 40;    // 1 - 100
+            send_mjpeg(show_img, port, timeout, jpeg_quality);
+        }
 
-            // save video file
-            if (output_video_writer && show_img) {
-                write_frame_cv(output_video_writer, show_img);
-                printf("\n cvWriteFrame \n");
+        // save video file
+        if (out_filename && show_img) {
+            if (!output_video_writer) {
+                int src_fps = 25;
+                src_fps = get_stream_fps_cpp_cv(cap);
+                output_video_writer =
+                    create_video_writer(out_filename, 'D', 'I', 'V', 'X', src_fps, get_width_mat(show_img), get_height_mat(show_img), 1);
+
+                //'H', '2', '6', '4'
+                //'D', 'I', 'V', 'X'
+                //'M', 'J', 'P', 'G'
+                //'M', 'P', '4', 'V'
+                //'M', 'P', '4', '2'
+                //'X', 'V', 'I', 'D'
+                //'W', 'M', 'V', '2'
             }
+            write_frame_cv(output_video_writer, show_img);
+            printf("\n cvWriteFrame \n");
+        }
 
-            release_mat(&show_img);
-
-            pthread_join(fetch_thread, 0);
-            pthread_join(detect_thread, 0);
-
-            if (flag_exit == 1) break;
+        release_mat(&f->mat);
+        f->end[DEMO_RENDER] = get_time_point();
+        trace_end("render", span);
+        add_demo_stats(&stats, f);
+        if (stats.count % 100 == 0) print_demo_stats(&stats);
+        spsc_ring_push(&rings[DEMO_CAPTURE], f);
 
-            if(delay == 0){
-                show_img = det_img;
-            }
-            det_img = in_img;
-            det_s = in_s;
-        }
         --delay;
         if(delay < 0){
             delay = frame_skip;
 
-            //double after = get_wall_time();
-            //float curr = 1./(after - before);
             double after = get_time_point();    // more accurate time measurements
             float curr = 1000000. / (after - before);
             fps = curr;
@@ -292,23 +346,26 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
         }
     }
     printf("input video stream closed. \n");
+    print_demo_stats(&stats);
+    for (i = 0; i < DEMO_RENDER; ++i) pthread_join(stages[i].thread, 0);
     if (output_video_writer) {
         release_video_writer(&output_video_writer);
         printf("output_video_writer closed. \n");
     }
 
     // free memory
-    release_mat(&show_img);
-    release_mat(&in_img);
-    free_image(in_s);
-
-    free(avg);
-    for (j = 0; j < NFRAMES; ++j) free(predictions[j]);
-    for (j = 0; j < NFRAMES; ++j) free_image(images[j]);
+    for (j = 0; j < demo_depth; ++j) {
+        release_mat(&frames[j].mat);
+        free_image(frames[j].input);
+        free_detection_buffer(&frames[j].dets_buffer);
+    }
+    free(frames);
+    for (i = 0; i < DEMO_STAGES; ++i) spsc_ring_free(&rings[i]);
+    release_capture(cap);
+    cap = NULL;
 
     free_ptrs((void **)names, net.layers[net.n - 1].classes);
 
-    int i;
     const int nsize = 8;
     for (j = 0; j < nsize; ++j) {
         for (i = 32; i < 127; ++i) {
@@ -326,4 +383,12 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
 {
     fprintf(stderr, "Demo needs OpenCV for webcam images.\n");
 }
+
+void set_demo_tiling(int tile, int overlap)
+{
+}
+
+void set_demo_pipeline_depth(int depth)
+{
+}
 #endif
@@ -7,6 +7,10 @@ extern "C" {
 #endif
 void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int cam_index, const char *filename, char **names, int classes,
     int frame_skip, char *prefix, char *out_filename, int mjpeg_port, int json_port, int dont_show, int ext_output, int letter_box_in);
+// frames are detected at their own size as overlapping tiles, see network_predict_tiled()
+void set_demo_tiling(int tile, int overlap);
+// frames in flight between capture and render, 6 by default; below 5 (one per stage) the stages wait for each other
+void set_demo_pipeline_depth(int depth);
 #ifdef __cplusplus
 }
 #endif
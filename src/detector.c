@@ -3,10 +3,20 @@
 #include "region_layer.h"
 #include "cost_layer.h"
 #include "utils.h"
+#include "darkunistd.h"
+#include "image_cache.h"
+#include "data_pack.h"
 #include "parser.h"
 #include "box.h"
 #include "demo.h"
 #include "option_list.h"
+#include "convolutional_layer.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "spsc_ring.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifndef __COMPAR_FN_T
 #define __COMPAR_FN_T
@@ -22,6 +32,72 @@ int check_mistakes = 0;
 
 static int coco_ids[] = { 1,2,3,4,5,6,7,8,9,10,11,13,14,15,16,17,18,19,20,21,22,23,24,25,27,28,31,32,33,34,35,36,37,38,39,40,41,42,43,44,46,47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63,64,65,67,70,72,73,74,75,76,77,78,79,80,81,82,84,85,86,87,88,89,90 };
 
+// -map_async: a snapshot of the weights is evaluated on a background thread
+// while training goes on
+typedef struct map_job {
+    char *datacfg;
+    char *cfgfile;
+    char weightfile[256];
+    int letter_box;
+    int iteration;
+    int gpu;
+    float map;
+    int done;
+    pthread_mutex_t mutex;
+    pthread_t thread;
+} map_job;
+
+static int map_gpu = -1;    // -map_async on GPU builds: device of the evaluator, -1 - the first training GPU
+
+static float evaluate_detector_map(char *datacfg, char *cfgfile, char *weightfile, float thresh_calc_avg_iou, const float iou_thresh,
+    const int map_points, int letter_box, network *existing_net, int gpu, int background);
+
+static void *map_job_thread(void *ptr)
+{
+    map_job *j = (map_job*)ptr;
+#ifdef GPU
+    // the current device of this thread only: gpu_index belongs to the training thread
+    if (j->gpu >= 0) CHECK_CUDA(cudaSetDevice(j->gpu));
+#endif
+    float map = evaluate_detector_map(j->datacfg, j->cfgfile, j->weightfile, 0.25, 0.5, 0, j->letter_box, NULL, j->gpu, 1);
+    pthread_mutex_lock(&j->mutex);
+    j->map = map;
+    j->done = 1;
+    pthread_mutex_unlock(&j->mutex);
+    return 0;
+}
+
+static void start_map_job(map_job *j, network net, int iteration)
+{
+    save_weights(net, j->weightfile);
+    j->iteration = iteration;
+    j->done = 0;
+    printf("\n mAP of iteration %d is calculated in the background \n", iteration);
+    if (pthread_create(&j->thread, 0, map_job_thread, j)) error("Thread creation failed");
+}
+
+static int map_job_done(map_job *j)
+{
+    pthread_mutex_lock(&j->mutex);
+    int done = j->done;
+    pthread_mutex_unlock(&j->mutex);
+    return done;
+}
+
+// the snapshot becomes the best weights if it beats best_map
+static float finish_map_job(map_job *j, float *best_map, char *best_weightfile)
+{
+    pthread_join(j->thread, 0);
+    printf("\n mean_average_precision (mAP@0.5) = %f at iteration %d \n", j->map, j->iteration);
+    if (j->map > *best_map) {
+        *best_map = j->map;
+        printf("New best mAP!\n");
+        remove(best_weightfile);
+        if (rename(j->weightfile, best_weightfile)) printf(" Can't rename %s to %s \n", j->weightfile, best_weightfile);
+    }
+    return j->map;
+}
+
 void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear, int dont_show, int calc_map, int mjpeg_port, int show_imgs)
 {
     list *options = read_data_cfg(datacfg);
@@ -29,8 +105,14 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     char *valid_images = option_find_str(options, "valid", train_images);
     char *backup_directory = option_find_str(options, "backup", "/backup/");
 
+    // calc_map == 2: -map_async
+    const int map_async = (calc_map == 2);
     network net_map;
     if (calc_map) {
+        if (is_packed_dataset(valid_images)) {
+            printf("\n Error: mAP is calculated on an image list, set valid=<list> in your %s file. \n", datacfg);
+            exit(-1);
+        }
         FILE* valid_file = fopen(valid_images, "r");
         if (!valid_file) {
             printf("\n Error: There is no %s file for mAP calculation!\n Don't use -map flag.\n Or set valid=%s in your %s file. \n", valid_images, train_images, datacfg);
@@ -46,6 +128,11 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 
         int k;  // free memory unnecessary arrays
         for (k = 0; k < net_map.n - 1; ++k) free_layer(net_map.layers[k]);
+        if (map_async) {
+            // the evaluator loads its own networks from the snapshot
+            net_map.n = 0;
+            free_network(net_map);
+        }
 
         char *name_list = option_find_str(options, "names", "data/names.list");
         int names_size = 0;
@@ -92,16 +179,28 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 
     int imgs = net.batch * net.subdivisions * ngpus;
     printf("Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
-    data train, buffer;
+    data train;
 
     layer l = net.layers[net.n - 1];
 
     int classes = l.classes;
     float jitter = l.jitter;
 
-    list *plist = get_paths(train_images);
-    int train_images_num = plist->size;
-    char **paths = (char **)list_to_array(plist);
+    // train= may also point to a dataset written by `detector pack`
+    packed_dataset *pack = NULL;
+    list *plist = NULL;
+    char **paths;
+    int train_images_num;
+    if (is_packed_dataset(train_images)) {
+        pack = open_packed_dataset(train_images);
+        paths = pack->paths;
+        train_images_num = pack->n;
+    }
+    else {
+        plist = get_paths(train_images);
+        train_images_num = plist->size;
+        paths = (char **)list_to_array(plist);
+    }
 
     int init_w = net.w;
     int init_h = net.h;
@@ -112,18 +211,31 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     float mean_average_precision = -1;
     float best_map = mean_average_precision;
 
+    map_job mj = { 0 };
+    int map_running = 0;
+    char best_weightfile[256];
+    sprintf(best_weightfile, "%s/%s_best.weights", backup_directory, base);
+    if (map_async) {
+        mj.datacfg = datacfg;
+        mj.cfgfile = cfgfile;
+        mj.letter_box = net.letter_box;
+        mj.gpu = (gpu_index < 0) ? -1 : (map_gpu >= 0) ? map_gpu : gpus[0];
+        sprintf(mj.weightfile, "%s/%s_map.weights", backup_directory, base);
+        pthread_mutex_init(&mj.mutex, NULL);
+    }
+
     load_args args = { 0 };
     args.w = net.w;
     args.h = net.h;
     args.c = net.c;
     args.paths = paths;
     args.n = imgs;
-    args.m = plist->size;
+    args.m = train_images_num;
+    args.pack = pack;
     args.classes = classes;
     args.flip = net.flip;
     args.jitter = jitter;
     args.num_boxes = l.max_boxes;
-    args.d = &buffer;
     args.type = DETECTION_DATA;
     args.threads = 64;    // 16 or 64
 
@@ -156,7 +268,8 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     }
     //printf(" imgs = %d \n", imgs);
 
-    pthread_t load_thread = load_data(args);
+    // keep two batches loading on the shared pool while the network trains
+    data_loader *loader = make_data_loader(args, 2);
     double time;
     int count = 0;
     //while(i*imgs < N*120){
@@ -180,10 +293,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             args.w = dim_w;
             args.h = dim_h;
 
-            pthread_join(load_thread, 0);
-            train = buffer;
-            free_data(train);
-            load_thread = load_data(args);
+            reset_data_loader(loader, args);
 
             for (i = 0; i < ngpus; ++i) {
                 resize_network(nets + i, dim_w, dim_h);
@@ -191,14 +301,13 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             net = nets[0];
         }
         time = what_time_is_it_now();
-        pthread_join(load_thread, 0);
-        train = buffer;
+        train = data_loader_next(loader);
         if (net.track) {
             net.sequential_subdivisions = get_current_seq_subdivisions(net);
             args.threads = net.sequential_subdivisions * ngpus;
             printf(" sequential_subdivisions = %d, sequence = %d \n", net.sequential_subdivisions, get_sequence_value(net));
+            set_data_loader_args(loader, args);
         }
-        load_thread = load_data(args);
 
         /*
         int k;
@@ -220,6 +329,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
         printf("Loaded: %lf seconds\n", (what_time_is_it_now() - time));
 
         time = what_time_is_it_now();
+        unsigned long long span = trace_begin();
         float loss = 0;
 #ifdef GPU
         if (ngpus == 1) {
@@ -232,6 +342,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 #else
         loss = train_network(net, train);
 #endif
+        trace_end("train batch", span);
         if (avg_loss < 0 || avg_loss != avg_loss) avg_loss = loss;    // if(-inf or nan)
         avg_loss = avg_loss*.9 + loss*.1;
 
@@ -254,15 +365,23 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
         printf("\n %d: %f, %f avg loss, %f rate, %lf seconds, %d images\n", get_current_batch(net), loss, avg_loss, get_current_rate(net), (what_time_is_it_now() - time), i*imgs);
 
         int draw_precision = 0;
-        if (calc_map && (i >= next_map_calc || i == net.max_batches)) {
+        if (map_running && map_job_done(&mj)) {
+            mean_average_precision = finish_map_job(&mj, &best_map, best_weightfile);
+            map_running = 0;
+            draw_precision = 1;
+        }
+        // while a snapshot is being evaluated the next one waits for it
+        if (map_async && !map_running && (i >= next_map_calc || i == net.max_batches)) {
+            iter_map = i;
+            start_map_job(&mj, net, i);
+            map_running = 1;
+        }
+        else if (calc_map && !map_async && (i >= next_map_calc || i == net.max_batches)) {
             if (l.random) {
                 printf("Resizing to initial size: %d x %d \n", init_w, init_h);
                 args.w = init_w;
                 args.h = init_h;
-                pthread_join(load_thread, 0);
-                free_data(train);
-                train = buffer;
-                load_thread = load_data(args);
+                reset_data_loader(loader, args);
                 int k;
                 for (k = 0; k < ngpus; ++k) {
                     resize_network(nets + k, init_w, init_h);
@@ -281,9 +400,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             if (mean_average_precision > best_map) {
                 best_map = mean_average_precision;
                 printf("New best mAP!\n");
-                char buff[256];
-                sprintf(buff, "%s/%s_best.weights", backup_directory, base);
-                save_weights(net, buff);
+                save_weights(net, best_weightfile);
             }
 
             draw_precision = 1;
@@ -306,6 +423,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 
         if (i >= (iter_save_last + 100) || i % 100 == 0) {
             iter_save_last = i;
+            print_image_cache_stats();
 #ifdef GPU
             if (ngpus != 1) sync_nets(nets, ngpus, 0);
 #endif
@@ -324,19 +442,32 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     sprintf(buff, "%s/%s_final.weights", backup_directory, base);
     save_weights(net, buff);
 
+    if (map_running) finish_map_job(&mj, &best_map, best_weightfile);
+    if (map_async && iter_map != get_current_batch(net)) {
+        // the last snapshot was taken before the final iteration
+        start_map_job(&mj, net, get_current_batch(net));
+        finish_map_job(&mj, &best_map, best_weightfile);
+    }
+    if (map_async) {
+        remove(mj.weightfile);
+        pthread_mutex_destroy(&mj.mutex);
+    }
+
 #ifdef OPENCV
     release_mat(&img);
     destroy_all_windows_cv();
 #endif
 
     // free memory
-    pthread_join(load_thread, 0);
-    free_data(buffer);
+    free_data_loader(loader);
 
     free(base);
-    free(paths);
-    free_list_contents(plist);
-    free_list(plist);
+    if (pack) free_packed_dataset(pack);
+    else {
+        free(paths);
+        free_list_contents(plist);
+        free_list(plist);
+    }
 
     free_list_contents_kvp(options);
     free_list(options);
@@ -345,7 +476,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     free(nets);
     //free_network(net);
 
-    if (calc_map) {
+    if (calc_map && !map_async) {
         net_map.n = 0;
         free_network(net_map);
     }
@@ -498,7 +629,7 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
     image* val_resized = (image*)calloc(nthreads, sizeof(image));
     image* buf = (image*)calloc(nthreads, sizeof(image));
     image* buf_resized = (image*)calloc(nthreads, sizeof(image));
-    pthread_t* thr = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+    load_job* jobs = (load_job*)calloc(nthreads, sizeof(load_job));
 
     load_args args = { 0 };
     args.w = net.w;
@@ -511,13 +642,13 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
         args.path = paths[i + t];
         args.im = &buf[t];
         args.resized = &buf_resized[t];
-        thr[t] = load_data_in_thread(args);
+        start_load_job(&jobs[t], args);
     }
     time_t start = time(0);
     for (i = nthreads; i < m + nthreads; i += nthreads) {
         fprintf(stderr, "%d\n", i);
         for (t = 0; t < nthreads && i + t - nthreads < m; ++t) {
-            pthread_join(thr[t], 0);
+            wait_load_job(&jobs[t]);
             val[t] = buf[t];
             val_resized[t] = buf_resized[t];
         }
@@ -525,7 +656,7 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
             args.path = paths[i + t];
             args.im = &buf[t];
             args.resized = &buf_resized[t];
-            thr[t] = load_data_in_thread(args);
+            start_load_job(&jobs[t], args);
         }
         for (t = 0; t < nthreads && i + t - nthreads < m; ++t) {
             char *path = paths[i + t - nthreads];
@@ -547,7 +678,7 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
             else {
                 print_detector_detections(fps, id, dets, nboxes, classes, w, h);
             }
-            free_detections(dets, nboxes);
+            free_network_boxes(dets);
             free(id);
             free_image(val[t]);
             free_image(val_resized[t]);
@@ -565,6 +696,7 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
         fprintf(fp, "\n]\n");
         fclose(fp);
     }
+    free(jobs);
     fprintf(stderr, "Total Detection Time: %f Seconds\n", (double)time(0) - start);
 }
 
@@ -644,6 +776,767 @@ void validate_detector_recall(char *datacfg, char *cfgfile, char *weightfile)
     }
 }
 
+// compares the Winograd F(4x4,3x3) convolutions with the GEMM path on the same images
+void check_winograd_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float iou_thresh)
+{
+    network net = parse_network_cfg_custom(cfgfile, 1, 1);    // set batch=1
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    fuse_conv_batchnorm(net);
+    calculate_binary_weights(net);
+
+    list *options = read_data_cfg(datacfg);
+    char *valid_images = option_find_str(options, "valid", "data/train.txt");
+    if (filename) valid_images = filename;  // e.g. data/valid_500x.txt
+    list *plist = get_paths(valid_images);
+    char **paths = (char **)list_to_array(plist);
+    const int m = plist->size;
+
+    int i, j, k, q;
+    float **winograd_weights = (float **)calloc(net.n, sizeof(float *));
+    int winograd_layers = 0;
+    for (j = 0; j < net.n; ++j) {
+        winograd_weights[j] = net.layers[j].winograd_weights;
+        if (winograd_weights[j]) ++winograd_layers;
+    }
+    printf("\n Winograd F(4x4,3x3) is used for %d layers, checking %d images from %s \n", winograd_layers, m, valid_images);
+    if (!winograd_layers) {
+        free(winograd_weights);
+        free(paths);
+        free_list_contents(plist);
+        free_list(plist);
+        free_list_contents_kvp(options);
+        free_list(options);
+        free_network(net);
+        return;
+    }
+
+    layer l = net.layers[net.n - 1];
+    float *gemm_output = (float *)calloc(l.outputs, sizeof(float));
+    const float nms = .45;
+    double max_diff = 0, sum_diff = 0, max_value = 0;
+    double gemm_time = 0, winograd_time = 0;
+    int gemm_boxes = 0, winograd_boxes = 0, matched = 0;
+
+    for (i = 0; i < m; ++i) {
+        image im = load_image(paths[i], 0, 0, net.c);
+        image sized = resize_image(im, net.w, net.h);
+        int nboxes_gemm = 0, nboxes_winograd = 0;
+
+        for (j = 0; j < net.n; ++j) net.layers[j].winograd_weights = NULL;
+        double time = what_time_is_it_now();
+        network_predict(net, sized.data);
+        gemm_time += what_time_is_it_now() - time;
+        memcpy(gemm_output, l.output, l.outputs * sizeof(float));
+        detection *dets_gemm = get_network_boxes(&net, im.w, im.h, thresh, .5, 0, 1, &nboxes_gemm, 0);
+
+        for (j = 0; j < net.n; ++j) net.layers[j].winograd_weights = winograd_weights[j];
+        time = what_time_is_it_now();
+        network_predict(net, sized.data);
+        winograd_time += what_time_is_it_now() - time;
+        detection *dets_winograd = get_network_boxes(&net, im.w, im.h, thresh, .5, 0, 1, &nboxes_winograd, 0);
+
+        for (k = 0; k < l.outputs; ++k) {
+            const double diff = fabs(l.output[k] - gemm_output[k]);
+            if (diff > max_diff) max_diff = diff;
+            if (fabs(gemm_output[k]) > max_value) max_value = fabs(gemm_output[k]);
+            sum_diff += diff;
+        }
+
+        do_nms_sort(dets_gemm, nboxes_gemm, l.classes, nms);
+        do_nms_sort(dets_winograd, nboxes_winograd, l.classes, nms);
+        for (k = 0; k < nboxes_winograd; ++k) {
+            for (j = 0; j < l.classes; ++j) winograd_boxes += dets_winograd[k].prob[j] > thresh;
+        }
+        for (k = 0; k < nboxes_gemm; ++k) {
+            for (j = 0; j < l.classes; ++j) {
+                if (dets_gemm[k].prob[j] <= thresh) continue;
+                ++gemm_boxes;
+                for (q = 0; q < nboxes_winograd; ++q) {
+                    if (dets_winograd[q].prob[j] > thresh && box_iou(dets_gemm[k].bbox, dets_winograd[q].bbox) >= iou_thresh) {
+                        ++matched;
+                        break;
+                    }
+                }
+            }
+        }
+        printf("\r %d/%d", i + 1, m);
+        fflush(stdout);
+
+        free_network_boxes(dets_gemm);
+        free_network_boxes(dets_winograd);
+        free_image(im);
+        free_image(sized);
+    }
+
+    printf("\n output of the last layer: max |diff| = %g, mean |diff| = %g, max |value| = %g \n",
+        max_diff, sum_diff / ((double)l.outputs * m), max_value);
+    printf(" detections (thresh = %.2f): GEMM %d, Winograd %d, matched with IoU >= %.2f: %d (%.2f%%) \n",
+        thresh, gemm_boxes, winograd_boxes, iou_thresh, matched, gemm_boxes ? 100. * matched / gemm_boxes : 100.);
+    printf(" average time per image: GEMM %.1f ms, Winograd %.1f ms \n",
+        gemm_time * 1000 / m, winograd_time * 1000 / m);
+
+    free(gemm_output);
+    free(winograd_weights);
+    free(paths);
+    free_list_contents(plist);
+    free_list(plist);
+    free_list_contents_kvp(options);
+    free_list(options);
+    free_network(net);
+}
+
+// post-training INT8 quantization: records the input range of every convolutional layer over
+// the calibration images and saves the model with per-channel INT8 weights
+void calibrate_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, char *outfile)
+{
+    network net = parse_network_cfg_custom(cfgfile, 1, 1);    // set batch=1
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    if (net.weights_map) error("calibrate: quantize the .weights file, not .dsw");
+    fuse_conv_batchnorm(net);
+
+    list *options = read_data_cfg(datacfg);
+    char *valid_images = option_find_str(options, "valid", "data/train.txt");
+    char *backup_directory = option_find_str(options, "backup", "/backup/");
+    if (filename) valid_images = filename;  // e.g. data/valid_1_20.txt
+    list *plist = get_paths(valid_images);
+    char **paths = (char **)list_to_array(plist);
+    const int m = plist->size;
+
+    int i, j, k;
+    float *input_min = (float *)calloc(net.n, sizeof(float));
+    float *input_max = (float *)calloc(net.n, sizeof(float));
+    int *quantize = (int *)calloc(net.n, sizeof(int));
+    for (j = 0; j < net.n; ++j) {
+        // the layer in front of the detection layer stays FP32: its output is decoded directly
+        const LAYER_TYPE next = (j + 1 < net.n) ? net.layers[j + 1].type : BLANK;
+        quantize[j] = can_quantize_convolutional_layer(net.layers[j]) && next != YOLO && next != REGION && next != DETECTION;
+    }
+
+    printf("\n Calibrating on %d images from %s \n", m, valid_images);
+    for (i = 0; i < m; ++i) {
+        image im = load_image(paths[i], 0, 0, net.c);
+        image sized = resize_image(im, net.w, net.h);
+        network_predict(net, sized.data);
+        for (j = 0; j < net.n; ++j) {
+            if (!quantize[j]) continue;
+            const float *input = j ? net.layers[j - 1].output : sized.data;
+            for (k = 0; k < net.layers[j].inputs; ++k) {
+                if (input[k] < input_min[j]) input_min[j] = input[k];
+                if (input[k] > input_max[j]) input_max[j] = input[k];
+            }
+        }
+        printf("\r %d/%d", i + 1, m);
+        fflush(stdout);
+        free_image(im);
+        free_image(sized);
+    }
+    printf("\n");
+
+    for (j = 0; j < net.n; ++j) {
+        layer *l = &net.layers[j];
+        if (!quantize[j] || !m) continue;
+        quantize_convolutional_layer(l, input_min[j], input_max[j]);
+        printf(" %3d conv %4d %2d x%2d/%2d  input [%10.5f, %10.5f]  scale %.6f  zero point %3d \n",
+            j, l->n, l->size, l->size, l->stride, input_min[j], input_max[j], l->input_int8_scale, l->input_int8_zero_point);
+    }
+
+    char buff[256];
+    if (!outfile) {
+        char *base = basecfg(cfgfile);
+        sprintf(buff, "%s/%s_int8.weights", backup_directory, base);
+        free(base);
+        outfile = buff;
+    }
+    save_weights_int8(net, outfile);
+
+    free(quantize);
+    free(input_min);
+    free(input_max);
+    free(paths);
+    free_list_contents(plist);
+    free_list(plist);
+    free_list_contents_kvp(options);
+    free_list(options);
+    free_network(net);
+}
+
+// writes the fused (and Winograd-transformed) model as .dsw, which load_weights() maps in one mmap()
+void export_detector(char *datacfg, char *cfgfile, char *weightfile, char *outfile, int winograd)
+{
+    network net = parse_network_cfg_custom(cfgfile, 1, 1);    // set batch=1
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    fuse_conv_batchnorm(net);
+    int j;
+    for (j = 0; j < net.n; ++j) {
+        layer *l = &net.layers[j];
+        if (l->type != CONVOLUTIONAL) continue;
+        if (winograd) winograd_transform_weights(l);
+        else if (l->winograd_weights) {
+            if (!is_weights_mapped(*l, l->winograd_weights)) free(l->winograd_weights);
+            l->winograd_weights = NULL;
+        }
+    }
+
+    list *options = read_data_cfg(datacfg);
+    char *backup_directory = option_find_str(options, "backup", "/backup/");
+    char buff[256];
+    if (!outfile) {
+        char *base = basecfg(cfgfile);
+        sprintf(buff, "%s/%s.dsw", backup_directory, base);
+        free(base);
+        outfile = buff;
+    }
+    save_weights_dsw(net, outfile);
+
+    free_list_contents_kvp(options);
+    free_list(options);
+    free_network(net);
+}
+
+void pack_detector(char *datacfg, char *outfile, int shard_mb)
+{
+    list *options = read_data_cfg(datacfg);
+    char *train_images = option_find_str(options, "train", "data/train.txt");
+    if (is_packed_dataset(train_images)) error("train= is already a packed dataset");
+    list *plist = get_paths(train_images);
+    char **paths = (char **)list_to_array(plist);
+
+    char buff[256];
+    if (!outfile) {
+        // data/train.txt -> data/train.pack
+        strncpy(buff, train_images, sizeof(buff) - 6);
+        buff[sizeof(buff) - 6] = 0;
+        char *ext = strrchr(buff, '.');
+        if (ext && !strchr(ext, '/')) *ext = 0;
+        strcat(buff, ".pack");
+        outfile = buff;
+    }
+    pack_dataset(paths, plist->size, outfile, (size_t)shard_mb * 1024 * 1024);
+    printf(" Set train=%s in %s to train from it \n", outfile, datacfg);
+
+    free(paths);
+    free_list_contents(plist);
+    free_list(plist);
+    free_list_contents_kvp(options);
+    free_list(options);
+}
+
+typedef struct {
+    double sum, min;
+} bench_time;
+
+static void add_bench_time(bench_time *t, double ms)
+{
+    if (t->sum == 0 || ms < t->min) t->min = ms;
+    t->sum += ms;
+}
+
+// activations read and written plus the weights, per image
+static double layer_mbytes(layer l)
+{
+    if (l.type == BLANK) return 0;  // fused into the layer before it
+    const double weight_size = l.weights_int8 ? sizeof(int8_t) : sizeof(float);
+    return ((double)(l.inputs + l.outputs) * sizeof(float) + l.nweights * weight_size) / (1024 * 1024);
+}
+
+static void fprint_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; s && *s; ++s) {
+        if (*s == '"' || *s == '\\') fputc('\\', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+// times the detection path stage by stage and every layer of the forward pass on one image;
+// writes the result as JSON or CSV for comparing builds and cfg files
+void benchmark_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh,
+    float hier_thresh, int letter_box, int iters, int warmup, char *format, char *outfile)
+{
+    static const char *stage_names[] = { "preprocess", "forward", "decode", "nms" };
+    enum { STAGES = 4 };
+    int i, j;
+
+    network net = parse_network_cfg_custom(cfgfile, 1, 1);    // set batch=1
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    fuse_conv_batchnorm(net);
+    calculate_binary_weights(net);
+    plan_network_memory(&net);
+
+    list *options = read_data_cfg(datacfg);
+    char *input = filename;
+    list *plist = NULL;
+    if (!input) {
+        plist = get_paths(option_find_str(options, "valid", "data/train.txt"));
+        if (!plist->size) error("benchmark: no image given and the valid= list is empty");
+        input = (char *)plist->front->val;
+    }
+    if (iters < 1) iters = 1;
+    const int csv = format && !strcmp(format, "csv");
+    char buff[256];
+    if (!outfile) {
+        sprintf(buff, "benchmark.%s", csv ? "csv" : "json");
+        outfile = buff;
+    }
+
+    image im = load_image(input, 0, 0, net.c);
+    image sized = make_image(net.w, net.h, net.c);
+    const int classes = net.layers[net.n - 1].classes;
+    const float nms = .45;
+    bench_time stages[STAGES] = { { 0 } };
+    bench_time *layers = (bench_time *)calloc(net.n, sizeof(bench_time));
+    net.layer_times = (double *)calloc(net.n, sizeof(double));
+    int nboxes = 0;
+
+    printf("\n Benchmark: %s, %d x %d, %d warm-up + %d iterations \n", input, im.w, im.h, warmup, iters);
+    for (i = -warmup; i < iters; ++i) {
+        double t[STAGES + 1];
+        t[0] = get_time_point();
+        if (letter_box) letterbox_image_into(im, net.w, net.h, sized);
+        else resize_image_into(im, sized);
+        t[1] = get_time_point();
+        network_predict(net, sized.data);
+        t[2] = get_time_point();
+        detection *dets = get_network_boxes_into(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes, letter_box, NULL);
+        t[3] = get_time_point();
+        do_nms_sort(dets, nboxes, classes, nms);
+        t[4] = get_time_point();
+        if (i < 0) continue;
+        for (j = 0; j < STAGES; ++j) add_bench_time(&stages[j], (t[j + 1] - t[j]) / 1000);
+        for (j = 0; j < net.n; ++j) add_bench_time(&layers[j], net.layer_times[j]);
+    }
+
+    double total = 0;
+    for (j = 0; j < STAGES; ++j) total += stages[j].sum / iters;
+    printf("\n layer   type               mean ms    min ms    BFLOPs  GFLOP/s       MB \n");
+    for (j = 0; j < net.n; ++j) {
+        layer l = net.layers[j];
+        const double mean = layers[j].sum / iters;
+        const double mb = layer_mbytes(l);
+        printf(" %5d   %-14s %9.3f %9.3f %9.3f %8.1f %8.2f \n", j, get_layer_string(l.type), mean, layers[j].min,
+            l.bflops, mean > 0 ? l.bflops * 1000 / mean : 0, mb);
+    }
+    for (j = 0; j < STAGES; ++j) {
+        printf(" %-12s mean %9.3f ms, min %9.3f ms \n", stage_names[j], stages[j].sum / iters, stages[j].min);
+    }
+    printf(" total        mean %9.3f ms, %.1f FPS, %d boxes \n", total, total > 0 ? 1000 / total : 0, nboxes);
+
+    FILE *fp = fopen(outfile, "w");
+    if (!fp) file_error(outfile);
+    if (csv) {
+        fprintf(fp, "kind,index,name,mean_ms,min_ms,bflops,gflops_per_s,mbytes\n");
+        for (j = 0; j < STAGES; ++j) {
+            fprintf(fp, "stage,%d,%s,%.4f,%.4f,,,\n", j, stage_names[j], stages[j].sum / iters, stages[j].min);
+        }
+    }
+    else {
+        fprintf(fp, "{\n  \"cfg\": ");
+        fprint_json_string(fp, cfgfile);
+        fprintf(fp, ",\n  \"weights\": ");
+        fprint_json_string(fp, weightfile);
+        fprintf(fp, ",\n  \"image\": ");
+        fprint_json_string(fp, input);
+        fprintf(fp, ",\n  \"network_size\": [%d, %d, %d],\n  \"image_size\": [%d, %d],\n", net.w, net.h, net.c, im.w, im.h);
+        fprintf(fp, "  \"gpu\": %d,\n  \"iterations\": %d,\n  \"warmup\": %d,\n", gpu_index, iters, warmup);
+        fprintf(fp, "  \"total_ms\": %.4f,\n  \"fps\": %.2f,\n  \"stages\": {\n", total, total > 0 ? 1000 / total : 0);
+        for (j = 0; j < STAGES; ++j) {
+            fprintf(fp, "    \"%s\": { \"mean_ms\": %.4f, \"min_ms\": %.4f }%s\n", stage_names[j],
+                stages[j].sum / iters, stages[j].min, j + 1 < STAGES ? "," : "");
+        }
+        fprintf(fp, "  },\n  \"layers\": [\n");
+    }
+    for (j = 0; j < net.n; ++j) {
+        layer l = net.layers[j];
+        const double mean = layers[j].sum / iters;
+        const double mb = layer_mbytes(l);
+        const double gflops = mean > 0 ? l.bflops * 1000 / mean : 0;
+        if (csv) fprintf(fp, "layer,%d,%s,%.4f,%.4f,%.6f,%.3f,%.4f\n", j, get_layer_string(l.type), mean, layers[j].min, l.bflops, gflops, mb);
+        else fprintf(fp, "    { \"index\": %d, \"type\": \"%s\", \"mean_ms\": %.4f, \"min_ms\": %.4f, \"bflops\": %.6f, \"gflops_per_s\": %.3f, \"mbytes\": %.4f }%s\n",
+            j, get_layer_string(l.type), mean, layers[j].min, l.bflops, gflops, mb, j + 1 < net.n ? "," : "");
+    }
+    if (!csv) fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    printf(" Saved to %s \n", outfile);
+
+    free(layers);
+    free(net.layer_times);
+    net.layer_times = NULL;
+    free_image(sized);
+    free_image(im);
+    if (plist) {
+        free_list_contents(plist);
+        free_list(plist);
+    }
+    free_list_contents_kvp(options);
+    free_list(options);
+    free_network(net);
+}
+
+// detector analyze: decoder threads, one per stream, feed whole videos as fast as they
+// decode; the main thread batches frames of all streams through one network and writes
+// each video's detections with their frame index and timestamp.
+#ifdef OPENCV
+typedef enum { ANALYZE_FRAME, ANALYZE_START, ANALYZE_END, ANALYZE_DONE } analyze_kind;
+
+// Every message of a stream, control ones too, is one of its slots,
+// so a decoder can never run further ahead than its slots.
+typedef struct analyze_frame {
+    analyze_kind kind;
+    int stream;         // owner of the slot
+    int video;          // index in the video list
+    int index;          // FRAME: 0-based frame number, END: frames read
+    double time_ms;     // FRAME: presentation time
+    int w, h;           // START: frame size, 0 - the video can't be read
+    double fps;         // START
+    int frames;         // START: as reported by the container, may be an estimate
+    image input;        // FRAME: net.w x net.h, resized or letterboxed
+} analyze_frame;
+
+typedef struct analyze_videos {
+    char **paths;
+    int n;
+    int next;           // next video to claim
+    int letter_box;
+    pthread_mutex_t mutex;
+} analyze_videos;
+
+typedef struct analyze_stream {
+    analyze_videos *videos;
+    analyze_frame *slots;
+    spsc_ring free;
+    spsc_ring decoded;
+    int done;
+    pthread_t thread;
+} analyze_stream;
+
+typedef struct analyze_output {
+    FILE *fp;
+    int w, h;
+    double start;
+} analyze_output;
+
+static analyze_frame *analyze_message(analyze_stream *s, analyze_kind kind, int video)
+{
+    analyze_frame *f = (analyze_frame *)spsc_ring_pop(&s->free);
+    f->kind = kind;
+    f->video = video;
+    return f;
+}
+
+static void *analyze_decode_thread(void *ptr)
+{
+    analyze_stream *s = (analyze_stream *)ptr;
+    analyze_videos *videos = s->videos;
+    trace_thread_name("analyze decoder");
+    while (1) {
+        pthread_mutex_lock(&videos->mutex);
+        const int v = videos->next++;
+        pthread_mutex_unlock(&videos->mutex);
+        if (v >= videos->n) break;
+
+        cap_cv *cap = get_capture_video_stream(videos->paths[v]);
+        mat_cv *mat = cap ? get_stream_frame_cv(cap, 0) : NULL;
+        analyze_frame *f = analyze_message(s, ANALYZE_START, v);
+        f->w = mat ? get_width_mat(mat) : 0;
+        f->h = mat ? get_height_mat(mat) : 0;
+        f->fps = cap ? get_capture_fps_cv(cap) : 0;
+        f->frames = cap ? (int)get_capture_frame_count_cv(cap) : 0;
+        const double fps = f->fps;
+        spsc_ring_push(&s->decoded, f);
+
+        int index = 0;
+        while (mat) {
+            unsigned long long span = trace_begin();
+            f = analyze_message(s, ANALYZE_FRAME, v);
+            f->index = index;
+            // the container's timestamp of the frame just read; backends without one report 0
+            f->time_ms = get_capture_position_msec_cv(cap);
+            if (f->time_ms <= 0 && index > 0) f->time_ms = fps > 0 ? index * 1000. / fps : 0;
+            mat_to_image_resize_cv(mat, f->input, videos->letter_box);
+            release_mat(&mat);
+            trace_end("decode", span);
+            spsc_ring_push(&s->decoded, f);
+            ++index;
+            mat = get_stream_frame_cv(cap, 0);
+        }
+        if (cap) release_capture(cap);
+        f = analyze_message(s, ANALYZE_END, v);
+        f->index = index;
+        spsc_ring_push(&s->decoded, f);
+    }
+    spsc_ring_push(&s->decoded, analyze_message(s, ANALYZE_DONE, -1));
+    return 0;
+}
+
+static void write_analyze_header(analyze_output *out, int binary, char *video, analyze_frame *f, char **names, int classes)
+{
+    int i;
+    if (binary) {
+        const int header[4] = { 1, f->w, f->h, f->frames };   // version, frame size, frame count
+        const float fps = f->fps;
+        fwrite("DSA1", 1, 4, out->fp);
+        fwrite(header, sizeof(int), 4, out->fp);
+        fwrite(&fps, sizeof(float), 1, out->fp);
+        fwrite(&classes, sizeof(int), 1, out->fp);
+        return;
+    }
+    fprintf(out->fp, "{\"video\":");
+    fprint_json_string(out->fp, video);
+    fprintf(out->fp, ",\"width\":%d,\"height\":%d,\"fps\":%.4f,\"frames\":%d,\"classes\":[", f->w, f->h, f->fps, f->frames);
+    for (i = 0; i < classes; ++i) {
+        if (i) fputc(',', out->fp);
+        fprint_json_string(out->fp, names ? names[i] : "");
+    }
+    fprintf(out->fp, "],\"box\":[\"class\",\"prob\",\"x\",\"y\",\"w\",\"h\"]}\n");
+}
+
+// one record per class above thresh, boxes relative to the frame with x, y at the centre
+static void write_analyze_frame(analyze_output *out, int binary, analyze_frame *f, detection *dets, int nboxes, int classes, float thresh)
+{
+    int i, j;
+    if (binary) {
+        unsigned int count = 0;
+        for (i = 0; i < nboxes; ++i) {
+            for (j = 0; j < classes; ++j) count += dets[i].prob[j] > thresh;
+        }
+        const unsigned int index = f->index;
+        fwrite(&index, sizeof(unsigned int), 1, out->fp);
+        fwrite(&f->time_ms, sizeof(double), 1, out->fp);
+        fwrite(&count, sizeof(unsigned int), 1, out->fp);
+        for (i = 0; i < nboxes; ++i) {
+            for (j = 0; j < classes; ++j) {
+                if (dets[i].prob[j] <= thresh) continue;
+                const box b = dets[i].bbox;
+                const float rec[5] = { dets[i].prob[j], b.x, b.y, b.w, b.h };
+                fwrite(&j, sizeof(int), 1, out->fp);
+                fwrite(rec, sizeof(float), 5, out->fp);
+            }
+        }
+        return;
+    }
+    int first = 1;
+    fprintf(out->fp, "{\"frame\":%d,\"time\":%.3f,\"boxes\":[", f->index, f->time_ms);
+    for (i = 0; i < nboxes; ++i) {
+        for (j = 0; j < classes; ++j) {
+            if (dets[i].prob[j] <= thresh) continue;
+            const box b = dets[i].bbox;
+            fprintf(out->fp, "%s[%d,%.4f,%.6f,%.6f,%.6f,%.6f]", first ? "" : ",", j, dets[i].prob[j], b.x, b.y, b.w, b.h);
+            first = 0;
+        }
+    }
+    fprintf(out->fp, "]}\n");
+}
+
+// <outdir>/<name>.<ext>, or next to the video without outdir
+static void analyze_output_path(char *video, char *outdir, const char *ext, char *path, size_t size)
+{
+    char *name = video;
+    char *p;
+    for (p = video; *p; ++p) {
+        if (*p == '/' || *p == '\\') name = p + 1;
+    }
+    char *dot = strrchr(name, '.');
+    const int stem = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+    if (outdir) snprintf(path, size, "%s/%.*s.%s", outdir, stem, name, ext);
+    else snprintf(path, size, "%.*s.%s", (int)(name - video) + stem, video, ext);
+}
+#endif  // OPENCV
+
+void analyze_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh,
+    float hier_thresh, int letter_box, int batch, int nstreams, char *format, char *outdir)
+{
+#ifdef OPENCV
+    int i, j;
+    if (!filename) error("analyze: give a video file or a .txt list of videos");
+    list *plist = NULL;
+    analyze_videos videos = { 0 };
+    const size_t len = strlen(filename);
+    if (len > 4 && !strcmp(filename + len - 4, ".txt")) {
+        plist = get_paths(filename);
+        videos.paths = (char **)list_to_array(plist);
+        videos.n = plist->size;
+    }
+    else {
+        videos.paths = &filename;
+        videos.n = 1;
+    }
+    if (!videos.n) error("analyze: the video list is empty");
+    videos.letter_box = letter_box;
+    pthread_mutex_init(&videos.mutex, NULL);
+
+    list *options = read_data_cfg(datacfg);
+    char *name_list = option_find_str(options, "names", "data/names.list");
+    int names_size = 0;
+    char **names = get_labels_custom(name_list, &names_size);
+
+    if (batch < 1) batch = 1;
+    network net = parse_network_cfg_custom(cfgfile, batch, 1);
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    fuse_conv_batchnorm(net);
+    calculate_binary_weights(net);
+    plan_network_memory(&net);
+    const int classes = net.layers[net.n - 1].classes;
+    char **labels = names_size >= classes ? names : NULL;
+    const float nms = .45;
+    const int binary = format && !strcmp(format, "bin");
+
+    if (nstreams <= 0) nstreams = 4;
+    if (nstreams > videos.n) nstreams = videos.n;
+    // a stream's frames in one batch never exceed net.batch, so two more slots
+    // keep its decoder running while the batch is in the network
+    const int nslots = net.batch + 2;
+    analyze_stream *streams = (analyze_stream *)calloc(nstreams, sizeof(analyze_stream));
+    for (i = 0; i < nstreams; ++i) {
+        analyze_stream *s = &streams[i];
+        s->videos = &videos;
+        s->slots = (analyze_frame *)calloc(nslots, sizeof(analyze_frame));
+        spsc_ring_init(&s->free, nslots);
+        spsc_ring_init(&s->decoded, nslots);
+        for (j = 0; j < nslots; ++j) {
+            s->slots[j].stream = i;
+            s->slots[j].input = make_image(net.w, net.h, net.c);
+            spsc_ring_push(&s->free, &s->slots[j]);
+        }
+        if (pthread_create(&s->thread, 0, analyze_decode_thread, s)) error("Thread creation failed");
+    }
+    printf("\n Analyze: %d videos, %d decoder streams, batch %d, %s output \n", videos.n, nstreams, net.batch, binary ? "binary" : "JSONL");
+
+    analyze_output *outputs = (analyze_output *)calloc(videos.n, sizeof(analyze_output));
+    analyze_frame **batch_frames = (analyze_frame **)calloc(net.batch, sizeof(analyze_frame *));
+    float *X = (float *)calloc((size_t)net.batch * net.inputs, sizeof(float));
+    detection_buffer dets_buffer = { 0 };
+    const double start = get_time_point();
+    long long total_frames = 0;
+    int active = nstreams;
+    int next = 0;
+    while (active > 0) {
+        // Fill the batch round-robin over the streams. An END stops it early so that
+        // the video's file is complete before it is closed; frames stay in order
+        // because each video is decoded by one stream and each stream is a queue.
+        // A stream with nothing decoded is skipped; the loop only waits once all of them are empty.
+        int n = 0;
+        analyze_frame *end = NULL;
+        analyze_stream *end_stream = NULL;
+        int empty = 0;  // active streams in a row without a frame
+        int spins = 0;
+        unsigned long long wait_span = 0;
+        while (n < net.batch && active > 0 && !end) {
+            analyze_stream *s = &streams[next];
+            next = (next + 1) % nstreams;
+            if (s->done) continue;
+            analyze_frame *f = (analyze_frame *)spsc_ring_try_pop(&s->decoded);
+            if (!f) {
+                if (++empty < active) continue;
+                if (!spins) wait_span = trace_begin();
+                spsc_ring_wait(&spins);
+                empty = 0;
+                continue;
+            }
+            if (spins) trace_end("wait for frame", wait_span);
+            empty = 0;
+            spins = 0;
+            if (f->kind == ANALYZE_FRAME) {
+                memcpy(X + (size_t)n * net.inputs, f->input.data, net.inputs * sizeof(float));
+                batch_frames[n++] = f;
+                continue;
+            }
+            if (f->kind == ANALYZE_START) {
+                char path[4096];
+                analyze_output *out = &outputs[f->video];
+                char *video = videos.paths[f->video];
+                if (f->w > 0) {
+                    analyze_output_path(video, outdir, binary ? "det" : "jsonl", path, sizeof(path));
+                    out->fp = fopen(path, binary ? "wb" : "w");
+                    if (!out->fp) file_error(path);
+                    out->w = f->w;
+                    out->h = f->h;
+                    out->start = get_time_point();
+                    write_analyze_header(out, binary, video, f, labels, classes);
+                    printf(" %s: %d x %d, %.2f fps -> %s \n", video, f->w, f->h, f->fps, path);
+                }
+                else printf(" Error: can't read the video %s \n", video);
+            }
+            else if (f->kind == ANALYZE_END) {
+                end = f;
+                end_stream = s;
+                continue;
+            }
+            else {
+                s->done = 1;
+                --active;
+            }
+            spsc_ring_push(&s->free, f);
+        }
+
+        if (n > 0) {
+            unsigned long long span = trace_begin();
+            network_predict(net, X);
+            for (j = 0; j < n; ++j) {
+                analyze_frame *f = batch_frames[j];
+                analyze_output *out = &outputs[f->video];
+                int nboxes = 0;
+                detection *dets = get_network_boxes_batch_into(&net, j, out->w, out->h, thresh, hier_thresh, 0, 1, &nboxes, letter_box, &dets_buffer);
+                do_nms_sort(dets, nboxes, classes, nms);
+                write_analyze_frame(out, binary, f, dets, nboxes, classes, thresh);
+                spsc_ring_push(&streams[f->stream].free, f);
+            }
+            total_frames += n;
+            trace_end("analyze batch", span);
+        }
+        if (end) {
+            analyze_output *out = &outputs[end->video];
+            if (out->fp) {
+                fclose(out->fp);
+                out->fp = NULL;
+                const double seconds = (get_time_point() - out->start) / 1000000;
+                printf(" %s: %d frames, %.1f FPS \n", videos.paths[end->video], end->index, seconds > 0 ? end->index / seconds : 0);
+            }
+            spsc_ring_push(&end_stream->free, end);
+        }
+    }
+
+    const double seconds = (get_time_point() - start) / 1000000;
+    printf(" Analyzed %lld frames of %d videos in %.1f s, %.1f FPS \n", total_frames, videos.n, seconds, seconds > 0 ? total_frames / seconds : 0);
+
+    for (i = 0; i < nstreams; ++i) {
+        analyze_stream *s = &streams[i];
+        pthread_join(s->thread, 0);
+        for (j = 0; j < nslots; ++j) free_image(s->slots[j].input);
+        free(s->slots);
+        spsc_ring_free(&s->free);
+        spsc_ring_free(&s->decoded);
+    }
+    free(streams);
+    free(outputs);
+    free(batch_frames);
+    free(X);
+    free_detection_buffer(&dets_buffer);
+    pthread_mutex_destroy(&videos.mutex);
+    if (plist) {
+        free(videos.paths);
+        free_list_contents(plist);
+        free_list(plist);
+    }
+    free_ptrs((void**)names, names_size);
+    free_list_contents_kvp(options);
+    free_list(options);
+    free_network(net);
+#else
+    printf(" detector analyze requires OpenCV to decode the videos \n");
+#endif
+}
+
 typedef struct {
     box b;
     float p;
@@ -651,6 +1544,7 @@ typedef struct {
     int image_index;
     int truth_flag;
     int unique_truth_index;
+    int seq;    // position in the merged list, keeps equal scores in that order
 } box_prob;
 
 int detections_comparator(const void *pa, const void *pb)
@@ -660,10 +1554,245 @@ int detections_comparator(const void *pa, const void *pb)
     float diff = a.p - b.p;
     if (diff < 0) return 1;
     else if (diff > 0) return -1;
+    return a.seq - b.seq;
+}
+
+// Appends double the capacity, so storing n detections copies O(n) in total
+typedef struct box_prob_store {
+    box_prob *data;
+    int size;
+    int capacity;
+} box_prob_store;
+
+static box_prob *box_prob_store_push(box_prob_store *s)
+{
+    if (s->size == s->capacity) {
+        s->capacity = s->capacity ? 2 * s->capacity : 256;
+        s->data = (box_prob*)realloc(s->data, s->capacity * sizeof(box_prob));
+        if (!s->data) error("Can't grow the mAP detection list");
+    }
+    return &s->data[s->size++];
+}
+
+// detection with prob > thresh_calc_avg_iou: IoU of a true-positive, -1 for a false-positive
+typedef struct map_thresh_hit {
+    int class_id;
+    float iou;
+} map_thresh_hit;
+
+// One validation image matched against its labels by a worker.
+// unique_truth_index of dets counts from the first label of the image.
+typedef struct map_image_result {
+    box_prob_store dets;
+    map_thresh_hit *hits;
+    int hits_count;
+    int hits_capacity;
+    int *truth_ids;
+    int num_labels;
+    int done;
+} map_image_result;
+
+typedef struct map_eval {
+    char **paths;
+    char **paths_dif;
+    int m;
+    int classes;
+    int letter_box;
+    float iou_thresh;
+    float thresh_calc_avg_iou;
+    load_args args;
+    int omp_threads;
+    map_image_result *results;
+    int next;                   // next image to claim
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} map_eval;
+
+typedef struct map_worker {
+    map_eval *e;
+    network net;
+    detection_buffer dets;
+    pthread_t thread;
+} map_worker;
+
+static int map_threads = 0;    // detector map: inference workers, 0 - one per core
+
+static void add_map_thresh_hit(map_image_result *r, int class_id, float iou)
+{
+    if (r->hits_count == r->hits_capacity) {
+        r->hits_capacity = r->hits_capacity ? 2 * r->hits_capacity : 64;
+        r->hits = (map_thresh_hit*)realloc(r->hits, r->hits_capacity * sizeof(map_thresh_hit));
+        if (!r->hits) error("Can't grow the mAP detection list");
+    }
+    r->hits[r->hits_count].class_id = class_id;
+    r->hits[r->hits_count].iou = iou;
+    r->hits_count++;
+}
+
+static void match_map_image(map_eval *e, int image_index, detection *dets, int nboxes, map_image_result *r)
+{
+    const float iou_thresh = e->iou_thresh;
+    char labelpath[4096];
+    replace_image_to_label(e->paths[image_index], labelpath);
+    int num_labels = 0;
+    box_label *truth = read_boxes(labelpath, &num_labels);
+    int i, j;
+    r->truth_ids = (int*)calloc(num_labels + 1, sizeof(int));
+    for (j = 0; j < num_labels; ++j) {
+        r->truth_ids[j] = truth[j].id;
+    }
+    r->num_labels = num_labels;
+
+    // difficult
+    box_label *truth_dif = NULL;
+    int num_labels_dif = 0;
+    if (e->paths_dif)
+    {
+        char labelpath_dif[4096];
+        replace_image_to_label(e->paths_dif[image_index], labelpath_dif);
+        truth_dif = read_boxes(labelpath_dif, &num_labels_dif);
+    }
+
+    box_prob_store *s = &r->dets;
+    for (i = 0; i < nboxes; ++i) {
+        int class_id;
+        for (class_id = 0; class_id < e->classes; ++class_id) {
+            float prob = dets[i].prob[class_id];
+            if (prob > 0) {
+                box_prob *d = box_prob_store_push(s);
+                d->b = dets[i].bbox;
+                d->p = prob;
+                d->image_index = image_index;
+                d->class_id = class_id;
+                d->truth_flag = 0;
+                d->unique_truth_index = -1;
+
+                int truth_index = -1;
+                float max_iou = 0;
+                for (j = 0; j < num_labels; ++j)
+                {
+                    box t = { truth[j].x, truth[j].y, truth[j].w, truth[j].h };
+                    float current_iou = box_iou(dets[i].bbox, t);
+                    if (current_iou > iou_thresh && class_id == truth[j].id) {
+                        if (current_iou > max_iou) {
+                            max_iou = current_iou;
+                            truth_index = j;
+                        }
+                    }
+                }
+
+                // best IoU
+                if (truth_index > -1) {
+                    d->truth_flag = 1;
+                    d->unique_truth_index = truth_index;
+                }
+                else {
+                    // if object is difficult then remove detection
+                    for (j = 0; j < num_labels_dif; ++j) {
+                        box t = { truth_dif[j].x, truth_dif[j].y, truth_dif[j].w, truth_dif[j].h };
+                        float current_iou = box_iou(dets[i].bbox, t);
+                        if (current_iou > iou_thresh && class_id == truth_dif[j].id) {
+                            --s->size;
+                            break;
+                        }
+                    }
+                }
+
+                // avg IoU, true-positives, false-positives for required Threshold are summed up in image order by the caller
+                if (prob > e->thresh_calc_avg_iou) {
+                    int z, found = 0;
+                    for (z = 0; z < s->size - 1; ++z) {
+                        if (s->data[z].unique_truth_index == truth_index) {
+                            found = 1; break;
+                        }
+                    }
+                    add_map_thresh_hit(r, class_id, (truth_index > -1 && found == 0) ? max_iou : -1);
+                }
+            }
+        }
+    }
+    free(truth);
+    if (truth_dif) free(truth_dif);
+}
+
+static int claim_map_image(map_eval *e)
+{
+    pthread_mutex_lock(&e->mutex);
+    int index = e->next++;
+    pthread_mutex_unlock(&e->mutex);
+    return index;
+}
+
+// Each worker claims images one at a time and loads the next one on the
+// loader pool while its network runs on the current one.
+static void *map_worker_thread(void *ptr)
+{
+    map_worker *w = (map_worker*)ptr;
+    map_eval *e = w->e;
+    const float thresh = .005;
+    const float nms = .45;
+#ifdef _OPENMP
+    if (e->omp_threads > 0) omp_set_num_threads(e->omp_threads);
+#endif
+    image im, resized;
+    load_job job;
+    load_args args = e->args;
+    args.im = &im;
+    args.resized = &resized;
+    trace_thread_name("map worker");
+
+    int index = claim_map_image(e);
+    if (index < e->m) {
+        args.path = e->paths[index];
+        start_load_job(&job, args);
+    }
+    while (index < e->m) {
+        unsigned long long span = trace_begin();
+        wait_load_job(&job);
+        trace_end("wait for image", span);
+        span = trace_begin();
+        image val = im;
+        image val_resized = resized;
+        int next = claim_map_image(e);
+        if (next < e->m) {
+            args.path = e->paths[next];
+            start_load_job(&job, args);
+        }
+
+        network_predict(w->net, val_resized.data);
+        int nboxes = 0;
+        float hier_thresh = 0;
+        detection *dets;
+        if (args.type == LETTERBOX_DATA) {
+            dets = get_network_boxes_into(&w->net, val.w, val.h, thresh, hier_thresh, 0, 1, &nboxes, e->letter_box, &w->dets);
+        }
+        else {
+            dets = get_network_boxes_into(&w->net, 1, 1, thresh, hier_thresh, 0, 0, &nboxes, e->letter_box, &w->dets);
+        }
+        if (nms) do_nms_sort(dets, nboxes, e->classes, nms);
+        match_map_image(e, index, dets, nboxes, &e->results[index]);
+        free_image(val);
+        free_image(val_resized);
+        trace_end("map image", span);
+
+        pthread_mutex_lock(&e->mutex);
+        e->results[index].done = 1;
+        pthread_cond_broadcast(&e->done);
+        pthread_mutex_unlock(&e->mutex);
+        index = next;
+    }
     return 0;
 }
 
 float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, float thresh_calc_avg_iou, const float iou_thresh, const int map_points, int letter_box, network *existing_net)
+{
+    return evaluate_detector_map(datacfg, cfgfile, weightfile, thresh_calc_avg_iou, iou_thresh, map_points, letter_box, existing_net, gpu_index, 0);
+}
+
+// gpu - device of the networks built here (-1 - CPU), the calling thread must have it set.
+// background - runs beside training (-map_async): leaves gpu_index and the rand() seed alone
+static float evaluate_detector_map(char *datacfg, char *cfgfile, char *weightfile, float thresh_calc_avg_iou, const float iou_thresh,
+    const int map_points, int letter_box, network *existing_net, int gpu, int background)
 {
     int j;
     list *options = read_data_cfg(datacfg);
@@ -688,19 +1817,21 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
     }
     else {
         net = parse_network_cfg_custom(cfgfile, 1, 1);    // set batch=1
+        net.gpu_index = gpu;
         if (weightfile) {
             load_weights(&net, weightfile);
         }
         //set_batch_network(&net, 1);
         fuse_conv_batchnorm(net);
         calculate_binary_weights(net);
+        plan_network_memory(&net);
     }
     if (net.layers[net.n - 1].classes != names_size) {
         printf(" Error: in the file %s number of names %d that isn't equal to classes=%d in the file %s \n",
             name_list, names_size, net.layers[net.n - 1].classes, cfgfile);
         getchar();
     }
-    srand(time(0));
+    if (!background) srand(time(0));
     printf("\n calculation mAP (mean average precision)...\n");
 
     list *plist = get_paths(valid_images);
@@ -718,33 +1849,63 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
 
     int m = plist->size;
     int i = 0;
-    int t;
 
-    const float thresh = .005;
-    const float nms = .45;
-    //const float iou_thresh = 0.5;
-
-    int nthreads = 4;
-    if (m < 4) nthreads = m;
-    image* val = (image*)calloc(nthreads, sizeof(image));
-    image* val_resized = (image*)calloc(nthreads, sizeof(image));
-    image* buf = (image*)calloc(nthreads, sizeof(image));
-    image* buf_resized = (image*)calloc(nthreads, sizeof(image));
-    pthread_t* thr = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+    // The training network shares its layers with the one passed in,
+    // so only a standalone CPU run gets more than one network.
+    int nworkers = 1;
+    if (!existing_net && gpu < 0) {
+        nworkers = map_threads > 0 ? map_threads : get_num_cpus();
+        if (!map_threads && nworkers > 8) nworkers = 8;
+        if (nworkers > m) nworkers = m;
+        if (nworkers < 1) nworkers = 1;
+    }
 
-    load_args args = { 0 };
-    args.w = net.w;
-    args.h = net.h;
-    args.c = net.c;
-    if (letter_box) args.type = LETTERBOX_DATA;
-    else args.type = IMAGE_DATA;
+    map_eval e = { 0 };
+    e.paths = paths;
+    e.paths_dif = paths_dif;
+    e.m = m;
+    e.classes = classes;
+    e.letter_box = letter_box;
+    e.iou_thresh = iou_thresh;
+    e.thresh_calc_avg_iou = thresh_calc_avg_iou;
+    e.args.w = net.w;
+    e.args.h = net.h;
+    e.args.c = net.c;
+    if (letter_box) e.args.type = LETTERBOX_DATA;
+    else e.args.type = IMAGE_DATA;
+#ifdef _OPENMP
+    if (nworkers > 1) {
+        e.omp_threads = omp_get_max_threads() / nworkers;
+        if (e.omp_threads < 1) e.omp_threads = 1;
+    }
+#endif
+    e.results = (map_image_result*)calloc(m + 1, sizeof(map_image_result));
+    pthread_mutex_init(&e.mutex, NULL);
+    pthread_cond_init(&e.done, NULL);
+
+    map_worker *workers = (map_worker*)calloc(nworkers, sizeof(map_worker));
+    workers[0].net = net;
+    for (i = 1; i < nworkers; ++i) {
+        workers[i].net = parse_network_cfg_custom(cfgfile, 1, 1);
+        workers[i].net.gpu_index = gpu;
+        if (weightfile) load_weights(&workers[i].net, weightfile);
+        fuse_conv_batchnorm(workers[i].net);
+        calculate_binary_weights(workers[i].net);
+        plan_network_memory(&workers[i].net);
+    }
+    if (nworkers > 1) printf(" %d inference workers \n", nworkers);
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].e = &e;
+        if (pthread_create(&workers[i].thread, 0, map_worker_thread, &workers[i])) error("Thread creation failed");
+    }
 
     //const float thresh_calc_avg_iou = 0.24;
     float avg_iou = 0;
     int tp_for_thresh = 0;
     int fp_for_thresh = 0;
 
-    box_prob* detections = (box_prob*)calloc(1, sizeof(box_prob));
+    // detections of each class in image order; sorted once all images are in
+    box_prob_store *class_detections = (box_prob_store*)calloc(classes, sizeof(box_prob_store));
     int detections_count = 0;
     int unique_truth_count = 0;
 
@@ -755,158 +1916,56 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
     int *tp_for_thresh_per_class = (int*)calloc(classes, sizeof(int));
     int *fp_for_thresh_per_class = (int*)calloc(classes, sizeof(int));
 
-    for (t = 0; t < nthreads; ++t) {
-        args.path = paths[i + t];
-        args.im = &buf[t];
-        args.resized = &buf_resized[t];
-        thr[t] = load_data_in_thread(args);
-    }
+    // Images are merged in list order as they complete, so the sums and the
+    // order of equal scores do not depend on the number of workers.
     time_t start = time(0);
-    for (i = nthreads; i < m + nthreads; i += nthreads) {
-        fprintf(stderr, "\r%d", i);
-        for (t = 0; t < nthreads && i + t - nthreads < m; ++t) {
-            pthread_join(thr[t], 0);
-            val[t] = buf[t];
-            val_resized[t] = buf_resized[t];
+    for (i = 0; i < m; ++i) {
+        map_image_result *r = &e.results[i];
+        unsigned long long span = trace_begin();
+        pthread_mutex_lock(&e.mutex);
+        while (!r->done) pthread_cond_wait(&e.done, &e.mutex);
+        pthread_mutex_unlock(&e.mutex);
+        trace_end("wait for map image", span);
+        if (i % 4 == 0) fprintf(stderr, "\r%d", i);
+
+        for (j = 0; j < r->num_labels; ++j) {
+            truth_classes_count[r->truth_ids[j]]++;
         }
-        for (t = 0; t < nthreads && i + t < m; ++t) {
-            args.path = paths[i + t];
-            args.im = &buf[t];
-            args.resized = &buf_resized[t];
-            thr[t] = load_data_in_thread(args);
+        for (j = 0; j < r->dets.size; ++j) {
+            box_prob *d = box_prob_store_push(&class_detections[r->dets.data[j].class_id]);
+            *d = r->dets.data[j];
+            if (d->unique_truth_index > -1) d->unique_truth_index += unique_truth_count;
+            d->seq = detections_count++;
         }
-        for (t = 0; t < nthreads && i + t - nthreads < m; ++t) {
-            const int image_index = i + t - nthreads;
-            char *path = paths[image_index];
-            char *id = basecfg(path);
-            float *X = val_resized[t].data;
-            network_predict(net, X);
-
-            int nboxes = 0;
-            float hier_thresh = 0;
-            detection *dets;
-            if (args.type == LETTERBOX_DATA) {
-                dets = get_network_boxes(&net, val[t].w, val[t].h, thresh, hier_thresh, 0, 1, &nboxes, letter_box);
+        for (j = 0; j < r->hits_count; ++j) {
+            const map_thresh_hit h = r->hits[j];
+            if (h.iou >= 0) {
+                avg_iou += h.iou;
+                ++tp_for_thresh;
+                avg_iou_per_class[h.class_id] += h.iou;
+                tp_for_thresh_per_class[h.class_id]++;
             }
             else {
-                dets = get_network_boxes(&net, 1, 1, thresh, hier_thresh, 0, 0, &nboxes, letter_box);
-            }
-            //detection *dets = get_network_boxes(&net, val[t].w, val[t].h, thresh, hier_thresh, 0, 1, &nboxes, letter_box); // for letter_box=1
-            if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
-
-            char labelpath[4096];
-            replace_image_to_label(path, labelpath);
-            int num_labels = 0;
-            box_label *truth = read_boxes(labelpath, &num_labels);
-            int i, j;
-            for (j = 0; j < num_labels; ++j) {
-                truth_classes_count[truth[j].id]++;
+                fp_for_thresh++;
+                fp_for_thresh_per_class[h.class_id]++;
             }
+        }
+        unique_truth_count += r->num_labels;
 
-            // difficult
-            box_label *truth_dif = NULL;
-            int num_labels_dif = 0;
-            if (paths_dif)
-            {
-                char *path_dif = paths_dif[image_index];
-
-                char labelpath_dif[4096];
-                replace_image_to_label(path_dif, labelpath_dif);
-
-                truth_dif = read_boxes(labelpath_dif, &num_labels_dif);
-            }
-
-            const int checkpoint_detections_count = detections_count;
-
-            for (i = 0; i < nboxes; ++i) {
-
-                int class_id;
-                for (class_id = 0; class_id < classes; ++class_id) {
-                    float prob = dets[i].prob[class_id];
-                    if (prob > 0) {
-                        detections_count++;
-                        detections = (box_prob*)realloc(detections, detections_count * sizeof(box_prob));
-                        detections[detections_count - 1].b = dets[i].bbox;
-                        detections[detections_count - 1].p = prob;
-                        detections[detections_count - 1].image_index = image_index;
-                        detections[detections_count - 1].class_id = class_id;
-                        detections[detections_count - 1].truth_flag = 0;
-                        detections[detections_count - 1].unique_truth_index = -1;
-
-                        int truth_index = -1;
-                        float max_iou = 0;
-                        for (j = 0; j < num_labels; ++j)
-                        {
-                            box t = { truth[j].x, truth[j].y, truth[j].w, truth[j].h };
-                            //printf(" IoU = %f, prob = %f, class_id = %d, truth[j].id = %d \n",
-                            //    box_iou(dets[i].bbox, t), prob, class_id, truth[j].id);
-                            float current_iou = box_iou(dets[i].bbox, t);
-                            if (current_iou > iou_thresh && class_id == truth[j].id) {
-                                if (current_iou > max_iou) {
-                                    max_iou = current_iou;
-                                    truth_index = unique_truth_count + j;
-                                }
-                            }
-                        }
-
-                        // best IoU
-                        if (truth_index > -1) {
-                            detections[detections_count - 1].truth_flag = 1;
-                            detections[detections_count - 1].unique_truth_index = truth_index;
-                        }
-                        else {
-                            // if object is difficult then remove detection
-                            for (j = 0; j < num_labels_dif; ++j) {
-                                box t = { truth_dif[j].x, truth_dif[j].y, truth_dif[j].w, truth_dif[j].h };
-                                float current_iou = box_iou(dets[i].bbox, t);
-                                if (current_iou > iou_thresh && class_id == truth_dif[j].id) {
-                                    --detections_count;
-                                    break;
-                                }
-                            }
-                        }
-
-                        // calc avg IoU, true-positives, false-positives for required Threshold
-                        if (prob > thresh_calc_avg_iou) {
-                            int z, found = 0;
-                            for (z = checkpoint_detections_count; z < detections_count - 1; ++z) {
-                                if (detections[z].unique_truth_index == truth_index) {
-                                    found = 1; break;
-                                }
-                            }
-
-                            if (truth_index > -1 && found == 0) {
-                                avg_iou += max_iou;
-                                ++tp_for_thresh;
-                                avg_iou_per_class[class_id] += max_iou;
-                                tp_for_thresh_per_class[class_id]++;
-                            }
-                            else{
-                                fp_for_thresh++;
-                                fp_for_thresh_per_class[class_id]++;
-                            }
-                        }
-                    }
-                }
-            }
-
-            unique_truth_count += num_labels;
-
-            //static int previous_errors = 0;
-            //int total_errors = fp_for_thresh + (unique_truth_count - tp_for_thresh);
-            //int errors_in_this_image = total_errors - previous_errors;
-            //previous_errors = total_errors;
-            //if(reinforcement_fd == NULL) reinforcement_fd = fopen("reinforcement.txt", "wb");
-            //char buff[1000];
-            //sprintf(buff, "%s\n", path);
-            //if(errors_in_this_image > 0) fwrite(buff, sizeof(char), strlen(buff), reinforcement_fd);
+        free(r->dets.data);
+        free(r->hits);
+        free(r->truth_ids);
+    }
 
-            free_detections(dets, nboxes);
-            free(id);
-            free_image(val[t]);
-            free_image(val_resized[t]);
-        }
+    for (i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i].thread, 0);
+        free_detection_buffer(&workers[i].dets);
+        if (i > 0) free_network(workers[i].net);
     }
+    free(workers);
+    free(e.results);
+    pthread_mutex_destroy(&e.mutex);
+    pthread_cond_destroy(&e.done);
 
     if ((tp_for_thresh + fp_for_thresh) > 0)
         avg_iou = avg_iou / (tp_for_thresh + fp_for_thresh);
@@ -917,8 +1976,14 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
             avg_iou_per_class[class_id] = avg_iou_per_class[class_id] / (tp_for_thresh_per_class[class_id] + fp_for_thresh_per_class[class_id]);
     }
 
-    // SORT(detections)
-    qsort(detections, detections_count, sizeof(box_prob), detections_comparator);
+    // SORT(detections) of each class; the class holding the top detection overall is needed for the AUC below
+    unsigned long long ap_span = trace_begin();
+    int top_class = -1;
+    for (i = 0; i < classes; ++i) {
+        box_prob_store *s = &class_detections[i];
+        qsort(s->data, s->size, sizeof(box_prob), detections_comparator);
+        if (s->size && (top_class < 0 || detections_comparator(&s->data[0], &class_detections[top_class].data[0]) < 0)) top_class = i;
+    }
 
     typedef struct {
         double precision;
@@ -926,73 +1991,41 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
         int tp, fp, fn;
     } pr_t;
 
-    // for PR-curve
-    pr_t** pr = (pr_t**)calloc(classes, sizeof(pr_t*));
-    for (i = 0; i < classes; ++i) {
-        pr[i] = (pr_t*)calloc(detections_count, sizeof(pr_t));
-    }
     printf("\n detections_count = %d, unique_truth_count = %d  \n", detections_count, unique_truth_count);
 
+    int* truth_flags = (int*)calloc(unique_truth_count + 1, sizeof(int));
 
-    int* detection_per_class_count = (int*)calloc(classes, sizeof(int));
-    for (j = 0; j < detections_count; ++j) {
-        detection_per_class_count[detections[j].class_id]++;
-    }
-
-    int* truth_flags = (int*)calloc(unique_truth_count, sizeof(int));
+    double mean_average_precision = 0;
 
     int rank;
-    for (rank = 0; rank < detections_count; ++rank) {
-        if (rank % 100 == 0)
-            printf(" rank = %d of ranks = %d \r", rank, detections_count);
-
-        if (rank > 0) {
-            int class_id;
-            for (class_id = 0; class_id < classes; ++class_id) {
-                pr[class_id][rank].tp = pr[class_id][rank - 1].tp;
-                pr[class_id][rank].fp = pr[class_id][rank - 1].fp;
-            }
-        }
-
-        box_prob d = detections[rank];
-        // if (detected && isn't detected before)
-        if (d.truth_flag == 1) {
-            if (truth_flags[d.unique_truth_index] == 0)
-            {
+    for (i = 0; i < classes; ++i) {
+        box_prob_store *s = &class_detections[i];
+        const int n = s->size;
+
+        // for PR-curve
+        pr_t *pr = (pr_t*)calloc(n + 1, sizeof(pr_t));
+        int tp = 0, fp = 0;
+        for (rank = 0; rank < n; ++rank) {
+            box_prob d = s->data[rank];
+            // if (detected && isn't detected before)
+            if (d.truth_flag == 1 && truth_flags[d.unique_truth_index] == 0) {
                 truth_flags[d.unique_truth_index] = 1;
-                pr[d.class_id][rank].tp++;    // true-positive
-            } else
-                pr[d.class_id][rank].fp++;
-        }
-        else {
-            pr[d.class_id][rank].fp++;    // false-positive
-        }
+                ++tp;    // true-positive
+            }
+            else ++fp;   // false-positive
 
-        for (i = 0; i < classes; ++i)
-        {
-            const int tp = pr[i][rank].tp;
-            const int fp = pr[i][rank].fp;
             const int fn = truth_classes_count[i] - tp;    // false-negative = objects - true-positive
-            pr[i][rank].fn = fn;
+            pr[rank].tp = tp;
+            pr[rank].fp = fp;
+            pr[rank].fn = fn;
 
-            if ((tp + fp) > 0) pr[i][rank].precision = (double)tp / (double)(tp + fp);
-            else pr[i][rank].precision = 0;
+            if ((tp + fp) > 0) pr[rank].precision = (double)tp / (double)(tp + fp);
+            else pr[rank].precision = 0;
 
-            if ((tp + fn) > 0) pr[i][rank].recall = (double)tp / (double)(tp + fn);
-            else pr[i][rank].recall = 0;
-
-            if (rank == (detections_count - 1) && detection_per_class_count[i] != (tp + fp)) {    // check for last rank
-                    printf(" class_id: %d - detections = %d, tp+fp = %d, tp = %d, fp = %d \n", i, detection_per_class_count[i], tp+fp, tp, fp);
-            }
+            if ((tp + fn) > 0) pr[rank].recall = (double)tp / (double)(tp + fn);
+            else pr[rank].recall = 0;
         }
-    }
 
-    free(truth_flags);
-
-
-    double mean_average_precision = 0;
-
-    for (i = 0; i < classes; ++i) {
         double avg_precision = 0;
 
         // MS COCO - uses 101-Recall-points on PR-chart.
@@ -1003,18 +2036,23 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
         // correct mAP calculation: ImageNet, PascalVOC 2010-2012
         if (map_points == 0)
         {
-            double last_recall = pr[i][detections_count - 1].recall;
-            double last_precision = pr[i][detections_count - 1].precision;
-            for (rank = detections_count - 2; rank >= 0; --rank)
-            {
-                double delta_recall = last_recall - pr[i][rank].recall;
-                last_recall = pr[i][rank].recall;
+            if (n > 0) {
+                double last_recall = pr[n - 1].recall;
+                double last_precision = pr[n - 1].precision;
+                for (rank = n - 2; rank >= 0; --rank)
+                {
+                    double delta_recall = last_recall - pr[rank].recall;
+                    last_recall = pr[rank].recall;
 
-                if (pr[i][rank].precision > last_precision) {
-                    last_precision = pr[i][rank].precision;
-                }
+                    if (pr[rank].precision > last_precision) {
+                        last_precision = pr[rank].precision;
+                    }
 
-                avg_precision += delta_recall * last_precision;
+                    avg_precision += delta_recall * last_precision;
+                }
+                // on the ranking of all classes, a class starts from a zero-recall
+                // point unless it holds the top detection
+                if (i != top_class) avg_precision += last_recall * last_precision;
             }
         }
         // MSCOCO - 101 Recall-points, PascalVOC - 11 Recall-points
@@ -1024,11 +2062,11 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
             for (point = 0; point < map_points; ++point) {
                 double cur_recall = point * 1.0 / (map_points-1);
                 double cur_precision = 0;
-                for (rank = 0; rank < detections_count; ++rank)
+                for (rank = 0; rank < n; ++rank)
                 {
-                    if (pr[i][rank].recall >= cur_recall) {    // > or >=
-                        if (pr[i][rank].precision > cur_precision) {
-                            cur_precision = pr[i][rank].precision;
+                    if (pr[rank].recall >= cur_recall) {    // > or >=
+                        if (pr[rank].precision > cur_precision) {
+                            cur_precision = pr[rank].precision;
                         }
                     }
                 }
@@ -1038,6 +2076,8 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
             }
             avg_precision = avg_precision / map_points;
         }
+        free(pr);
+        free(s->data);
 
         printf("class_id = %d, name = %s, ap = %2.2f%%   \t (TP = %d, FP = %d) \n",
             i, names[i], avg_precision * 100, tp_for_thresh_per_class[i], fp_for_thresh_per_class[i]);
@@ -1048,6 +2088,9 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
 
         mean_average_precision += avg_precision;
     }
+    trace_end("map average precision", ap_span);
+
+    free(truth_flags);
 
     const float cur_precision = (float)tp_for_thresh / ((float)tp_for_thresh + (float)fp_for_thresh);
     const float cur_recall = (float)tp_for_thresh / ((float)tp_for_thresh + (float)(unique_truth_count - tp_for_thresh));
@@ -1065,13 +2108,8 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
 
     printf(" mean average precision (mAP@%0.2f) = %f, or %2.2f %% \n", iou_thresh, mean_average_precision, mean_average_precision * 100);
 
-    for (i = 0; i < classes; ++i) {
-        free(pr[i]);
-    }
-    free(pr);
-    free(detections);
+    free(class_detections);
     free(truth_classes_count);
-    free(detection_per_class_count);
 
     free(avg_iou_per_class);
     free(tp_for_thresh_per_class);
@@ -1270,6 +2308,9 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
 }
 
 
+static int tile_inference = 0;  // detector test/demo -tile: see network_predict_tiled()
+static int tile_overlap = 0;    // pixels, 0 - 1/8 of the network size
+
 void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh,
     float hier_thresh, int dont_show, int ext_output, int save_labels, char *outfile, int letter_box)
 {
@@ -1285,6 +2326,7 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     }
     fuse_conv_batchnorm(net);
     calculate_binary_weights(net);
+    plan_network_memory(&net);
     if (net.layers[net.n - 1].classes != names_size) {
         printf(" Error: in the file %s number of names %d that isn't equal to classes=%d in the file %s \n",
             name_list, names_size, net.layers[net.n - 1].classes, cfgfile);
@@ -1301,27 +2343,67 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
         char *tmp = "[\n";
         fwrite(tmp, sizeof(char), strlen(tmp), json_file);
     }
+
+    // When the image list is piped in, decode the next image on the loader
+    // pool while the current one runs through the network.
+    int read_ahead = !filename && !isatty(fileno(stdin));
+    char next_path[256];
+    image next_im, next_sized;
+    load_job job;
+    load_args args = { 0 };
+    args.w = net.w;
+    args.h = net.h;
+    args.c = net.c;
+    args.type = letter_box ? LETTERBOX_DATA : IMAGE_DATA;
+    args.path = next_path;
+    args.im = &next_im;
+    args.resized = &next_sized;
+    int pending = 0;
+    if (read_ahead && fgets(next_path, 256, stdin)) {
+        strtok(next_path, "\n");
+        start_load_job(&job, args);
+        pending = 1;
+    }
+
     int j;
     float nms = .45;    // 0.4F
     while (1) {
-        if (filename) {
-            strncpy(input, filename, 256);
-            if (strlen(input) > 0)
-                if (input[strlen(input) - 1] == 0x0d) input[strlen(input) - 1] = 0;
-        }
-        else {
+        image im, sized;
+        if (read_ahead) {
             printf("Enter Image Path: ");
             fflush(stdout);
-            input = fgets(input, 256, stdin);
-            if (!input) break;
-            strtok(input, "\n");
-        }
-        //image im;
-        //image sized = load_image_resize(input, net.w, net.h, net.c, &im);
-        image im = load_image(input, 0, 0, net.c);
-        image sized;
-        if(letter_box) sized = letterbox_image(im, net.w, net.h);
-        else sized = resize_image(im, net.w, net.h);
+            if (!pending) break;
+            wait_load_job(&job);
+            pending = 0;
+            strcpy(input, next_path);
+            im = next_im;
+            sized = next_sized;
+            if (fgets(next_path, 256, stdin)) {
+                strtok(next_path, "\n");
+                start_load_job(&job, args);
+                pending = 1;
+            }
+        }
+        else {
+            if (filename) {
+                strncpy(input, filename, 256);
+                if (strlen(input) > 0)
+                    if (input[strlen(input) - 1] == 0x0d) input[strlen(input) - 1] = 0;
+            }
+            else {
+                printf("Enter Image Path: ");
+                fflush(stdout);
+                input = fgets(input, 256, stdin);
+                if (!input) break;
+                strtok(input, "\n");
+            }
+            //image im;
+            //image sized = load_image_resize(input, net.w, net.h, net.c, &im);
+            im = load_image(input, 0, 0, net.c);
+            if (tile_inference) sized = make_empty_image(0, 0, 0);
+            else if (letter_box) sized = letterbox_image(im, net.w, net.h);
+            else sized = resize_image(im, net.w, net.h);
+        }
         layer l = net.layers[net.n - 1];
 
         //box *boxes = calloc(l.w*l.h*l.n, sizeof(box));
@@ -1330,16 +2412,20 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
 
         float *X = sized.data;
 
+        int nboxes = 0;
+        detection *dets = NULL;
         //time= what_time_is_it_now();
         double time = get_time_point();
-        network_predict(net, X);
+        if (tile_inference) dets = network_predict_tiled(&net, im, tile_overlap, thresh, hier_thresh, nms, &nboxes, NULL);
+        else network_predict(net, X);
         //network_predict_image(&net, im); letterbox = 1;
         printf("%s: Predicted in %lf milli-seconds.\n", input, ((double)get_time_point() - time) / 1000);
         //printf("%s: Predicted in %f seconds.\n", input, (what_time_is_it_now()-time));
 
-        int nboxes = 0;
-        detection *dets = get_network_boxes(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes, letter_box);
-        if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+        if (!tile_inference) {
+            dets = get_network_boxes(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes, letter_box);
+            if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+        }
         draw_detections_v3(im, dets, nboxes, thresh, names, alphabet, l.classes, ext_output);
         save_image(im, "predictions");
         if (!dont_show) {
@@ -1384,7 +2470,7 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
             fclose(fw);
         }
 
-        free_detections(dets, nboxes);
+        if (!tile_inference) free_network_boxes(dets);
         free_image(im);
         free_image(sized);
 
@@ -1425,12 +2511,25 @@ void run_detector(int argc, char **argv)
     int dont_show = find_arg(argc, argv, "-dont_show");
     int show = find_arg(argc, argv, "-show");
     int letter_box = find_arg(argc, argv, "-letter_box");
+    tile_inference = find_arg(argc, argv, "-tile");
+    tile_overlap = find_int_arg(argc, argv, "-tile_overlap", 0);
     int calc_map = find_arg(argc, argv, "-map");
+    if (find_arg(argc, argv, "-map_async")) calc_map = 2;
+    map_gpu = find_int_arg(argc, argv, "-map_gpu", -1);
     int map_points = find_int_arg(argc, argv, "-points", 0);
     check_mistakes = find_arg(argc, argv, "-check_mistakes");
     int show_imgs = find_arg(argc, argv, "-show_imgs");
     int mjpeg_port = find_int_arg(argc, argv, "-mjpeg_port", -1);
     int json_port = find_int_arg(argc, argv, "-json_port", -1);
+    int winograd = find_int_arg(argc, argv, "-winograd", 1);    // detector export
+    int image_cache_mb = find_int_arg(argc, argv, "-image_cache", 0);  // detector train: MB of decoded images kept in RAM
+    int shard_mb = find_int_arg(argc, argv, "-shard_mb", 64);           // detector pack
+    map_threads = find_int_arg(argc, argv, "-map_threads", 0);          // detector map: inference workers on CPU
+    int analyze_batch = find_int_arg(argc, argv, "-batch", 4);          // detector analyze
+    int analyze_streams = find_int_arg(argc, argv, "-streams", 0);      // decoder threads, 0 - up to 4
+    int iters = find_int_arg(argc, argv, "-iters", 100);                // detector benchmark
+    int warmup = find_int_arg(argc, argv, "-warmup", 10);
+    char *format = find_char_arg(argc, argv, "-format", "json");        // json or csv, analyze: json (JSONL) or bin
     char *out_filename = find_char_arg(argc, argv, "-out_filename", 0);
     char *outfile = find_char_arg(argc, argv, "-out", 0);
     char *prefix = find_char_arg(argc, argv, "-prefix", 0);
@@ -1483,10 +2582,17 @@ void run_detector(int argc, char **argv)
         if (strlen(weights) > 0)
             if (weights[strlen(weights) - 1] == 0x0d) weights[strlen(weights) - 1] = 0;
     char *filename = (argc > 6) ? argv[6] : 0;
+    if (image_cache_mb > 0) set_image_cache_size((size_t)image_cache_mb * 1024 * 1024);
     if (0 == strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, dont_show, ext_output, save_labels, outfile, letter_box);
     else if (0 == strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear, dont_show, calc_map, mjpeg_port, show_imgs);
     else if (0 == strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
     else if (0 == strcmp(argv[2], "recall")) validate_detector_recall(datacfg, cfg, weights);
+    else if (0 == strcmp(argv[2], "winograd")) check_winograd_detector(datacfg, cfg, weights, filename, thresh, iou_thresh);
+    else if (0 == strcmp(argv[2], "calibrate")) calibrate_detector(datacfg, cfg, weights, filename, outfile);
+    else if (0 == strcmp(argv[2], "export")) export_detector(datacfg, cfg, weights, outfile, winograd);
+    else if (0 == strcmp(argv[2], "pack")) pack_detector(datacfg, outfile, shard_mb);
+    else if (0 == strcmp(argv[2], "benchmark")) benchmark_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, letter_box, iters, warmup, format, outfile);
+    else if (0 == strcmp(argv[2], "analyze")) analyze_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, letter_box, analyze_batch, analyze_streams, format, outfile);
     else if (0 == strcmp(argv[2], "map")) validate_detector_map(datacfg, cfg, weights, thresh, iou_thresh, map_points, letter_box, NULL);
     else if (0 == strcmp(argv[2], "calc_anchors")) calc_anchors(datacfg, num_of_clusters, width, height, show);
     else if (0 == strcmp(argv[2], "demo")) {
@@ -1497,6 +2603,8 @@ void run_detector(int argc, char **argv)
         if (filename)
             if (strlen(filename) > 0)
                 if (filename[strlen(filename) - 1] == 0x0d) filename[strlen(filename) - 1] = 0;
+        set_demo_tiling(tile_inference, tile_overlap);
+        set_demo_pipeline_depth(find_int_arg(argc, argv, "-pipeline_depth", 0));
         demo(cfg, weights, thresh, hier_thresh, cam_index, filename, names, classes, frame_skip, prefix, out_filename,
             mjpeg_port, json_port, dont_show, ext_output, letter_box);
 
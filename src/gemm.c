@@ -11,10 +11,79 @@
 #ifdef _WIN32
 #include <intrin.h>
 #endif
+#include <pthread.h>
 #if defined(_OPENMP)
 #include <omp.h>
 #endif
 
+#define GEMM_ALIGN 64
+
+static void *gemm_aligned_malloc(size_t size)
+{
+    void *ptr = 0;
+#ifdef _WIN32
+    ptr = _aligned_malloc(size, GEMM_ALIGN);
+#else
+    if (posix_memalign(&ptr, GEMM_ALIGN, size)) ptr = 0;
+#endif
+    if (!ptr) malloc_error();
+    return ptr;
+}
+
+static void gemm_aligned_free(void *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// Scratch buffers of the calling thread, kept between calls and freed when the
+// thread exits: the mAP workers and their OpenMP teams come and go.
+enum { GEMM_SCRATCH_A, GEMM_SCRATCH_B, GEMM_SCRATCH_INT8_INPUT, GEMM_SCRATCH_COUNT };
+
+typedef struct gemm_scratch {
+    void *ptr[GEMM_SCRATCH_COUNT];
+    size_t size[GEMM_SCRATCH_COUNT];
+} gemm_scratch;
+
+static pthread_key_t gemm_scratch_key;
+static pthread_once_t gemm_scratch_once = PTHREAD_ONCE_INIT;
+
+static void free_gemm_scratch(void *ptr)
+{
+    gemm_scratch *s = (gemm_scratch *)ptr;
+    int i;
+    for (i = 0; i < GEMM_SCRATCH_COUNT; ++i) {
+        if (s->ptr[i]) gemm_aligned_free(s->ptr[i]);
+    }
+    free(s);
+}
+
+static void make_gemm_scratch_key()
+{
+    if (pthread_key_create(&gemm_scratch_key, free_gemm_scratch)) error("pthread_key_create failed");
+}
+
+// GEMM_ALIGN-aligned, at least size bytes
+static void *gemm_scratch_buffer(int which, size_t size)
+{
+    pthread_once(&gemm_scratch_once, make_gemm_scratch_key);
+    gemm_scratch *s = (gemm_scratch *)pthread_getspecific(gemm_scratch_key);
+    if (!s) {
+        s = (gemm_scratch *)calloc(1, sizeof(gemm_scratch));
+        if (!s) malloc_error();
+        pthread_setspecific(gemm_scratch_key, s);
+    }
+    if (s->size[which] < size) {
+        if (s->ptr[which]) gemm_aligned_free(s->ptr[which]);
+        s->ptr[which] = gemm_aligned_malloc(size);
+        s->size[which] = size;
+    }
+    return s->ptr[which];
+}
+
 #define TILE_M 4 // 4 ops
 #define TILE_N 16 // AVX2 = 2 ops * 8 floats
 #define TILE_K 16 // loop
@@ -511,6 +580,40 @@ static inline int popcnt_32(uint32_t val32) {
 }
 //----------------------------
 
+int can_apply_conv_epilogue(ACTIVATION a)
+{
+    return a != SWISH;  // swish also keeps the sigmoid for backward
+}
+
+static inline float conv_epilogue_activate(float x, ACTIVATION a)
+{
+    if (a == LEAKY) return (x > 0) ? x : .1f*x;
+    if (a == LINEAR) return x;
+    return activate(x, a);
+}
+
+// out[0..len) of one filter, `offset` is the position of out[0] in the output tensor
+static inline void conv_epilogue_row(const conv_epilogue *e, int filter, float *out, size_t offset, int len)
+{
+    const float bias = e->bias[filter];
+    const ACTIVATION a = e->activation;
+    int i;
+    if (e->residual) {
+        const float *res = e->residual + offset;
+        if (a == LEAKY) for (i = 0; i < len; ++i) { const float x = out[i] + bias; out[i] = ((x > 0) ? x : .1f*x) + res[i]; }
+        else for (i = 0; i < len; ++i) out[i] = conv_epilogue_activate(out[i] + bias, a) + res[i];
+    }
+    else {
+        if (a == LEAKY) for (i = 0; i < len; ++i) { const float x = out[i] + bias; out[i] = (x > 0) ? x : .1f*x; }
+        else for (i = 0; i < len; ++i) out[i] = conv_epilogue_activate(out[i] + bias, a);
+    }
+}
+
+// INT8 convolution, see convolution_2d_int8(): int32 sums of one output row for 16 filters
+typedef void(*int8_conv_row_t)(const uint8_t *in, size_t in_row, int c4, int ksize, int stride, int dilation,
+    const int8_t *weights, int out_w, int32_t *acc);
+static int8_conv_row_t get_int8_conv_row();
+
 
 #if (defined(__AVX__) && defined(__x86_64__)) || defined(_WIN64)
 
@@ -576,11 +679,18 @@ void asm_cpuid(uint32_t* abcd, uint32_t eax)
 #ifdef _WIN32
 //  Windows
 #define cpuid(info, x)    __cpuidex(info, x, 0)
+#define xgetbv_xcr0()     _xgetbv(0)
 #else
 //  GCC Intrinsics
 void cpuid(int info[4], int InfoType) {
     __cpuid_count(InfoType, 0, info[0], info[1], info[2], info[3]);
 }
+
+static inline uint64_t xgetbv_xcr0() {
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
 #endif
 
 
@@ -594,6 +704,9 @@ static int HW_SSE, HW_SSE2, HW_SSE3, HW_SSSE3, HW_SSE41, HW_SSE42, HW_SSE4a, HW_
 //  SIMD: 256-bit
 static int HW_AVX, HW_XOP, HW_FMA3, HW_FMA4, HW_AVX2;
 
+//  OS support of the extended register state (XSAVE/XGETBV)
+static int HW_OSXSAVE, HW_OS_AVX512;
+
 //  SIMD: 512-bit
 static int HW_AVX512F;    //  AVX512 Foundation
 static int HW_AVX512CD;   //  AVX512 Conflict Detection
@@ -604,6 +717,7 @@ static int HW_AVX512BW;   //  AVX512 Byte + Word
 static int HW_AVX512DQ;   //  AVX512 Doubleword + Quadword
 static int HW_AVX512IFMA; //  AVX512 Integer 52-bit Fused Multiply-Add
 static int HW_AVX512VBMI; //  AVX512 Vector Byte Manipulation Instructions
+static int HW_AVX512VNNI; //  AVX512 Vector Neural Network Instructions
 
 // https://stackoverflow.com/questions/6121792/how-to-check-if-a-cpu-supports-the-sse3-instruction-set
 void check_cpu_features(void) {
@@ -629,6 +743,7 @@ void check_cpu_features(void) {
 
         HW_AVX = (info[2] & ((int)1 << 28)) != 0;
         HW_FMA3 = (info[2] & ((int)1 << 12)) != 0;
+        HW_OSXSAVE = (info[2] & ((int)1 << 27)) != 0;
 
         HW_RDRAND = (info[2] & ((int)1 << 30)) != 0;
     }
@@ -651,6 +766,7 @@ void check_cpu_features(void) {
         HW_AVX512DQ = (info[1] & ((int)1 << 17)) != 0;
         HW_AVX512IFMA = (info[1] & ((int)1 << 21)) != 0;
         HW_AVX512VBMI = (info[2] & ((int)1 << 1)) != 0;
+        HW_AVX512VNNI = (info[2] & ((int)1 << 11)) != 0;
     }
     if (nExIds >= 0x80000001) {
         cpuid(info, 0x80000001);
@@ -660,6 +776,11 @@ void check_cpu_features(void) {
         HW_FMA4 = (info[2] & ((int)1 << 16)) != 0;
         HW_XOP = (info[2] & ((int)1 << 11)) != 0;
     }
+    if (HW_OSXSAVE) {
+        // XCR0: bit 1 - SSE, bit 2 - AVX, bits 5,6,7 - opmask, ZMM_Hi256, Hi16_ZMM
+        uint64_t xcr0 = xgetbv_xcr0();
+        HW_OS_AVX512 = (xcr0 & 0xE6) == 0xE6;
+    }
 }
 
 int is_avx() {
@@ -684,6 +805,27 @@ int is_fma_avx2() {
     return result;
 }
 
+int is_avx512() {
+    static int result = -1;
+    if (result == -1) {
+        check_cpu_features();
+        result = HW_AVX512F && HW_OS_AVX512;
+        if (result == 1) printf(" Used AVX-512 \n");
+        else printf(" Not used AVX-512 \n");
+    }
+    return result;
+}
+
+int is_avx512_vnni() {
+    static int result = -1;
+    if (result == -1) {
+        result = is_avx512() && HW_AVX512VNNI;
+        if (result == 1) printf(" Used AVX-512 VNNI \n");
+        else printf(" Not used AVX-512 VNNI \n");
+    }
+    return result;
+}
+
 // https://software.intel.com/sites/landingpage/IntrinsicsGuide
 void gemm_nn(int M, int N, int K, float ALPHA,
     float *A, int lda,
@@ -880,6 +1022,441 @@ void gemm_nn_fast(int M, int N, int K, float ALPHA,
 
 
 
+//--------------------------------------------
+// Packed SGEMM: cache-blocked and register-tiled
+//--------------------------------------------
+// C[M x N] += ALPHA * op(A)[M x K] * op(B)[K x N]
+// op(B) is split into NC-wide column blocks (one per thread, ~L3) and KC-deep
+// slices which are packed into NR-wide panels (one panel stays in L1),
+// op(A) is packed into MR-high panels of an MC x KC block (~L2).
+// The micro-kernel keeps the whole MR x NR tile of C in registers.
+
+#if defined(_MSC_VER)
+#define GEMM_TARGET_FMA
+#define GEMM_TARGET_AVX512
+#define GEMM_TARGET_AVX512_VNNI
+#else
+#define GEMM_TARGET_FMA __attribute__((target("avx2,fma")))
+#define GEMM_TARGET_AVX512 __attribute__((target("avx512f")))
+#define GEMM_TARGET_AVX512_VNNI __attribute__((target("avx512f,avx512vnni")))
+#endif
+
+#define GEMM_MAX_MR 8
+#define GEMM_MAX_NR 48
+
+typedef void(*gemm_micro_kernel_t)(int kc, const float *a, const float *b, float *c, int ldc);
+
+typedef struct gemm_packed_params {
+    int mr, nr;         // register tile
+    int mc, kc, nc;     // cache blocks
+    gemm_micro_kernel_t kernel;
+} gemm_packed_params;
+
+// 4x24 tile: 12 accumulators + 3 loads of B + 1 broadcast of A = 16 ymm registers
+GEMM_TARGET_FMA
+static void gemm_micro_kernel_4x24_fma(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c02 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps(), c12 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps(), c22 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps(), c32 = _mm256_setzero_ps();
+    int k;
+    for (k = 0; k < kc; ++k) {
+        const __m256 b0 = _mm256_load_ps(b);
+        const __m256 b1 = _mm256_load_ps(b + 8);
+        const __m256 b2 = _mm256_load_ps(b + 16);
+        __m256 a0;
+
+        a0 = _mm256_broadcast_ss(a);
+        c00 = _mm256_fmadd_ps(a0, b0, c00);
+        c01 = _mm256_fmadd_ps(a0, b1, c01);
+        c02 = _mm256_fmadd_ps(a0, b2, c02);
+
+        a0 = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(a0, b0, c10);
+        c11 = _mm256_fmadd_ps(a0, b1, c11);
+        c12 = _mm256_fmadd_ps(a0, b2, c12);
+
+        a0 = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(a0, b0, c20);
+        c21 = _mm256_fmadd_ps(a0, b1, c21);
+        c22 = _mm256_fmadd_ps(a0, b2, c22);
+
+        a0 = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(a0, b0, c30);
+        c31 = _mm256_fmadd_ps(a0, b1, c31);
+        c32 = _mm256_fmadd_ps(a0, b2, c32);
+
+        a += 4;
+        b += 24;
+    }
+    _mm256_storeu_ps(c + 0, _mm256_add_ps(_mm256_loadu_ps(c + 0), c00));
+    _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c01));
+    _mm256_storeu_ps(c + 16, _mm256_add_ps(_mm256_loadu_ps(c + 16), c02));
+    c += ldc;
+    _mm256_storeu_ps(c + 0, _mm256_add_ps(_mm256_loadu_ps(c + 0), c10));
+    _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c11));
+    _mm256_storeu_ps(c + 16, _mm256_add_ps(_mm256_loadu_ps(c + 16), c12));
+    c += ldc;
+    _mm256_storeu_ps(c + 0, _mm256_add_ps(_mm256_loadu_ps(c + 0), c20));
+    _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c21));
+    _mm256_storeu_ps(c + 16, _mm256_add_ps(_mm256_loadu_ps(c + 16), c22));
+    c += ldc;
+    _mm256_storeu_ps(c + 0, _mm256_add_ps(_mm256_loadu_ps(c + 0), c30));
+    _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c31));
+    _mm256_storeu_ps(c + 16, _mm256_add_ps(_mm256_loadu_ps(c + 16), c32));
+}
+
+// 8x48 tile: 24 accumulators + 3 loads of B + 1 broadcast of A = 28 zmm registers
+GEMM_TARGET_AVX512
+static void gemm_micro_kernel_8x48_avx512(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    __m512 acc[8][3];
+    int i, k;
+    for (i = 0; i < 8; ++i) {
+        acc[i][0] = _mm512_setzero_ps();
+        acc[i][1] = _mm512_setzero_ps();
+        acc[i][2] = _mm512_setzero_ps();
+    }
+    for (k = 0; k < kc; ++k) {
+        const __m512 b0 = _mm512_load_ps(b);
+        const __m512 b1 = _mm512_load_ps(b + 16);
+        const __m512 b2 = _mm512_load_ps(b + 32);
+        for (i = 0; i < 8; ++i) {
+            const __m512 a0 = _mm512_set1_ps(a[i]);
+            acc[i][0] = _mm512_fmadd_ps(a0, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(a0, b1, acc[i][1]);
+            acc[i][2] = _mm512_fmadd_ps(a0, b2, acc[i][2]);
+        }
+        a += 8;
+        b += 48;
+    }
+    for (i = 0; i < 8; ++i) {
+        float *c_row = c + i*ldc;
+        _mm512_storeu_ps(c_row + 0, _mm512_add_ps(_mm512_loadu_ps(c_row + 0), acc[i][0]));
+        _mm512_storeu_ps(c_row + 16, _mm512_add_ps(_mm512_loadu_ps(c_row + 16), acc[i][1]));
+        _mm512_storeu_ps(c_row + 32, _mm512_add_ps(_mm512_loadu_ps(c_row + 32), acc[i][2]));
+    }
+}
+
+static gemm_packed_params get_gemm_packed_params()
+{
+    gemm_packed_params p;
+    if (is_avx512()) {
+        p.mr = 8; p.nr = 48;
+        p.mc = 96; p.kc = 256; p.nc = 48 * 64;
+        p.kernel = gemm_micro_kernel_8x48_avx512;
+    }
+    else {
+        p.mr = 4; p.nr = 24;
+        p.mc = 96; p.kc = 256; p.nc = 24 * 128;
+        p.kernel = gemm_micro_kernel_4x24_fma;
+    }
+    return p;
+}
+
+// packing buffers: GEMM_SCRATCH_A - panels of A, GEMM_SCRATCH_B - panels of B
+static float *gemm_packed_buffer(int which, size_t size)
+{
+    return (float *)gemm_scratch_buffer(which, size * sizeof(float));
+}
+
+// ALPHA*op(A)[mc x kc] -> MR-high panels, k-major inside the panel, zero-padded rows
+static void gemm_pack_a(int TA, int mc, int kc, float ALPHA, float *A, int lda, int mr, float *dst)
+{
+    int i, k, r;
+    for (i = 0; i < mc; i += mr) {
+        const int m_cur = (mc - i < mr) ? (mc - i) : mr;
+        for (k = 0; k < kc; ++k) {
+            if (TA) for (r = 0; r < m_cur; ++r) dst[r] = ALPHA * A[k*lda + i + r];
+            else    for (r = 0; r < m_cur; ++r) dst[r] = ALPHA * A[(i + r)*lda + k];
+            for (; r < mr; ++r) dst[r] = 0;
+            dst += mr;
+        }
+    }
+}
+
+// rows [pc, pc+kc) and columns [jc, jc+nc) of op(B) -> NR-wide panels,
+// k-major inside the panel, zero-padded columns
+typedef void(*gemm_pack_b_t)(void *args, int pc, int kc, int jc, int nc, int nr, float *dst);
+
+typedef struct gemm_matrix_args {
+    int TB;
+    float *B;
+    int ldb;
+} gemm_matrix_args;
+
+static void gemm_pack_b(void *args, int pc, int kc, int jc, int nc, int nr, float *dst)
+{
+    const gemm_matrix_args *m = (gemm_matrix_args *)args;
+    const int ldb = m->ldb;
+    float *B = m->TB ? &m->B[jc*ldb + pc] : &m->B[pc*ldb + jc];
+    int j, k, r;
+    for (j = 0; j < nc; j += nr) {
+        const int n_cur = (nc - j < nr) ? (nc - j) : nr;
+        for (k = 0; k < kc; ++k) {
+            if (m->TB) for (r = 0; r < n_cur; ++r) dst[r] = B[(j + r)*ldb + k];
+            else memcpy(dst, &B[k*ldb + j], n_cur * sizeof(float));
+            for (r = n_cur; r < nr; ++r) dst[r] = 0;
+            dst += nr;
+        }
+    }
+}
+
+// op(B) = im2col(im), gathered directly from the image without a workspace
+typedef struct gemm_im2col_args {
+    float *im;
+    int height, width;
+    int ksize, stride, pad, dilation;
+    int out_w;
+} gemm_im2col_args;
+
+static void gemm_pack_b_im2col(void *args, int pc, int kc, int jc, int nc, int nr, float *dst)
+{
+    const gemm_im2col_args *m = (gemm_im2col_args *)args;
+    const int height = m->height, width = m->width, stride = m->stride, out_w = m->out_w;
+    int j, k, r, t;
+    for (k = 0; k < kc; ++k) {
+        const int row = pc + k;
+        const int kx = row % m->ksize;
+        const int ky = (row / m->ksize) % m->ksize;
+        const int chan = row / (m->ksize*m->ksize);
+        const float *im = m->im + chan*height*width;
+        const int y_off = ky*m->dilation - m->pad;
+        const int x_off = kx*m->dilation - m->pad;
+
+        for (j = 0; j < nc; j += nr) {
+            float *d = dst + j*kc + k*nr;
+            const int n_cur = (nc - j < nr) ? (nc - j) : nr;
+            int oy = (jc + j) / out_w;
+            int ox = (jc + j) % out_w;
+            // the panel is split into runs that lie on the same output row
+            for (r = 0; r < n_cur; ) {
+                const int run = (n_cur - r < out_w - ox) ? (n_cur - r) : (out_w - ox);
+                const int iy = oy*stride + y_off;
+                int ix = ox*stride + x_off;
+                if (iy < 0 || iy >= height) {
+                    memset(d + r, 0, run * sizeof(float));
+                }
+                else if (stride == 1) {
+                    const float *src = im + iy*width;
+                    const int lo = (ix < 0) ? ((-ix < run) ? -ix : run) : 0;
+                    const int hi = (width - ix < run) ? ((width - ix > lo) ? width - ix : lo) : run;
+                    for (t = 0; t < lo; ++t) d[r + t] = 0;
+                    memcpy(d + r + lo, src + ix + lo, (hi - lo) * sizeof(float));
+                    for (t = hi; t < run; ++t) d[r + t] = 0;
+                }
+                else {
+                    const float *src = im + iy*width;
+                    for (t = 0; t < run; ++t, ix += stride) {
+                        d[r + t] = (ix >= 0 && ix < width) ? src[ix] : 0;
+                    }
+                }
+                r += run;
+                ox = 0;
+                ++oy;
+            }
+            for (; r < nr; ++r) d[r] = 0;
+        }
+    }
+}
+
+static void gemm_packed_driver(int TA, int M, int N, int K, float ALPHA,
+    float *A, int lda,
+    gemm_pack_b_t pack_b, void *b_args,
+    float *C, int ldc, const conv_epilogue *epilogue)
+{
+    const gemm_packed_params p = get_gemm_packed_params();
+    int threads = 1;
+#if defined(_OPENMP)
+    // called from inside a parallel region (nested regions are serialized): don't split N
+    if (!omp_in_parallel()) threads = omp_get_max_threads();
+#endif
+    // give each thread its own NR-aligned column block of C, but not wider than NC
+    int nc = (N + threads - 1) / threads;
+    nc = ((nc + p.nr - 1) / p.nr) * p.nr;
+    if (nc > p.nc) nc = p.nc;
+    if (nc < p.nr) nc = p.nr;
+    const int blocks = (N + nc - 1) / nc;
+
+    int t;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (t = 0; t < blocks; ++t) {
+        const int jc = t*nc;
+        const int nc_cur = (N - jc < nc) ? (N - jc) : nc;
+        float *b_pack = gemm_packed_buffer(GEMM_SCRATCH_B, (size_t)p.kc * nc);
+        float *a_pack = gemm_packed_buffer(GEMM_SCRATCH_A, (size_t)p.mc * p.kc);
+        float edge[GEMM_MAX_MR*GEMM_MAX_NR];
+        int pc, ic, jr, ir, i, j;
+
+        for (pc = 0; pc < K; pc += p.kc) {
+            const int kc_cur = (K - pc < p.kc) ? (K - pc) : p.kc;
+            pack_b(b_args, pc, kc_cur, jc, nc_cur, p.nr, b_pack);
+
+            for (ic = 0; ic < M; ic += p.mc) {
+                const int mc_cur = (M - ic < p.mc) ? (M - ic) : p.mc;
+                gemm_pack_a(TA, mc_cur, kc_cur, ALPHA, TA ? &A[pc*lda + ic] : &A[ic*lda + pc], lda, p.mr, a_pack);
+
+                for (jr = 0; jr < nc_cur; jr += p.nr) {
+                    const int nr_cur = (nc_cur - jr < p.nr) ? (nc_cur - jr) : p.nr;
+                    const float *b = b_pack + jr*kc_cur;
+
+                    for (ir = 0; ir < mc_cur; ir += p.mr) {
+                        const int mr_cur = (mc_cur - ir < p.mr) ? (mc_cur - ir) : p.mr;
+                        const float *a = a_pack + ir*kc_cur;
+                        float *c = &C[(ic + ir)*ldc + jc + jr];
+
+                        if (mr_cur == p.mr && nr_cur == p.nr) {
+                            p.kernel(kc_cur, a, b, c, ldc);
+                        }
+                        else {
+                            // partial tile at the right/bottom edge of C
+                            memset(edge, 0, p.mr*p.nr * sizeof(float));
+                            p.kernel(kc_cur, a, b, edge, p.nr);
+                            for (i = 0; i < mr_cur; ++i) {
+                                for (j = 0; j < nr_cur; ++j) {
+                                    c[i*ldc + j] += edge[i*p.nr + j];
+                                }
+                            }
+                        }
+                        if (epilogue && pc + kc_cur == K) {
+                            for (i = 0; i < mr_cur; ++i) {
+                                conv_epilogue_row(epilogue, ic + ir + i, c + i*ldc, (size_t)(ic + ir + i)*ldc + jc + jr, nr_cur);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void gemm_cpu_packed(int TA, int TB, int M, int N, int K, float ALPHA,
+    float *A, int lda,
+    float *B, int ldb,
+    float *C, int ldc)
+{
+    gemm_matrix_args args;
+    args.TB = TB;
+    args.B = B;
+    args.ldb = ldb;
+    gemm_packed_driver(TA, M, N, K, ALPHA, A, lda, gemm_pack_b, &args, C, ldc, NULL);
+}
+
+// output[n x out_h*out_w] += weights[n x channels*ksize*ksize] * im2col(im)
+// im2col() is never materialized: panels of B are gathered straight from the image
+void convolution_2d_packed(float *im, int channels, int height, int width,
+    int ksize, int stride, int pad, int dilation,
+    float *weights, int n, float *output, const conv_epilogue *epilogue)
+{
+    gemm_im2col_args args;
+    const int out_h = (height + 2 * pad - (dilation * (ksize - 1) + 1)) / stride + 1;
+    const int out_w = (width + 2 * pad - (dilation * (ksize - 1) + 1)) / stride + 1;
+    const int k = channels*ksize*ksize;
+    if (ksize == 1 && stride == 1 && pad == 0) {
+        gemm_matrix_args matrix;    // the image is B itself
+        matrix.TB = 0;
+        matrix.B = im;
+        matrix.ldb = out_h*out_w;
+        gemm_packed_driver(0, n, out_h*out_w, k, 1, weights, k, gemm_pack_b, &matrix, output, out_h*out_w, epilogue);
+        return;
+    }
+    args.im = im;
+    args.height = height;
+    args.width = width;
+    args.ksize = ksize;
+    args.stride = stride;
+    args.pad = pad;
+    args.dilation = dilation;
+    args.out_w = out_w;
+    gemm_packed_driver(0, n, out_h*out_w, k, 1, weights, k, gemm_pack_b_im2col, &args, output, out_h*out_w, epilogue);
+}
+
+// acc[x][f] += sum over (ky, kx, 4-channel group g) of in[ky][x*stride + kx][g] . weights[ky][kx][g][f]
+// both are 4-byte dot products: uint8 input x int8 weights
+GEMM_TARGET_AVX512_VNNI
+static void int8_conv_row_avx512_vnni(const uint8_t *in, size_t in_row, int c4, int ksize, int stride, int dilation,
+    const int8_t *weights, int out_w, int32_t *acc)
+{
+    const size_t px = (size_t)stride*c4 * 4;   // bytes between neighbouring output pixels
+    int x = 0, ky, kx, g, p;
+    for (; x + 12 <= out_w; x += 12) {
+        __m512i sum[12];
+        for (p = 0; p < 12; ++p) sum[p] = _mm512_setzero_si512();
+        for (ky = 0; ky < ksize; ++ky) {
+            for (kx = 0; kx < ksize; ++kx) {
+                const uint8_t *src = in + ky*dilation*in_row + ((size_t)x*stride + kx*dilation)*c4 * 4;
+                const int8_t *w = weights + (ky*ksize + kx)*c4 * 64;
+                for (g = 0; g < c4; ++g) {
+                    const __m512i w512 = _mm512_loadu_si512((const void *)(w + g * 64));
+                    for (p = 0; p < 12; ++p) {
+                        sum[p] = _mm512_dpbusd_epi32(sum[p], _mm512_set1_epi32(*(const int32_t *)(src + p*px + g * 4)), w512);
+                    }
+                }
+            }
+        }
+        for (p = 0; p < 12; ++p) _mm512_storeu_si512((void *)(acc + (x + p) * 16), sum[p]);
+    }
+    for (; x < out_w; ++x) {
+        __m512i sum = _mm512_setzero_si512();
+        for (ky = 0; ky < ksize; ++ky) {
+            for (kx = 0; kx < ksize; ++kx) {
+                const uint8_t *src = in + ky*dilation*in_row + ((size_t)x*stride + kx*dilation)*c4 * 4;
+                const int8_t *w = weights + (ky*ksize + kx)*c4 * 64;
+                for (g = 0; g < c4; ++g) {
+                    sum = _mm512_dpbusd_epi32(sum, _mm512_set1_epi32(*(const int32_t *)(src + g * 4)), _mm512_loadu_si512((const void *)(w + g * 64)));
+                }
+            }
+        }
+        _mm512_storeu_si512((void *)(acc + x * 16), sum);
+    }
+}
+
+// _mm256_maddubs_epi16() saturates int16, the weights are limited to [-63, 63] so 2 * 255 * 63 fits
+GEMM_TARGET_FMA
+static void int8_conv_row_avx2(const uint8_t *in, size_t in_row, int c4, int ksize, int stride, int dilation,
+    const int8_t *weights, int out_w, int32_t *acc)
+{
+    const size_t px = (size_t)stride*c4 * 4;
+    const __m256i ones = _mm256_set1_epi16(1);
+    int x = 0, ky, kx, g, p;
+    for (; x < out_w; x += 4) {
+        const int pixels = (out_w - x < 4) ? (out_w - x) : 4;
+        size_t offset[4];
+        __m256i sum[4][2];
+        for (p = 0; p < 4; ++p) {
+            offset[p] = (p < pixels) ? p*px : 0;  // pixels past the end of the row repeat the first one, dropped below
+            sum[p][0] = sum[p][1] = _mm256_setzero_si256();
+        }
+        for (ky = 0; ky < ksize; ++ky) {
+            for (kx = 0; kx < ksize; ++kx) {
+                const uint8_t *src = in + ky*dilation*in_row + ((size_t)x*stride + kx*dilation)*c4 * 4;
+                const int8_t *w = weights + (ky*ksize + kx)*c4 * 64;
+                for (g = 0; g < c4; ++g) {
+                    const __m256i w0 = _mm256_loadu_si256((const __m256i *)(w + g * 64));
+                    const __m256i w1 = _mm256_loadu_si256((const __m256i *)(w + g * 64 + 32));
+                    for (p = 0; p < 4; ++p) {
+                        const __m256i a = _mm256_set1_epi32(*(const int32_t *)(src + offset[p] + g * 4));
+                        sum[p][0] = _mm256_add_epi32(sum[p][0], _mm256_madd_epi16(_mm256_maddubs_epi16(a, w0), ones));
+                        sum[p][1] = _mm256_add_epi32(sum[p][1], _mm256_madd_epi16(_mm256_maddubs_epi16(a, w1), ones));
+                    }
+                }
+            }
+        }
+        for (p = 0; p < pixels; ++p) {
+            _mm256_storeu_si256((__m256i *)(acc + (x + p) * 16), sum[p][0]);
+            _mm256_storeu_si256((__m256i *)(acc + (x + p) * 16 + 8), sum[p][1]);
+        }
+    }
+}
+
+static int8_conv_row_t get_int8_conv_row()
+{
+    if (is_avx512_vnni()) return int8_conv_row_avx512_vnni;
+    if (is_fma_avx2()) return int8_conv_row_avx2;
+    return NULL;
+}
+
 void gemm_nn_bin_32bit_packed(int M, int N, int K, float ALPHA,
     uint32_t *A, int lda,
     uint32_t *B, int ldb,
@@ -1766,6 +2343,62 @@ void activate_array_cpu_custom(float *x, const int n, const ACTIVATION a)
     }
 }
 
+// out[i] = sum_t w[t] * rows[t][i], the vertical pass of the separable image resampler
+void weighted_sum_rows(float *out, const float **rows, const float *w, int taps, int n)
+{
+    int i = 0, t;
+    if (is_avx() == 1) {
+        for (; i + 8 <= n; i += 8) {
+            __m256 acc = _mm256_mul_ps(_mm256_set1_ps(w[0]), _mm256_loadu_ps(rows[0] + i));
+            for (t = 1; t < taps; ++t) {
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(w[t]), _mm256_loadu_ps(rows[t] + i)));
+            }
+            _mm256_storeu_ps(out + i, acc);
+        }
+    }
+    for (; i < n; ++i) {
+        float acc = w[0] * rows[0][i];
+        for (t = 1; t < taps; ++t) acc += w[t] * rows[t][i];
+        out[i] = acc;
+    }
+}
+
+// 1 if a box (edges l,t,r,b and area) has IoU > thresh with any of the n boxes
+// stored as separate edge arrays whose keep[i] is set; same arithmetic as box_iou()
+int any_iou_above(float l, float t, float r, float b, float area, const float *left, const float *top,
+    const float *right, const float *bottom, const float *areas, const float *keep, int n, float thresh)
+{
+    int i = 0;
+    if (is_avx() == 1) {
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 vl = _mm256_set1_ps(l), vt = _mm256_set1_ps(t), vr = _mm256_set1_ps(r), vb = _mm256_set1_ps(b);
+        const __m256 varea = _mm256_set1_ps(area), vthresh = _mm256_set1_ps(thresh);
+        for (; i + 8 <= n; i += 8) {
+            __m256 kept = _mm256_cmp_ps(_mm256_loadu_ps(keep + i), zero, _CMP_NEQ_OQ);
+            if (!_mm256_movemask_ps(kept)) continue;
+            __m256 w = _mm256_sub_ps(_mm256_min_ps(_mm256_loadu_ps(right + i), vr), _mm256_max_ps(_mm256_loadu_ps(left + i), vl));
+            __m256 h = _mm256_sub_ps(_mm256_min_ps(_mm256_loadu_ps(bottom + i), vb), _mm256_max_ps(_mm256_loadu_ps(top + i), vt));
+            __m256 inter = _mm256_and_ps(_mm256_mul_ps(w, h),
+                _mm256_and_ps(_mm256_cmp_ps(w, zero, _CMP_GE_OQ), _mm256_cmp_ps(h, zero, _CMP_GE_OQ)));
+            __m256 uni = _mm256_sub_ps(_mm256_add_ps(_mm256_loadu_ps(areas + i), varea), inter);
+            __m256 valid = _mm256_and_ps(_mm256_cmp_ps(inter, zero, _CMP_NEQ_OQ), _mm256_cmp_ps(uni, zero, _CMP_NEQ_OQ));
+            __m256 above = _mm256_cmp_ps(_mm256_div_ps(inter, uni), vthresh, _CMP_GT_OQ);
+            if (_mm256_movemask_ps(_mm256_and_ps(_mm256_and_ps(above, valid), kept))) return 1;
+        }
+    }
+    for (; i < n; ++i) {
+        if (keep[i] == 0) continue;
+        float w = (right[i] < r ? right[i] : r) - (left[i] > l ? left[i] : l);
+        float h = (bottom[i] < b ? bottom[i] : b) - (top[i] > t ? top[i] : t);
+        if (w < 0 || h < 0) continue;
+        float inter = w*h;
+        float uni = areas[i] + area - inter;
+        if (inter == 0 || uni == 0) continue;
+        if (inter / uni > thresh) return 1;
+    }
+    return 0;
+}
+
 void float_to_bit(float *src, unsigned char *dst, size_t size)
 {
     size_t dst_size = size / 8 + 1;
@@ -1947,6 +2580,19 @@ int is_fma_avx2() {
     return 0;
 }
 
+int is_avx512() {
+    return 0;
+}
+
+int is_avx512_vnni() {
+    return 0;
+}
+
+static int8_conv_row_t get_int8_conv_row()
+{
+    return NULL;
+}
+
 void gemm_nn(int M, int N, int K, float ALPHA,
     float *A, int lda,
     float *B, int ldb,
@@ -1980,6 +2626,53 @@ void gemm_nn_fast(int M, int N, int K, float ALPHA,
     }
 }
 
+void gemm_cpu_packed(int TA, int TB, int M, int N, int K, float ALPHA,
+    float *A, int lda,
+    float *B, int ldb,
+    float *C, int ldc)
+{
+    int i, j, k;
+    #pragma omp parallel for private(j, k)
+    for (i = 0; i < M; ++i) {
+        for (k = 0; k < K; ++k) {
+            PUT_IN_REGISTER float A_PART = ALPHA * (TA ? A[k*lda + i] : A[i*lda + k]);
+            for (j = 0; j < N; ++j) {
+                C[i*ldc + j] += A_PART * (TB ? B[j*ldb + k] : B[k*ldb + j]);
+            }
+        }
+    }
+}
+
+void convolution_2d_packed(float *im, int channels, int height, int width,
+    int ksize, int stride, int pad, int dilation,
+    float *weights, int n, float *output, const conv_epilogue *epilogue)
+{
+    const int out_h = (height + 2 * pad - (dilation * (ksize - 1) + 1)) / stride + 1;
+    const int out_w = (width + 2 * pad - (dilation * (ksize - 1) + 1)) / stride + 1;
+    int fil;
+    #pragma omp parallel for
+    for (fil = 0; fil < n; ++fil) {
+        int chan, y, x, f_y, f_x;
+        for (chan = 0; chan < channels; ++chan) {
+            for (f_y = 0; f_y < ksize; ++f_y) {
+                for (f_x = 0; f_x < ksize; ++f_x) {
+                    const float w = weights[((fil*channels + chan)*ksize + f_y)*ksize + f_x];
+                    for (y = 0; y < out_h; ++y) {
+                        const int input_y = y*stride + f_y*dilation - pad;
+                        if (input_y < 0 || input_y >= height) continue;
+                        for (x = 0; x < out_w; ++x) {
+                            const int input_x = x*stride + f_x*dilation - pad;
+                            if (input_x < 0 || input_x >= width) continue;
+                            output[(fil*out_h + y)*out_w + x] += w * im[(chan*height + input_y)*width + input_x];
+                        }
+                    }
+                }
+            }
+        }
+        if (epilogue) conv_epilogue_row(epilogue, fil, output + (size_t)fil*out_h*out_w, (size_t)fil*out_h*out_w, out_h*out_w);
+    }
+}
+
 void gemm_nn_bin_32bit_packed(int M, int N, int K, float ALPHA,
     uint32_t *A, int lda,
     uint32_t *B, int ldb,
@@ -2343,6 +3036,33 @@ void activate_array_cpu_custom(float *x, const int n, const ACTIVATION a)
     }
 }
 
+void weighted_sum_rows(float *out, const float **rows, const float *w, int taps, int n)
+{
+    int i, t;
+    for (i = 0; i < n; ++i) {
+        float acc = w[0] * rows[0][i];
+        for (t = 1; t < taps; ++t) acc += w[t] * rows[t][i];
+        out[i] = acc;
+    }
+}
+
+int any_iou_above(float l, float t, float r, float b, float area, const float *left, const float *top,
+    const float *right, const float *bottom, const float *areas, const float *keep, int n, float thresh)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (keep[i] == 0) continue;
+        float w = (right[i] < r ? right[i] : r) - (left[i] > l ? left[i] : l);
+        float h = (bottom[i] < b ? bottom[i] : b) - (top[i] > t ? top[i] : t);
+        if (w < 0 || h < 0) continue;
+        float inter = w*h;
+        float uni = areas[i] + area - inter;
+        if (inter == 0 || uni == 0) continue;
+        if (inter / uni > thresh) return 1;
+    }
+    return 0;
+}
+
 void float_to_bit(float *src, unsigned char *dst, size_t size)
 {
     size_t dst_size = size / 8 + 1;
@@ -2641,8 +3361,8 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
     }
 
     is_avx();   // initialize static variable
-    if (is_fma_avx2() && !TA && !TB) {
-        gemm_nn_fast(M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
+    if (is_fma_avx2()) {
+        gemm_cpu_packed(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
     }
     else {
         int t;
@@ -2660,6 +3380,297 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
     }
 }
 
+// Winograd F(4x4, 3x3): a 6x6 input tile gives a 4x4 output tile with 36 instead of 144 multiplications,
+// Y = A^T [ (G g G^T) .* (B^T d B) ] A
+// the element-wise products over all channels turn into 36 independent GEMMs
+#define WINOGRAD_LANES 8    // tiles transformed at once, the lane loops are vectorized by the compiler
+
+// u[0..5] = G * g[0..2]
+static inline void winograd_g_3(const float *g, int gs, float *u, int us)
+{
+    const float g0 = g[0], g1 = g[gs], g2 = g[2 * gs];
+    u[0] = g0 / 4;
+    u[us] = -(g0 + g1 + g2) / 6;
+    u[2 * us] = -(g0 - g1 + g2) / 6;
+    u[3 * us] = g0 / 24 + g1 / 12 + g2 / 6;
+    u[4 * us] = g0 / 24 - g1 / 12 + g2 / 6;
+    u[5 * us] = g2;
+}
+
+// v[0..5][lane] = B^T * d[0..5][lane]
+static inline void winograd_bt_6(const float *d, int ds, float *v, int vs)
+{
+    int l;
+    for (l = 0; l < WINOGRAD_LANES; ++l) {
+        const float d0 = d[l], d1 = d[ds + l], d2 = d[2 * ds + l], d3 = d[3 * ds + l], d4 = d[4 * ds + l], d5 = d[5 * ds + l];
+        v[l] = 4 * d0 - 5 * d2 + d4;
+        v[vs + l] = -4 * (d1 + d2) + d3 + d4;
+        v[2 * vs + l] = 4 * (d1 - d2) - d3 + d4;
+        v[3 * vs + l] = 2 * (d3 - d1) - d2 + d4;
+        v[4 * vs + l] = 2 * (d1 - d3) - d2 + d4;
+        v[5 * vs + l] = 4 * d1 - 5 * d3 + d5;
+    }
+}
+
+// y[0..3][lane] = A^T * m[0..5][lane]
+static inline void winograd_at_6(const float *m, int ms, float *y, int ys)
+{
+    int l;
+    for (l = 0; l < WINOGRAD_LANES; ++l) {
+        const float m0 = m[l], m1 = m[ms + l], m2 = m[2 * ms + l], m3 = m[3 * ms + l], m4 = m[4 * ms + l], m5 = m[5 * ms + l];
+        const float s12 = m1 + m2, d12 = m1 - m2, s34 = m3 + m4, d34 = m3 - m4;
+        y[l] = m0 + s12 + s34;
+        y[ys + l] = d12 + 2 * d34;
+        y[2 * ys + l] = s12 + 4 * s34;
+        y[3 * ys + l] = d12 + 8 * d34 + m5;
+    }
+}
+
+// weights[n x channels x 3 x 3] -> transformed[36 x n x channels]
+void winograd_transform_weights_4x4_3x3(float *weights, int n, int channels, float *transformed)
+{
+    const size_t stride = (size_t)n*channels;
+    int i;
+    #pragma omp parallel for
+    for (i = 0; i < n*channels; ++i) {
+        float tmp[6 * 3], u[6 * 6];
+        int r;
+        for (r = 0; r < 3; ++r) winograd_g_3(weights + (size_t)i * 9 + r, 3, tmp + r, 3);    // G g
+        for (r = 0; r < 6; ++r) winograd_g_3(tmp + r * 3, 1, u + r * 6, 1);                  // (G g) G^T
+        for (r = 0; r < 36; ++r) transformed[r*stride + i] = u[r];
+    }
+}
+
+// output[n x out_h x out_w] += conv3x3(im), stride = 1, dilation = 1
+// tiles are processed in blocks so that the transformed input and the products of one block stay in cache
+void convolution_winograd_4x4_3x3(float *im, int channels, int height, int width, int pad,
+    float *transformed_weights, int n, float *output, const conv_epilogue *epilogue)
+{
+    const int out_h = height + 2 * pad - 2;
+    const int out_w = width + 2 * pad - 2;
+    const int tiles_w = (out_w + 3) / 4;
+    const int tiles = ((out_h + 3) / 4) * tiles_w;
+
+    // tiles per block: a multiple of the micro-kernel widths (24 and 48) and of WINOGRAD_LANES,
+    // larger blocks make the transforms miss the cache, smaller ones repack U[xi] too often
+    const int block = 144;
+    const int blocks = (tiles + block - 1) / block;
+
+    #pragma omp parallel
+    {
+        float *v = (float*)calloc((size_t)36 * channels * block, sizeof(float));
+        float *m = (float*)calloc((size_t)36 * n * block, sizeof(float));
+        if (!v || !m) malloc_error();
+        int b;
+
+        #pragma omp for schedule(dynamic, 1)
+        for (b = 0; b < blocks; ++b) {
+            const int p0 = b*block;
+            const int p_cur = (tiles - p0 < block) ? (tiles - p0) : block;
+            float d[36 * WINOGRAD_LANES], tmp[36 * WINOGRAD_LANES], vt[36 * WINOGRAD_LANES];
+            int y0[WINOGRAD_LANES], x0[WINOGRAD_LANES];
+            int p, ch, k, xi, r, c, l;
+
+            for (p = 0; p < p_cur; p += WINOGRAD_LANES) {
+                const int lanes = (p_cur - p < WINOGRAD_LANES) ? (p_cur - p) : WINOGRAD_LANES;
+                for (l = 0; l < WINOGRAD_LANES; ++l) {
+                    y0[l] = ((p0 + p + l) / tiles_w) * 4;
+                    x0[l] = ((p0 + p + l) % tiles_w) * 4;
+                }
+
+                // V[xi][ch][p] = B^T d B
+                for (ch = 0; ch < channels; ++ch) {
+                    const float *src = im + (size_t)ch*height*width;
+                    for (l = 0; l < WINOGRAD_LANES; ++l) {
+                        const int y = y0[l] - pad, x = x0[l] - pad;
+                        if (l < lanes && y >= 0 && x >= 0 && y + 6 <= height && x + 6 <= width) {
+                            for (r = 0; r < 6; ++r) {
+                                for (c = 0; c < 6; ++c) d[(r * 6 + c)*WINOGRAD_LANES + l] = src[(y + r)*width + x + c];
+                            }
+                        }
+                        else {
+                            for (r = 0; r < 6; ++r) {
+                                for (c = 0; c < 6; ++c) {
+                                    const int in = l < lanes && y + r >= 0 && y + r < height && x + c >= 0 && x + c < width;
+                                    d[(r * 6 + c)*WINOGRAD_LANES + l] = in ? src[(y + r)*width + x + c] : 0;
+                                }
+                            }
+                        }
+                    }
+                    for (c = 0; c < 6; ++c) {   // B^T d
+                        winograd_bt_6(d + c*WINOGRAD_LANES, 6 * WINOGRAD_LANES, tmp + c*WINOGRAD_LANES, 6 * WINOGRAD_LANES);
+                    }
+                    for (r = 0; r < 6; ++r) {   // (B^T d) B
+                        winograd_bt_6(tmp + r * 6 * WINOGRAD_LANES, WINOGRAD_LANES, vt + r * 6 * WINOGRAD_LANES, WINOGRAD_LANES);
+                    }
+                    for (xi = 0; xi < 36; ++xi) {
+                        memcpy(v + ((size_t)xi*channels + ch)*block + p, vt + xi*WINOGRAD_LANES, WINOGRAD_LANES * sizeof(float));
+                    }
+                }
+            }
+
+            // M[xi] = U[xi] * V[xi]
+            memset(m, 0, (size_t)36 * n * block * sizeof(float));
+            for (xi = 0; xi < 36; ++xi) {
+                gemm_cpu(0, 0, n, p_cur, channels, 1,
+                    transformed_weights + (size_t)xi*n*channels, channels,
+                    v + (size_t)xi*channels*block, block,
+                    1, m + (size_t)xi*n*block, block);
+            }
+
+            // Y = A^T M A
+            for (p = 0; p < p_cur; p += WINOGRAD_LANES) {
+                const int lanes = (p_cur - p < WINOGRAD_LANES) ? (p_cur - p) : WINOGRAD_LANES;
+                for (l = 0; l < WINOGRAD_LANES; ++l) {
+                    y0[l] = ((p0 + p + l) / tiles_w) * 4;
+                    x0[l] = ((p0 + p + l) % tiles_w) * 4;
+                }
+                for (k = 0; k < n; ++k) {
+                    float *dst = output + (size_t)k*out_h*out_w;
+                    for (xi = 0; xi < 36; ++xi) {
+                        memcpy(d + xi*WINOGRAD_LANES, m + ((size_t)xi*n + k)*block + p, WINOGRAD_LANES * sizeof(float));
+                    }
+                    for (c = 0; c < 6; ++c) {   // A^T M
+                        winograd_at_6(d + c*WINOGRAD_LANES, 6 * WINOGRAD_LANES, tmp + c*WINOGRAD_LANES, 6 * WINOGRAD_LANES);
+                    }
+                    for (r = 0; r < 4; ++r) {   // (A^T M) A
+                        winograd_at_6(tmp + r * 6 * WINOGRAD_LANES, WINOGRAD_LANES, vt + r * 4 * WINOGRAD_LANES, WINOGRAD_LANES);
+                    }
+                    for (l = 0; l < lanes; ++l) {
+                        for (r = 0; r < 4 && y0[l] + r < out_h; ++r) {
+                            const size_t pos = (size_t)(y0[l] + r)*out_w + x0[l];
+                            const int len = (out_w - x0[l] < 4) ? out_w - x0[l] : 4;
+                            for (c = 0; c < len; ++c) dst[pos + c] += vt[(r * 4 + c)*WINOGRAD_LANES + l];
+                            if (epilogue) conv_epilogue_row(epilogue, k, dst + pos, (size_t)k*out_h*out_w + pos, len);
+                        }
+                    }
+                }
+            }
+        }
+
+        free(v);
+        free(m);
+    }
+}
+
+// INT8 convolution for inference:
+// output[n x out_h x out_w] += input_scale * weights_scales[k] * (sum(q_in * q_w) - input_zero_point * weights_sums[k])
+// the input is quantized to uint8 once per call and stored zero-point padded as NHWC with 4 channels per 32-bit word,
+// so every (ky, kx, 4-channel group) step is a 4-byte dot product of one input word and 16 filters (see pack_int8_weights())
+
+static void int8_conv_row_scalar(const uint8_t *in, size_t in_row, int c4, int ksize, int stride, int dilation,
+    const int8_t *weights, int out_w, int32_t *acc)
+{
+    int x, ky, kx, g, f, j;
+    for (x = 0; x < out_w; ++x) {
+        int32_t *sum = acc + x * 16;
+        for (f = 0; f < 16; ++f) sum[f] = 0;
+        for (ky = 0; ky < ksize; ++ky) {
+            for (kx = 0; kx < ksize; ++kx) {
+                const uint8_t *src = in + ky*dilation*in_row + ((size_t)x*stride + kx*dilation)*c4 * 4;
+                const int8_t *w = weights + (ky*ksize + kx)*c4 * 64;
+                for (g = 0; g < c4; ++g) {
+                    for (f = 0; f < 16; ++f) {
+                        for (j = 0; j < 4; ++j) sum[f] += src[g * 4 + j] * w[g * 64 + f * 4 + j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+size_t int8_weights_size(int n, int channels, int ksize)
+{
+    return (size_t)((n + 15) / 16) * ksize*ksize * ((channels + 3) / 4) * 64;
+}
+
+// weights[n x channels x ksize x ksize] -> [n/16][ksize][ksize][channels/4][16 filters][4 channels], zero padded
+void pack_int8_weights(int8_t *weights, int n, int channels, int ksize, int8_t *packed)
+{
+    const int c4 = (channels + 3) / 4;
+    int fg, ky, kx, g, f, j;
+    for (fg = 0; fg < (n + 15) / 16; ++fg) {
+        for (ky = 0; ky < ksize; ++ky) {
+            for (kx = 0; kx < ksize; ++kx) {
+                for (g = 0; g < c4; ++g) {
+                    for (f = 0; f < 16; ++f) {
+                        for (j = 0; j < 4; ++j) {
+                            const int k = fg * 16 + f, chan = g * 4 + j;
+                            *packed++ = (k < n && chan < channels) ? weights[((k*channels + chan)*ksize + ky)*ksize + kx] : 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void convolution_2d_int8(float *im, int channels, int height, int width,
+    int ksize, int stride, int pad, int dilation,
+    int8_t *weights, float *weights_scales, int *weights_sums, int n,
+    float input_scale, int input_zero_point, float *output, const conv_epilogue *epilogue)
+{
+    const int out_h = (height + 2 * pad - (dilation * (ksize - 1) + 1)) / stride + 1;
+    const int out_w = (width + 2 * pad - (dilation * (ksize - 1) + 1)) / stride + 1;
+    const int c4 = (channels + 3) / 4;
+    // padded input, also covers the receptive field of the last output pixel when it sticks out
+    const int field_h = (out_h - 1)*stride + (ksize - 1)*dilation + 1;
+    const int field_w = (out_w - 1)*stride + (ksize - 1)*dilation + 1;
+    const int in_h = (height + 2 * pad > field_h) ? height + 2 * pad : field_h;
+    const int in_w = (width + 2 * pad > field_w) ? width + 2 * pad : field_w;
+    const size_t in_row = (size_t)in_w*c4 * 4;
+    const float inv_scale = 1.f / input_scale;
+    const size_t group_size = (size_t)ksize*ksize*c4 * 64;
+    const int groups = (n + 15) / 16;
+    int8_conv_row_t conv_row = get_int8_conv_row();
+    if (!conv_row) conv_row = int8_conv_row_scalar;
+
+    uint8_t *in = (uint8_t *)gemm_scratch_buffer(GEMM_SCRATCH_INT8_INPUT, in_h*in_row);
+
+    int y, t;
+    #pragma omp parallel for
+    for (y = 0; y < in_h; ++y) {
+        uint8_t *dst = in + y*in_row;
+        const int iy = y - pad;
+        int x, chan;
+        memset(dst, input_zero_point, in_row);
+        if (iy < 0 || iy >= height) continue;
+        for (chan = 0; chan < channels; ++chan) {
+            const float *src = im + ((size_t)chan*height + iy)*width;
+            uint8_t *d = dst + (size_t)pad*c4 * 4 + (chan / 4) * 4 + chan % 4;
+            for (x = 0; x < width; ++x) {
+                int q = (int)(src[x] * inv_scale + input_zero_point + 0.5f);
+                q = (q < 0) ? 0 : (q > 255) ? 255 : q;
+                d[(size_t)x*c4 * 4] = (uint8_t)q;
+            }
+        }
+    }
+
+    #pragma omp parallel
+    {
+        int32_t *acc = (int32_t *)calloc((size_t)out_w * 16, sizeof(int32_t));
+        if (!acc) malloc_error();
+
+        #pragma omp for schedule(dynamic, 1)
+        for (t = 0; t < groups*out_h; ++t) {
+            const int fg = t / out_h;
+            const int oy = t % out_h;
+            const int filters = (n - fg * 16 < 16) ? (n - fg * 16) : 16;
+            int f, x;
+            conv_row(in + (size_t)oy*stride*in_row, in_row, c4, ksize, stride, dilation, weights + fg*group_size, out_w, acc);
+            for (f = 0; f < filters; ++f) {
+                const int k = fg * 16 + f;
+                const float scale = input_scale*weights_scales[k];
+                const int32_t offset = input_zero_point*weights_sums[k];
+                float *dst = output + ((size_t)k*out_h + oy)*out_w;
+                for (x = 0; x < out_w; ++x) dst[x] += (acc[x * 16 + f] - offset)*scale;
+                if (epilogue) conv_epilogue_row(epilogue, k, dst, ((size_t)k*out_h + oy)*out_w, out_w);
+            }
+        }
+        free(acc);
+    }
+}
+
 #ifdef GPU
 
 #include <math.h>
@@ -27,8 +27,13 @@ static inline unsigned char get_bit(unsigned char const*const src, size_t index)
 
 int is_avx();
 int is_fma_avx2();
+int is_avx512();
+int is_avx512_vnni();
 
 void float_to_bit(float *src, unsigned char *dst, size_t size);
+void weighted_sum_rows(float *out, const float **rows, const float *w, int taps, int n);
+int any_iou_above(float l, float t, float r, float b, float area, const float *left, const float *top,
+    const float *right, const float *bottom, const float *areas, const float *keep, int n, float thresh);
 
 void transpose_block_SSE4x4(float *A, float *B, const int n, const int m,
     const int lda, const int ldb, const int block_size);
@@ -100,6 +105,37 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float BETA,
         float *C, int ldc);
 
+void gemm_cpu_packed(int TA, int TB, int M, int N, int K, float ALPHA,
+    float *A, int lda,
+    float *B, int ldb,
+    float *C, int ldc);
+
+// inference epilogue of the convolution kernels, applied to each output tile once it is complete:
+// output = activation(output + bias[filter]) + residual, where residual (the [shortcut] input, or NULL)
+// has the same layout as the output
+typedef struct conv_epilogue {
+    float *bias;
+    ACTIVATION activation;
+    float *residual;
+} conv_epilogue;
+
+int can_apply_conv_epilogue(ACTIVATION a);
+
+void convolution_2d_packed(float *im, int channels, int height, int width,
+    int ksize, int stride, int pad, int dilation,
+    float *weights, int n, float *output, const conv_epilogue *epilogue);
+
+void winograd_transform_weights_4x4_3x3(float *weights, int n, int channels, float *transformed);
+void convolution_winograd_4x4_3x3(float *im, int channels, int height, int width, int pad,
+    float *transformed_weights, int n, float *output, const conv_epilogue *epilogue);
+
+size_t int8_weights_size(int n, int channels, int ksize);
+void pack_int8_weights(int8_t *weights, int n, int channels, int ksize, int8_t *packed);
+void convolution_2d_int8(float *im, int channels, int height, int width,
+    int ksize, int stride, int pad, int dilation,
+    int8_t *weights, float *weights_scales, int *weights_sums, int n,
+    float input_scale, int input_zero_point, float *output, const conv_epilogue *epilogue);
+
 #ifdef GPU
 void gemm_ongpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float *A_gpu, int lda,
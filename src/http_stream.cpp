@@ -4,7 +4,7 @@
 
 
 //
-// a single-threaded, multi client(using select), debug webserver - streaming out mjpg.
+// multi client webservers streaming out detections (JSON) and mjpg.
 //  on win, _WIN32 has to be defined, must link against ws2_32.lib (socks on linux are for free)
 //
 
@@ -14,6 +14,12 @@
 #include <algorithm>
 #include <memory>
 #include <mutex>
+#include <deque>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
 using std::cerr;
 using std::endl;
 
@@ -57,6 +63,12 @@ static int close_socket(SOCKET s) {
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #define PORT        unsigned short
 #define SOCKET    int
 #define HOSTENT  struct hostent
@@ -90,52 +102,112 @@ static int close_socket(SOCKET s) {
 #endif // _WIN32
 
 
-class JSON_sender
-{
-    SOCKET sock;
-    SOCKET maxfd;
-    fd_set master;
-    int timeout; // master sock timeout, shutdown after timeout usec.
-    int close_all_sockets;
-
-    int _write(int sock, char const*const s, int len)
-    {
-        if (len < 1) { len = strlen(s); }
-        return ::send(sock, s, len, 0);
-    }
+// Bytes shared by all the clients they are queued for
+typedef std::shared_ptr<const std::string> stream_bytes;
 
-public:
+static stream_bytes make_http_header(const char *content_type)
+{
+    std::string s =
+        "HTTP/1.0 200 OK\r\n"
+        "Server: Mozarella/2.2\r\n"
+        "Accept-Range: bytes\r\n"
+        "Connection: close\r\n"
+        "Max-Age: 0\r\n"
+        "Expires: 0\r\n"
+        "Cache-Control: no-cache, private\r\n"
+        "Pragma: no-cache\r\n"
+        "Content-Type: ";
+    s += content_type;
+    s += "\r\n\r\n";
+    return std::make_shared<const std::string>(s);
+}
 
-    JSON_sender(int port = 0, int _timeout = 400000)
-        : sock(INVALID_SOCKET)
-        , timeout(_timeout)
-    {
-        close_all_sockets = 0;
-        FD_ZERO(&master);
-        if (port)
-            open(port);
-    }
+static bool set_nonblocking(SOCKET s)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
 
-    ~JSON_sender()
-    {
-        close_all();
-        release();
-    }
+static bool socket_would_block()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
 
-    bool release()
-    {
-        if (sock != INVALID_SOCKET)
-            ::shutdown(sock, 2);
-        sock = (INVALID_SOCKET);
-        return false;
-    }
+//
+// A server thread owns the listening socket and all the clients (epoll on linux,
+// select elsewhere). The caller only hands messages over with publish(), which
+// never waits for the network. Every client has a bounded queue: one that can't
+// keep up loses its oldest unsent messages instead of slowing down the others.
+//
+class Stream_sender
+{
+protected:
+    struct message_t {
+        stream_bytes head;      // separator or part header, may be empty
+        stream_bytes body;
+        bool droppable;
+    };
+
+    struct client_t {
+        SOCKET s;
+        std::string request;    // start of the HTTP request, as much as has arrived
+        double accepted_at;     // time point, us
+        bool started;           // response header queued
+        bool ndjson;
+        std::deque<message_t> queue;
+        size_t offset;          // bytes of queue.front() already sent
+        bool want_write;        // waiting for the socket to become writable
+        long long messages;     // published messages queued so far
+        long long dropped;
+        // used by the MJPEG stream
+        int tier;               // quality tier the client gets
+        double fps_cap;         // 0 - every frame
+        double last_frame;      // time point of the last frame queued, us
+        long long dropped_seen;
+        int calm;               // frames in a row without a backlog
+    };
+
+    const char *name;
+    SOCKET sock;
+    int timeout;        // usec to flush the clients when closing
+    static const int request_timeout = 200000;  // usec to wait for the request line
+    size_t max_queue;   // messages per client
 
-    void close_all()
+    void push(client_t &c, stream_bytes head, stream_bytes body, bool droppable)
     {
-        close_all_sockets = 1;
-        write("\n]");   // close JSON array
+        if (droppable && c.queue.size() >= max_queue) {
+            // the message being sent can't be cut short
+            for (auto it = c.queue.begin() + (c.offset > 0 ? 1 : 0); it != c.queue.end(); ++it) {
+                if (!it->droppable) continue;
+                c.queue.erase(it);
+                ++c.dropped;
+                break;
+            }
+        }
+        message_t m = { head, body, droppable };
+        c.queue.push_back(m);
     }
 
+    // queues the response header
+    virtual void start(client_t &c) = 0;
+    // queues one published message, tag as given to publish()
+    virtual void queue_message(client_t &c, stream_bytes const& msg, int tag) = 0;
+    // queues what ends the stream
+    virtual void finish(client_t &c) {}
+    virtual void accepted(client_t &c) {}
+    virtual void removed(client_t &c) {}
+
+    // derived classes open in their constructor and close in their destructor,
+    // so that the server thread never calls into a class that isn't there
     bool open(int port)
     {
         sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -154,111 +226,367 @@ public:
 #endif
         if (::bind(sock, (SOCKADDR*)&address, sizeof(SOCKADDR_IN)) == SOCKET_ERROR)
         {
-            cerr << "error JSON_sender: couldn't bind sock " << sock << " to port " << port << "!" << endl;
+            cerr << "error " << name << ": couldn't bind sock " << sock << " to port " << port << "!" << endl;
             return release();
         }
         if (::listen(sock, 10) == SOCKET_ERROR)
         {
-            cerr << "error JSON_sender: couldn't listen on sock " << sock << " on port " << port << " !" << endl;
+            cerr << "error " << name << ": couldn't listen on sock " << sock << " on port " << port << " !" << endl;
             return release();
         }
-        FD_ZERO(&master);
-        FD_SET(sock, &master);
-        maxfd = sock;
+        set_nonblocking(sock);
+#ifdef __linux__
+        epfd = epoll_create1(0);
+        wakefd = eventfd(0, EFD_NONBLOCK);
+        if (epfd < 0 || wakefd < 0) {
+            cerr << "error " << name << ": epoll/eventfd failed" << endl;
+            return release();
+        }
+        watch(sock, &sock, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wakefd, &wakefd, EPOLLIN, EPOLL_CTL_ADD);
+#endif
+        stop = false;
+        server = std::thread(&Stream_sender::run, this);
         return true;
     }
 
+    void close()
+    {
+        if (!server.joinable()) return;
+        stop = true;
+        wake();
+        server.join();
+        sock = INVALID_SOCKET;  // closed by the server thread
+    }
+
+public:
+
+    Stream_sender(const char *_name, int _timeout, int _max_queue)
+        : name(_name)
+        , sock(INVALID_SOCKET)
+        , timeout(_timeout)
+        , max_queue(_max_queue > 1 ? _max_queue : 2)
+        , stop(false)
+    {
+#ifdef __linux__
+        epfd = -1;
+        wakefd = -1;
+#endif
+    }
+
+    virtual ~Stream_sender()
+    {
+        close();
+        release();
+    }
+
+    bool release()
+    {
+        if (sock != INVALID_SOCKET)
+            ::shutdown(sock, 2);
+        sock = (INVALID_SOCKET);
+        return false;
+    }
+
     bool isOpened()
     {
         return sock != INVALID_SOCKET;
     }
 
-    bool write(char const* outputbuf)
+    // from any thread; the message is sent to every client by the server thread
+    void publish(stream_bytes msg, int tag = 0)
     {
-        fd_set rread = master;
-        struct timeval select_timeout = { 0, 0 };
-        struct timeval socket_timeout = { 0, timeout };
-        if (::select(maxfd + 1, &rread, NULL, NULL, &select_timeout) <= 0)
-            return true; // nothing broken, there's just noone listening
+        if (!isOpened()) return;
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            inbox.push_back(std::make_pair(msg, tag));
+            if (inbox.size() > max_queue) inbox.pop_front();    // the server thread is stalled
+        }
+        wake();
+    }
 
-        int outlen = static_cast<int>(strlen(outputbuf));
+private:
+    std::vector<std::unique_ptr<client_t>> clients;
+    std::deque<std::pair<stream_bytes, int>> inbox;
+    std::mutex inbox_mutex;
+    std::atomic<bool> stop;
+    std::thread server;
+#ifdef __linux__
+    int epfd;
+    int wakefd;
+
+    void watch(int fd, void *ptr, uint32_t events, int op)
+    {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = ptr;
+        if (epoll_ctl(epfd, op, fd, &ev) < 0) cerr << name << ": epoll_ctl failed for " << fd << endl;
+    }
+#endif
 
+    void wake()
+    {
+#ifdef __linux__
+        uint64_t one = 1;
+        if (wakefd >= 0 && ::write(wakefd, &one, sizeof(one)) < 0) {}
+#endif  // elsewhere select() wakes up on its own every 10 ms
+    }
+
+    void accept_clients()
+    {
+        while (true) {
+            SOCKADDR_IN address = { 0 };
 #ifdef _WIN32
-        for (unsigned i = 0; i<rread.fd_count; i++)
-        {
             int addrlen = sizeof(SOCKADDR);
-            SOCKET s = rread.fd_array[i];    // fd_set on win is an array, while ...
 #else
-        for (int s = 0; s <= maxfd; s++)
-        {
             socklen_t addrlen = sizeof(SOCKADDR);
-            if (!FD_ISSET(s, &rread))      // ... on linux it's a bitmask ;)
-                continue;
 #endif
-            if (s == sock) // request on master socket, accept and send main header.
-            {
-                SOCKADDR_IN address = { 0 };
-                SOCKET      client = ::accept(sock, (SOCKADDR*)&address, &addrlen);
-                if (client == SOCKET_ERROR)
-                {
-                    cerr << "error JSON_sender: couldn't accept connection on sock " << sock << " !" << endl;
-                    return false;
+            SOCKET s = ::accept(sock, (SOCKADDR*)&address, &addrlen);
+            if (s == INVALID_SOCKET) {
+                if (!socket_would_block()) cerr << "error " << name << ": couldn't accept connection on sock " << sock << " !" << endl;
+                return;
+            }
+            set_nonblocking(s);
+            client_t *c = new client_t();
+            c->s = s;
+            c->accepted_at = get_time_point();
+            clients.push_back(std::unique_ptr<client_t>(c));
+            accepted(*c);
+#ifdef __linux__
+            watch(s, c, EPOLLIN, EPOLL_CTL_ADD);
+#endif
+            cerr << name << ": new client " << s << endl;
+            // the request line usually comes with the connection
+            if (!read_request(*c)) remove_client(c);
+        }
+    }
+
+    void remove_client(client_t *c)
+    {
+#ifdef __linux__
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->s, NULL);
+#endif
+        removed(*c);
+        int result = close_socket(c->s);
+        cerr << name << ": close client " << c->s << ": " << result << ", dropped " << c->dropped << " messages \n";
+        for (size_t i = 0; i < clients.size(); ++i) {
+            if (clients[i].get() != c) continue;
+            clients[i].swap(clients.back());
+            clients.pop_back();
+            break;
+        }
+    }
+
+    // false - the client has gone
+    bool read_request(client_t &c)
+    {
+        char buf[1024];
+        while (true) {
+            int n = ::recv(c.s, buf, sizeof(buf), 0);
+            if (n == 0) return false;
+            if (n < 0) return socket_would_block();
+            if (c.request.size() < 4096) c.request.append(buf, n);
+        }
+    }
+
+    // false - the client has gone
+    bool flush(client_t &c)
+    {
+        while (!c.queue.empty()) {
+            message_t &m = c.queue.front();
+            const size_t head_len = m.head ? m.head->size() : 0;
+            const size_t total = head_len + (m.body ? m.body->size() : 0);
+            const char *p = c.offset < head_len ? m.head->data() + c.offset : m.body->data() + (c.offset - head_len);
+            const size_t len = c.offset < head_len ? head_len - c.offset : total - c.offset;
+            int n = ::send(c.s, p, (int)len, 0);
+            if (n < 0) {
+                if (!socket_would_block()) return false;
+                set_want_write(c, true);
+                return true;
+            }
+            c.offset += n;
+            if (c.offset == total) {
+                c.queue.pop_front();
+                c.offset = 0;
+            }
+        }
+        set_want_write(c, false);
+        return true;
+    }
+
+    void set_want_write(client_t &c, bool on)
+    {
+        if (c.want_write == on) return;
+        c.want_write = on;
+#ifdef __linux__
+        watch(c.s, &c, on ? EPOLLIN | EPOLLOUT : EPOLLIN, EPOLL_CTL_MOD);
+#endif
+    }
+
+    void deliver_inbox()
+    {
+        std::deque<std::pair<stream_bytes, int>> msgs;
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            msgs.swap(inbox);
+        }
+        double const now = get_time_point();
+        for (auto &msg : msgs) {
+            for (size_t i = 0; i < clients.size(); ++i) {
+                client_t &c = *clients[i];
+                if (!c.started) {
+                    // start() answers according to the request line
+                    if (c.request.find('\n') == std::string::npos && now - c.accepted_at < request_timeout) continue;
+                    start(c);
+                    c.started = true;
                 }
-                if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char *)&socket_timeout, sizeof(socket_timeout)) < 0) {
-                    cerr << "error JSON_sender: SO_RCVTIMEO setsockopt failed\n";
+                queue_message(c, msg.first, msg.second);
+            }
+        }
+        if (msgs.empty()) return;
+        for (size_t i = clients.size(); i-- > 0;) {
+            if (!clients[i]->want_write && !flush(*clients[i])) {
+                cerr << name << ": kill client " << clients[i]->s << endl;
+                remove_client(clients[i].get());
+            }
+        }
+    }
+
+    void run()
+    {
+#ifdef __linux__
+        struct epoll_event events[64];
+        while (!stop) {
+            int n = epoll_wait(epfd, events, 64, -1);
+            for (int i = 0; i < n; ++i) {
+                void *ptr = events[i].data.ptr;
+                if (ptr == &sock) accept_clients();
+                else if (ptr == &wakefd) {
+                    uint64_t count;
+                    if (::read(wakefd, &count, sizeof(count)) < 0) {}
                 }
-                if (setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (char *)&socket_timeout, sizeof(socket_timeout)) < 0) {
-                    cerr << "error JSON_sender: SO_SNDTIMEO setsockopt failed\n";
+                else {
+                    client_t *c = (client_t *)ptr;
+                    bool alive = !(events[i].events & EPOLLERR);
+                    if (alive && (events[i].events & (EPOLLIN | EPOLLHUP))) alive = read_request(*c);
+                    if (alive && (events[i].events & EPOLLOUT)) alive = flush(*c);
+                    if (!alive) remove_client(c);
                 }
-                maxfd = (maxfd>client ? maxfd : client);
-                FD_SET(client, &master);
-                _write(client, "HTTP/1.0 200 OK\r\n", 0);
-                _write(client,
-                    "Server: Mozarella/2.2\r\n"
-                    "Accept-Range: bytes\r\n"
-                    "Connection: close\r\n"
-                    "Max-Age: 0\r\n"
-                    "Expires: 0\r\n"
-                    "Cache-Control: no-cache, private\r\n"
-                    "Pragma: no-cache\r\n"
-                    "Content-Type: application/json\r\n"
-                    //"Content-Type: multipart/x-mixed-replace; boundary=boundary\r\n"
-                    "\r\n", 0);
-                _write(client, "[\n", 0);   // open JSON array
-                int n = _write(client, outputbuf, outlen);
-                cerr << "JSON_sender: new client " << client << endl;
             }
-            else // existing client, just stream pix
-            {
-                //char head[400];
-                // application/x-resource+json or application/x-collection+json -  when you are representing REST resources and collections
-                // application/json or text/json or text/javascript or text/plain.
-                // https://stackoverflow.com/questions/477816/what-is-the-correct-json-content-type
-                //sprintf(head, "\r\nContent-Length: %zu\r\n\r\n", outlen);
-                //sprintf(head, "--boundary\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", outlen);
-                //_write(s, head, 0);
-                if (!close_all_sockets) _write(s, ", \n", 0);
-                int n = _write(s, outputbuf, outlen);
-                if (n < outlen)
-                {
-                    cerr << "JSON_sender: kill client " << s << endl;
-                    ::shutdown(s, 2);
-                    FD_CLR(s, &master);
-                }
-
-                if (close_all_sockets) {
-                    int result = close_socket(s);
-                    cerr << "JSON_sender: close clinet: " << result << " \n";
-                    continue;
+            deliver_inbox();
+        }
+#else
+        while (!stop) {
+            fd_set rd, wr;
+            FD_ZERO(&rd);
+            FD_ZERO(&wr);
+            FD_SET(sock, &rd);
+            SOCKET maxfd = sock;
+            for (auto &c : clients) {
+                FD_SET(c->s, &rd);
+                if (c->want_write) FD_SET(c->s, &wr);
+                maxfd = (maxfd > c->s ? maxfd : c->s);
+            }
+            struct timeval select_timeout = { 0, 10000 };
+            if (::select((int)maxfd + 1, &rd, &wr, NULL, &select_timeout) > 0) {
+                if (FD_ISSET(sock, &rd)) accept_clients();
+                for (size_t i = clients.size(); i-- > 0;) {
+                    client_t *c = clients[i].get();
+                    bool alive = true;
+                    if (FD_ISSET(c->s, &rd)) alive = read_request(*c);
+                    if (alive && FD_ISSET(c->s, &wr)) alive = flush(*c);
+                    if (!alive) remove_client(c);
                 }
             }
+            deliver_inbox();
         }
-        if (close_all_sockets) {
-            int result = close_socket(sock);
-            cerr << "JSON_sender: close acceptor: " << result << " \n\n";
+#endif
+        // let the clients have the end of the stream, for at most `timeout`
+        deliver_inbox();
+        for (auto &c : clients) {
+            if (c->started) finish(*c);
         }
-        return true;
+        const double deadline = get_time_point() + timeout;
+        while (!clients.empty() && get_time_point() < deadline) {
+            for (size_t i = clients.size(); i-- > 0;) {
+                client_t *c = clients[i].get();
+                if (!flush(*c) || c->queue.empty()) remove_client(c);
+            }
+            if (!clients.empty()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
+        while (!clients.empty()) remove_client(clients.back().get());
+        int result = close_socket(sock);
+        cerr << name << ": close acceptor: " << result << " \n\n";
+#ifdef __linux__
+        ::close(wakefd);
+        ::close(epfd);
+#endif
+    }
+};
+// ----------------------------------------
+
+//
+// Detections as one JSON array per client, or NDJSON (one object per line) to
+// the clients whose request asks for a path containing "ndjson".
+//
+class JSON_sender : public Stream_sender
+{
+    stream_bytes array_header, ndjson_header, array_start, separator, array_end;
+    stream_bytes line_of, line;    // NDJSON copy of the last message, server thread only
+
+    static stream_bytes make_bytes(const char *s) { return std::make_shared<const std::string>(s); }
+
+    void start(client_t &c)
+    {
+        // GET /ndjson HTTP/1.1 - only the request line decides
+        size_t const line_end = c.request.find('\n');
+        c.ndjson = c.request.substr(0, line_end).find("ndjson") != std::string::npos;
+        if (c.ndjson) push(c, stream_bytes(), ndjson_header, false);
+        else push(c, array_header, array_start, false);
+    }
+
+    void queue_message(client_t &c, stream_bytes const& msg, int tag)
+    {
+        if (!c.ndjson) {
+            // the separator goes in front of all but the first message,
+            // which therefore must not be dropped
+            push(c, c.messages ? separator : stream_bytes(), msg, c.messages > 0);
+            ++c.messages;
+            return;
+        }
+        if (line_of != msg) {
+            std::string s(*msg);
+            std::replace(s.begin(), s.end(), '\n', ' ');
+            s += '\n';
+            line = std::make_shared<const std::string>(s);
+            line_of = msg;
+        }
+        push(c, stream_bytes(), line, true);
+    }
+
+    void finish(client_t &c)
+    {
+        if (!c.ndjson) push(c, stream_bytes(), array_end, false);
+    }
+
+public:
+
+    JSON_sender(int port = 0, int _timeout = 400000, int _max_queue = 16)
+        : Stream_sender("JSON_sender", _timeout, _max_queue)
+    {
+        array_header = make_http_header("application/json");
+        ndjson_header = make_http_header("application/x-ndjson");
+        array_start = make_bytes("[\n");    // open JSON array
+        separator = make_bytes(", \n");
+        array_end = make_bytes("\n]");      // close JSON array
+        if (port)
+            open(port);
+    }
+
+    ~JSON_sender()
+    {
+        close();
+    }
 };
 // ----------------------------------------
 
@@ -277,7 +605,7 @@ void send_json_custom(char const* send_buf, int port, int timeout)
         std::lock_guard<std::mutex> lock(mtx);
         if(!js_ptr) js_ptr.reset(new JSON_sender(port, timeout));
 
-        js_ptr->write(send_buf);
+        js_ptr->publish(std::make_shared<const std::string>(send_buf));
     }
     catch (...) {
         cerr << " Error in send_json_custom() function \n";
@@ -287,12 +615,14 @@ void send_json_custom(char const* send_buf, int port, int timeout)
 void send_json(detection *dets, int nboxes, int classes, char **names, long long int frame_id, int port, int timeout)
 {
     try {
-        char *send_buf = detection_to_json(dets, nboxes, classes, names, frame_id, NULL);
-
-        send_json_custom(send_buf, port, timeout);
-        std::cout << " JSON-stream sent. \n";
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!js_ptr) js_ptr.reset(new JSON_sender(port, timeout));
 
-        free(send_buf);
+        // formatted in place, then copied once into the message all the clients share
+        static char *send_buf = NULL;
+        static size_t send_buf_size = 0;
+        size_t len = detection_to_json_into(dets, nboxes, classes, names, frame_id, NULL, &send_buf, &send_buf_size);
+        js_ptr->publish(std::make_shared<const std::string>(send_buf, len));
     }
     catch (...) {
         cerr << " Error in send_json() function \n";
@@ -314,177 +644,164 @@ using namespace cv;
 
 
 
-class MJPG_sender
+//
+// The caller only copies its frame into a latest-frame-wins mailbox. Encoder
+// threads, one per quality tier, encode the newest frame once for all the
+// clients of their tier, skipping the frames they were too slow for, and the
+// server thread fans the bytes out. A client whose frames get dropped moves to
+// a lower quality and back up once it keeps up; "?fps=N" in its request caps
+// its frame rate.
+//
+class MJPG_sender : public Stream_sender
 {
-    SOCKET sock;
-    SOCKET maxfd;
-    fd_set master;
-    int timeout; // master sock timeout, shutdown after timeout usec.
-    int quality; // jpeg compression [1..100]
-    int close_all_sockets;
-
-    int _write(int sock, char const*const s, int len)
+    enum { TIERS = 3 };
+    int quality[TIERS];             // jpeg compression [1..100] of each tier
+    std::atomic<int> tier_clients[TIERS];
+    stream_bytes header;
+
+    std::mutex frame_mutex;
+    std::condition_variable frame_ready;
+    std::shared_ptr<cv::Mat> latest;    // the mailbox
+    long long latest_id;
+    std::vector<std::shared_ptr<cv::Mat>> frames;   // reused for the copies
+    bool encoders_stop;
+    std::thread encoders[TIERS];
+
+    void encode_loop(int tier)
     {
-        if (len < 1) { len = strlen(s); }
-        return ::send(sock, s, len, 0);
+        long long done = 0;
+        std::vector<uchar> outbuf;
+        std::vector<int> params;
+        params.push_back(IMWRITE_JPEG_QUALITY);
+        params.push_back(quality[tier]);
+        while (true) {
+            std::shared_ptr<cv::Mat> frame;
+            {
+                std::unique_lock<std::mutex> lock(frame_mutex);
+                frame_ready.wait(lock, [&]() { return encoders_stop || (latest_id > done && tier_clients[tier] > 0); });
+                if (encoders_stop) return;
+                frame = latest;
+                done = latest_id;
+            }
+            cv::imencode(".jpg", *frame, outbuf, params);
+            char head[400];
+            int n = sprintf(head, "--mjpegstream\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", outbuf.size());
+            std::shared_ptr<std::string> part = std::make_shared<std::string>();
+            part->reserve(n + outbuf.size());
+            part->append(head, n);
+            part->append((const char *)outbuf.data(), outbuf.size());
+            publish(part, tier);
+        }
     }
 
-public:
-
-    MJPG_sender(int port = 0, int _timeout = 400000, int _quality = 30)
-        : sock(INVALID_SOCKET)
-        , timeout(_timeout)
-        , quality(_quality)
+    void set_tier(client_t &c, int tier)
     {
-        close_all_sockets = 0;
-        FD_ZERO(&master);
-        if (port)
-            open(port);
+        if (tier < 0) tier = 0;
+        if (tier > TIERS - 1) tier = TIERS - 1;
+        if (tier == c.tier) return;
+        --tier_clients[c.tier];
+        ++tier_clients[tier];
+        c.tier = tier;
+        c.calm = 0;
+        // an encoder that was idle starts with the next frame
+        cerr << name << ": client " << c.s << " quality " << quality[tier] << endl;
     }
 
-    ~MJPG_sender()
+    void accepted(client_t &c)
     {
-        close_all();
-        release();
+        c.tier = 0;
+        ++tier_clients[0];
     }
 
-    bool release()
+    void removed(client_t &c)
     {
-        if (sock != INVALID_SOCKET)
-            ::shutdown(sock, 2);
-        sock = (INVALID_SOCKET);
-        return false;
+        --tier_clients[c.tier];
     }
 
-    void close_all()
+    void start(client_t &c)
     {
-        close_all_sockets = 1;
-        cv::Mat tmp(cv::Size(10, 10), CV_8UC3);
-        write(tmp);
+        // GET /?fps=5 HTTP/1.1
+        std::string const line = c.request.substr(0, c.request.find('\n'));
+        size_t const fps = line.find("fps=");
+        if (fps != std::string::npos) c.fps_cap = atof(line.c_str() + fps + 4);
+        push(c, stream_bytes(), header, false);
     }
 
-    bool open(int port)
+    void queue_message(client_t &c, stream_bytes const& msg, int tag)
     {
-        sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-        SOCKADDR_IN address;
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_family = AF_INET;
-        address.sin_port = htons(port);    // ::htons(port);
-        int reuse = 1;
-        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0)
-            cerr << "setsockopt(SO_REUSEADDR) failed" << endl;
-
-#ifdef SO_REUSEPORT
-        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0)
-            cerr << "setsockopt(SO_REUSEPORT) failed" << endl;
-#endif
-        if (::bind(sock, (SOCKADDR*)&address, sizeof(SOCKADDR_IN)) == SOCKET_ERROR)
-        {
-            cerr << "error MJPG_sender: couldn't bind sock " << sock << " to port " << port << "!" << endl;
-            return release();
+        if (tag != c.tier) return;
+        if (c.dropped > c.dropped_seen) {
+            c.dropped_seen = c.dropped;
+            set_tier(c, c.tier + 1);
         }
-        if (::listen(sock, 10) == SOCKET_ERROR)
-        {
-            cerr << "error MJPG_sender: couldn't listen on sock " << sock << " on port " << port << " !" << endl;
-            return release();
+        else if (c.queue.size() <= 1 && ++c.calm > 100) {   // ~3 s at 30 fps
+            set_tier(c, c.tier - 1);
         }
-        FD_ZERO(&master);
-        FD_SET(sock, &master);
-        maxfd = sock;
-        return true;
+        double const now = get_time_point();
+        if (c.fps_cap > 0 && now - c.last_frame < 1000000 / c.fps_cap) return;
+        c.last_frame = now;
+        push(c, stream_bytes(), msg, true);
     }
 
-    bool isOpened()
+public:
+
+    MJPG_sender(int port = 0, int _timeout = 400000, int _quality = 30)
+        : Stream_sender("MJPG_sender", _timeout, 2)
+        , latest_id(0)
+        , encoders_stop(false)
     {
-        return sock != INVALID_SOCKET;
+        // no std::min/max, windows.h may define them as macros
+        if (_quality < 1) _quality = 1;
+        if (_quality > 100) _quality = 100;
+        quality[0] = _quality;
+        quality[1] = _quality * 2 / 3;
+        quality[2] = _quality / 3;
+        for (int i = 1; i < TIERS; ++i) if (quality[i] < 1) quality[i] = 1;
+        for (int i = 0; i < TIERS; ++i) tier_clients[i] = 0;
+        header = make_http_header("multipart/x-mixed-replace; boundary=mjpegstream");
+        if (port && open(port)) {
+            for (int i = 0; i < TIERS; ++i) encoders[i] = std::thread(&MJPG_sender::encode_loop, this, i);
+        }
     }
 
-    bool write(const Mat & frame)
+    ~MJPG_sender()
     {
-        fd_set rread = master;
-        struct timeval select_timeout = { 0, 0 };
-        struct timeval socket_timeout = { 0, timeout };
-        if (::select(maxfd + 1, &rread, NULL, NULL, &select_timeout) <= 0)
-            return true; // nothing broken, there's just noone listening
-
-        std::vector<uchar> outbuf;
-        std::vector<int> params;
-        params.push_back(IMWRITE_JPEG_QUALITY);
-        params.push_back(quality);
-        cv::imencode(".jpg", frame, outbuf, params);  //REMOVED FOR COMPATIBILITY
-        // https://docs.opencv.org/3.4/d4/da8/group__imgcodecs.html#ga292d81be8d76901bff7988d18d2b42ac
-        //std::cerr << "cv::imencode call disabled!" << std::endl;
-        size_t outlen = outbuf.size();
-
-#ifdef _WIN32
-        for (unsigned i = 0; i<rread.fd_count; i++)
         {
-            int addrlen = sizeof(SOCKADDR);
-            SOCKET s = rread.fd_array[i];    // fd_set on win is an array, while ...
-#else
-        for (int s = 0; s <= maxfd; s++)
+            std::lock_guard<std::mutex> lock(frame_mutex);
+            encoders_stop = true;
+        }
+        frame_ready.notify_all();
+        for (int i = 0; i < TIERS; ++i) {
+            if (encoders[i].joinable()) encoders[i].join();
+        }
+        close();
+    }
+
+    // copies the frame into the mailbox, nothing is encoded or sent on the caller's thread
+    void write(const Mat & frame)
+    {
+        int watching = 0;
+        for (int i = 0; i < TIERS; ++i) watching += tier_clients[i];
+        if (!isOpened() || !watching) return;
         {
-            socklen_t addrlen = sizeof(SOCKADDR);
-            if (!FD_ISSET(s, &rread))      // ... on linux it's a bitmask ;)
-                continue;
-#endif
-            if (s == sock) // request on master socket, accept and send main header.
-            {
-                SOCKADDR_IN address = { 0 };
-                SOCKET      client = ::accept(sock, (SOCKADDR*)&address, &addrlen);
-                if (client == SOCKET_ERROR)
-                {
-                    cerr << "error MJPG_sender: couldn't accept connection on sock " << sock << " !" << endl;
-                    return false;
-                }
-                if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char *)&socket_timeout, sizeof(socket_timeout)) < 0) {
-                    cerr << "error MJPG_sender: SO_RCVTIMEO setsockopt failed\n";
+            std::lock_guard<std::mutex> lock(frame_mutex);
+            // a copy no encoder holds any more
+            std::shared_ptr<cv::Mat> copy;
+            for (auto &f : frames) {
+                if (f.use_count() == 1) {
+                    copy = f;
+                    break;
                 }
-                if (setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (char *)&socket_timeout, sizeof(socket_timeout)) < 0) {
-                    cerr << "error MJPG_sender: SO_SNDTIMEO setsockopt failed\n";
-                }
-                maxfd = (maxfd>client ? maxfd : client);
-                FD_SET(client, &master);
-                _write(client, "HTTP/1.0 200 OK\r\n", 0);
-                _write(client,
-                    "Server: Mozarella/2.2\r\n"
-                    "Accept-Range: bytes\r\n"
-                    "Connection: close\r\n"
-                    "Max-Age: 0\r\n"
-                    "Expires: 0\r\n"
-                    "Cache-Control: no-cache, private\r\n"
-                    "Pragma: no-cache\r\n"
-                    "Content-Type: multipart/x-mixed-replace; boundary=mjpegstream\r\n"
-                    "\r\n", 0);
-                cerr << "MJPG_sender: new client " << client << endl;
             }
-            else // existing client, just stream pix
-            {
-                if (close_all_sockets) {
-                    int result = close_socket(s);
-                    cerr << "MJPG_sender: close clinet: " << result << " \n";
-                    continue;
-                }
-
-                char head[400];
-                sprintf(head, "--mjpegstream\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", outlen);
-                _write(s, head, 0);
-                int n = _write(s, (char*)(&outbuf[0]), outlen);
-                //cerr << "known client " << s << " " << n << endl;
-                if (n < outlen)
-                {
-                    cerr << "MJPG_sender: kill client " << s << endl;
-                    ::shutdown(s, 2);
-                    FD_CLR(s, &master);
-                }
+            if (!copy) {
+                copy = std::make_shared<cv::Mat>();
+                frames.push_back(copy);
             }
+            frame.copyTo(*copy);
+            latest = copy;
+            ++latest_id;
         }
-        if (close_all_sockets) {
-            int result = close_socket(sock);
-            cerr << "MJPG_sender: close acceptor: " << result << " \n\n";
-        }
-        return true;
+        frame_ready.notify_all();
     }
 };
 // ----------------------------------------
@@ -500,7 +817,6 @@ void send_mjpeg(mat_cv* mat, int port, int timeout, int quality)
         static MJPG_sender wri(port, timeout, quality);
         //cv::Mat mat = cv::cvarrToMat(ipl);
         wri.write(*mat);
-        std::cout << " MJPEG-stream sent. \n";
     }
     catch (...) {
         cerr << " Error in send_mjpeg() function \n";
@@ -1,6 +1,8 @@
 #include "image.h"
+#include "image_cache.h"
 #include "utils.h"
 #include "blas.h"
+#include "gemm.h"
 #include "dark_cuda.h"
 #include <stdio.h>
 #ifndef _USE_MATH_DEFINES
@@ -56,11 +58,6 @@ static void set_pixel(image m, int x, int y, int c, float val)
     assert(x < m.w && y < m.h && c < m.c);
     m.data[c*m.h*m.w + y*m.w + x] = val;
 }
-static void add_pixel(image m, int x, int y, int c, float val)
-{
-    assert(x < m.w && y < m.h && c < m.c);
-    m.data[c*m.h*m.w + y*m.w + x] += val;
-}
 
 void composite_image(image source, image dest, int dx, int dy)
 {
@@ -923,42 +920,239 @@ void fill_image(image m, float s)
     for (i = 0; i < m.h*m.w*m.c; ++i) m.data[i] = s;
 }
 
-void letterbox_image_into(image im, int w, int h, image boxed)
+// Separable resampler shared by resize_image(), letterbox_image() and the
+// 8-bit *_bytes_into() functions. Each output pixel is sum_t weights[t] * src[index[t]]
+// along one axis; indices are already clamped to the source.
+typedef struct resample_axis {
+    int taps;
+    int *index;     // out * taps
+    float *weights; // out * taps
+} resample_axis;
+
+// filter == 0 is the bilinear scheme resize_image() always used (corner
+// pixels aligned, bit-exact with the old code). filter == 1 uses a tent
+// filter as wide as the scale factor when shrinking, so every source pixel
+// contributes and small objects don't alias away; enlarging stays bilinear.
+// filter == 2 is bilinear with pixel centres aligned, as cv::resize(INTER_LINEAR).
+// last_is_edge: the last output sample copies the last input pixel (the
+// horizontal pass), otherwise its second weight is dropped (the vertical pass).
+static resample_axis make_resample_axis(int in, int out, int filter, int last_is_edge)
+{
+    resample_axis a;
+    int i, t;
+    if (filter == 1 && in > out) {
+        float scale = (float)in / out;
+        a.taps = (int)ceil(2 * scale) + 1;
+        a.index = (int*)calloc(out * a.taps, sizeof(int));
+        a.weights = (float*)calloc(out * a.taps, sizeof(float));
+        for (i = 0; i < out; ++i) {
+            float center = (i + .5f)*scale - .5f;
+            int first = (int)floor(center - scale) + 1;
+            float sum = 0;
+            for (t = 0; t < a.taps; ++t) {
+                float wt = 1 - fabs(first + t - center) / scale;
+                a.weights[i*a.taps + t] = wt > 0 ? wt : 0;
+                sum += a.weights[i*a.taps + t];
+            }
+            for (t = 0; t < a.taps; ++t) {
+                a.index[i*a.taps + t] = constrain_int(first + t, 0, in - 1);
+                a.weights[i*a.taps + t] /= sum;
+            }
+        }
+        return a;
+    }
+    a.taps = 2;
+    a.index = (int*)calloc(out * 2, sizeof(int));
+    a.weights = (float*)calloc(out * 2, sizeof(float));
+    if (filter == 2) {
+        float scale = (float)in / out;
+        for (i = 0; i < out; ++i) {
+            float s = (i + .5f)*scale - .5f;
+            int ix = (int)floor(s);
+            float d = s - ix;
+            if (ix < 0) {
+                ix = 0;
+                d = 0;
+            }
+            if (ix >= in - 1) {
+                ix = in - 1;
+                d = 0;
+            }
+            a.index[i*2] = ix;
+            a.index[i*2 + 1] = constrain_int(ix + 1, 0, in - 1);
+            a.weights[i*2] = 1 - d;
+            a.weights[i*2 + 1] = d;
+        }
+        return a;
+    }
+    float scale = out > 1 ? (float)(in - 1) / (out - 1) : 0;
+    for (i = 0; i < out; ++i) {
+        int last = (i == out - 1 || in == 1);
+        float s = i*scale;
+        int ix = (int)s;
+        float d = s - ix;
+        if (last && last_is_edge) {
+            ix = in - 1;
+            d = 0;
+        }
+        a.index[i*2] = constrain_int(ix, 0, in - 1);
+        a.index[i*2 + 1] = constrain_int(ix + 1, 0, in - 1);
+        a.weights[i*2] = 1 - d;
+        a.weights[i*2 + 1] = last ? 0 : d;
+    }
+    return a;
+}
+
+static void free_resample_axis(resample_axis a)
+{
+    free(a.index);
+    free(a.weights);
+}
+
+// Resamples a w x h source into the new_w x new_h window of dst at (dx, dy),
+// reading either planar floats (fsrc, as in image) or interleaved 8-bit
+// pixels (bsrc, stride bytes per row, swap_rb for BGR input), converting
+// and normalizing to [0, 1] on the way. Source rows are resampled
+// horizontally into a small ring buffer once each, then the vertical pass
+// runs over whole rows with weighted_sum_rows().
+static void resample_into(const float *fsrc, const unsigned char *bsrc, int w, int h, int src_c, int stride, int swap_rb,
+    image dst, int dx, int dy, int new_w, int new_h, int filter)
+{
+    int i, k, r, t;
+    int c = dst.c < src_c ? dst.c : src_c;
+    resample_axis ax = make_resample_axis(w, new_w, filter, 1);
+    resample_axis ay = make_resample_axis(h, new_h, filter, 0);
+    int ring = ay.taps;
+    float *rows = (float*)calloc((size_t)ring * c * new_w, sizeof(float));
+    int *tags = (int*)calloc(ring, sizeof(int));
+    for (i = 0; i < ring; ++i) tags[i] = -1;
+    const float **taps = (const float**)calloc(ay.taps, sizeof(float*));
+    const float **krows = (const float**)calloc(ay.taps, sizeof(float*));
+    float lut[256];
+    for (i = 0; i < 256; ++i) lut[i] = (float)i / 255.;
+
+    for (r = 0; r < new_h; ++r) {
+        for (t = 0; t < ay.taps; ++t) {
+            int y = ay.index[r*ay.taps + t];
+            int slot = y % ring;
+            float *row = rows + (size_t)slot * c * new_w;
+            if (tags[slot] != y) {
+                tags[slot] = y;
+                for (k = 0; k < c; ++k) {
+                    float *out = row + k*new_w;
+                    if (fsrc) {
+                        const float *in = fsrc + (size_t)k*w*h + (size_t)y*w;
+                        if (ax.taps == 2) {
+                            for (i = 0; i < new_w; ++i) {
+                                out[i] = ax.weights[2*i] * in[ax.index[2*i]] + ax.weights[2*i + 1] * in[ax.index[2*i + 1]];
+                            }
+                        }
+                        else for (i = 0; i < new_w; ++i) {
+                            const int *idx = ax.index + i*ax.taps;
+                            const float *wt = ax.weights + i*ax.taps;
+                            float val = wt[0] * in[idx[0]];
+                            int j;
+                            for (j = 1; j < ax.taps; ++j) val += wt[j] * in[idx[j]];
+                            out[i] = val;
+                        }
+                    }
+                    else {
+                        int sk = (swap_rb && src_c >= 3 && k < 3) ? 2 - k : k;
+                        const unsigned char *in = bsrc + (size_t)y*stride + sk;
+                        if (ax.taps == 2) {
+                            for (i = 0; i < new_w; ++i) {
+                                out[i] = ax.weights[2*i] * lut[in[ax.index[2*i] * src_c]] + ax.weights[2*i + 1] * lut[in[ax.index[2*i + 1] * src_c]];
+                            }
+                        }
+                        else for (i = 0; i < new_w; ++i) {
+                            const int *idx = ax.index + i*ax.taps;
+                            const float *wt = ax.weights + i*ax.taps;
+                            float val = wt[0] * lut[in[idx[0] * src_c]];
+                            int j;
+                            for (j = 1; j < ax.taps; ++j) val += wt[j] * lut[in[idx[j] * src_c]];
+                            out[i] = val;
+                        }
+                    }
+                }
+            }
+            taps[t] = row;
+        }
+        for (k = 0; k < c; ++k) {
+            for (t = 0; t < ay.taps; ++t) krows[t] = taps[t] + k*new_w;
+            weighted_sum_rows(dst.data + (size_t)k*dst.w*dst.h + (size_t)(dy + r)*dst.w + dx, krows, ay.weights + r*ay.taps, ay.taps, new_w);
+        }
+    }
+    free(krows);
+    free(taps);
+    free(tags);
+    free(rows);
+    free_resample_axis(ax);
+    free_resample_axis(ay);
+}
+
+image resize_image(image im, int w, int h)
+{
+    image resized = make_image(w, h, im.c);
+    resample_into(im.data, NULL, im.w, im.h, im.c, 0, 0, resized, 0, 0, w, h, 0);
+    return resized;
+}
+
+void resize_image_into(image im, image dst)
+{
+    resample_into(im.data, NULL, im.w, im.h, im.c, 0, 0, dst, 0, 0, dst.w, dst.h, 0);
+}
+
+void resize_bytes_into(const unsigned char *src, int w, int h, int c, int stride, int swap_rb, image dst, int filter)
+{
+    resample_into(NULL, src, w, h, c, stride, swap_rb, dst, 0, 0, dst.w, dst.h, filter);
+}
+
+static void letterbox_size(int im_w, int im_h, int w, int h, int *new_w, int *new_h)
 {
-    int new_w = im.w;
-    int new_h = im.h;
-    if (((float)w / im.w) < ((float)h / im.h)) {
-        new_w = w;
-        new_h = (im.h * w) / im.w;
+    if (((float)w / im_w) < ((float)h / im_h)) {
+        *new_w = w;
+        *new_h = (im_h * w) / im_w;
     }
     else {
-        new_h = h;
-        new_w = (im.w * h) / im.h;
+        *new_h = h;
+        *new_w = (im_w * h) / im_h;
     }
-    image resized = resize_image(im, new_w, new_h);
-    embed_image(resized, boxed, (w - new_w) / 2, (h - new_h) / 2);
-    free_image(resized);
 }
 
-image letterbox_image(image im, int w, int h)
+void letterbox_bytes_into(const unsigned char *src, int w, int h, int c, int stride, int swap_rb, image dst, int filter)
 {
-    int new_w = im.w;
-    int new_h = im.h;
-    if (((float)w / im.w) < ((float)h / im.h)) {
-        new_w = w;
-        new_h = (im.h * w) / im.w;
-    }
-    else {
-        new_h = h;
-        new_w = (im.w * h) / im.h;
+    int new_w, new_h, k, y;
+    letterbox_size(w, h, dst.w, dst.h, &new_w, &new_h);
+    int dx = (dst.w - new_w) / 2;
+    int dy = (dst.h - new_h) / 2;
+    // only the borders: the window is written by the resampler
+    for (k = 0; k < dst.c; ++k) {
+        float *plane = dst.data + (size_t)k*dst.w*dst.h;
+        for (y = 0; y < dst.h; ++y) {
+            float *row = plane + (size_t)y*dst.w;
+            if (y < dy || y >= dy + new_h) fill_cpu(dst.w, .5, row, 1);
+            else {
+                fill_cpu(dx, .5, row, 1);
+                fill_cpu(dst.w - dx - new_w, .5, row + dx + new_w, 1);
+            }
+        }
     }
-    image resized = resize_image(im, new_w, new_h);
+    resample_into(NULL, src, w, h, c, stride, swap_rb, dst, dx, dy, new_w, new_h, filter);
+}
+
+
+void letterbox_image_into(image im, int w, int h, image boxed)
+{
+    int new_w, new_h;
+    letterbox_size(im.w, im.h, w, h, &new_w, &new_h);
+    resample_into(im.data, NULL, im.w, im.h, im.c, 0, 0, boxed, (w - new_w) / 2, (h - new_h) / 2, new_w, new_h, 0);
+}
+
+image letterbox_image(image im, int w, int h)
+{
     image boxed = make_image(w, h, im.c);
     fill_image(boxed, .5);
-    //int i;
-    //for(i = 0; i < boxed.w*boxed.h*boxed.c; ++i) boxed.data[i] = 0;
-    embed_image(resized, boxed, (w - new_w) / 2, (h - new_h) / 2);
-    free_image(resized);
+    letterbox_image_into(im, w, h, boxed);
     return boxed;
 }
 
@@ -1273,51 +1467,6 @@ float bilinear_interpolate(image im, float x, float y, int c)
     return val;
 }
 
-image resize_image(image im, int w, int h)
-{
-    image resized = make_image(w, h, im.c);
-    image part = make_image(w, im.h, im.c);
-    int r, c, k;
-    float w_scale = (float)(im.w - 1) / (w - 1);
-    float h_scale = (float)(im.h - 1) / (h - 1);
-    for(k = 0; k < im.c; ++k){
-        for(r = 0; r < im.h; ++r){
-            for(c = 0; c < w; ++c){
-                float val = 0;
-                if(c == w-1 || im.w == 1){
-                    val = get_pixel(im, im.w-1, r, k);
-                } else {
-                    float sx = c*w_scale;
-                    int ix = (int) sx;
-                    float dx = sx - ix;
-                    val = (1 - dx) * get_pixel(im, ix, r, k) + dx * get_pixel(im, ix+1, r, k);
-                }
-                set_pixel(part, c, r, k, val);
-            }
-        }
-    }
-    for(k = 0; k < im.c; ++k){
-        for(r = 0; r < h; ++r){
-            float sy = r*h_scale;
-            int iy = (int) sy;
-            float dy = sy - iy;
-            for(c = 0; c < w; ++c){
-                float val = (1-dy) * get_pixel(part, c, iy, k);
-                set_pixel(resized, c, r, k, val);
-            }
-            if(r == h-1 || im.h == 1) continue;
-            for(c = 0; c < w; ++c){
-                float val = dy * get_pixel(part, c, iy+1, k);
-                add_pixel(resized, c, r, k, val);
-            }
-        }
-    }
-
-    free_image(part);
-    return resized;
-}
-
-
 void test_resize(char *filename)
 {
     image im = load_image(filename, 0,0, 3);
@@ -1369,6 +1518,23 @@ void test_resize(char *filename)
 }
 
 
+// interleaved 8-bit HWC -> planar float CHW in [0, 1]
+static image bytes_to_image(const unsigned char *data, int w, int h, int c)
+{
+    int i,j,k;
+    image im = make_image(w, h, c);
+    for(k = 0; k < c; ++k){
+        for(j = 0; j < h; ++j){
+            for(i = 0; i < w; ++i){
+                int dst_index = i + w*j + w*h*k;
+                int src_index = k + c*i + c*w*j;
+                im.data[dst_index] = (float)data[src_index]/255.;
+            }
+        }
+    }
+    return im;
+}
+
 image load_image_stb(char *filename, int channels)
 {
     int w, h, c;
@@ -1388,17 +1554,35 @@ image load_image_stb(char *filename, int channels)
         //exit(EXIT_FAILURE);
     }
     if(channels) c = channels;
-    int i,j,k;
-    image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
+    image im = bytes_to_image(data, w, h, c);
+    free(data);
+    return im;
+}
+
+// Same as load_image_stb(), but the decoded bytes go through the image cache.
+// buf/size hold the encoded file when it is already in memory (packed
+// datasets); otherwise buf is NULL and filename is read.
+image load_image_stb_cached(char *filename, const unsigned char *buf, size_t size, int channels)
+{
+    long long mtime = buf ? 0 : image_cache_mtime(filename);
+    cached_image *ci = image_cache_get(filename, channels, mtime);
+    if (ci) {
+        image im = bytes_to_image(ci->data, ci->w, ci->h, ci->c);
+        image_cache_release(ci);
+        return im;
+    }
+    int w, h, c;
+    unsigned char *data;
+    if (buf) data = stbi_load_from_memory(buf, (int)size, &w, &h, &c, channels);
+    else data = stbi_load(filename, &w, &h, &c, channels);
+    if (!data) {
+        if (!buf) return load_image_stb(filename, channels);   // reports the failure
+        fprintf(stderr, "Cannot decode packed image \"%s\"\nSTB Reason: %s\n", filename, stbi_failure_reason());
+        return make_image(10, 10, channels ? channels : 3);
     }
+    if (channels) c = channels;
+    image_cache_put(filename, channels, mtime, w, h, c, data);
+    image im = bytes_to_image(data, w, h, c);
     free(data);
     return im;
 }
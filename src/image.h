@@ -41,6 +41,13 @@ void random_distort_image(image im, float hue, float saturation, float exposure)
 //LIB_API void copy_image_from_bytes(image im, char *pdata);
 void fill_image(image m, float s);
 void letterbox_image_into(image im, int w, int h, image boxed);
+void resize_image_into(image im, image dst);
+// interleaved 8-bit pixels (stride bytes per row; BGR if swap_rb) resized or
+// letterboxed straight into the planar [0, 1] network input dst in one pass;
+// filter: 0 - bilinear with the corner pixels aligned, as resize_image();
+// 1 - low-passes when shrinking; 2 - bilinear at pixel centres, as cv::resize()
+void resize_bytes_into(const unsigned char *src, int w, int h, int c, int stride, int swap_rb, image dst, int filter);
+void letterbox_bytes_into(const unsigned char *src, int w, int h, int c, int stride, int swap_rb, image dst, int filter);
 //LIB_API image letterbox_image(image im, int w, int h);
 image resize_min(image im, int min);
 image resize_max(image im, int max);
@@ -82,6 +89,7 @@ image make_empty_image(int w, int h, int c);
 image float_to_image(int w, int h, int c, float *data);
 image copy_image(image p);
 image load_image(char *filename, int w, int h, int c);
+image load_image_stb_cached(char *filename, const unsigned char *buf, size_t size, int channels);
 //LIB_API image load_image_color(char *filename, int w, int h);
 image **load_alphabet();
 
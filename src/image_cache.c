@@ -0,0 +1,162 @@
+#include "image_cache.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define IMAGE_CACHE_BUCKETS (1 << 16)
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cached_image **buckets;
+static cached_image *lru_front, *lru_back;
+static size_t cache_cap, cache_used;
+static int cache_count;
+static unsigned long long cache_hits, cache_misses;
+
+static unsigned int hash_key(const char *path, int channels)
+{
+    unsigned int h = 5381 + channels;
+    while (*path) h = h * 33 + (unsigned char)*path++;
+    return h & (IMAGE_CACHE_BUCKETS - 1);
+}
+
+long long image_cache_mtime(const char *path)
+{
+    if (!cache_cap) return -1;  // nothing is keyed on it, skip the stat()
+    struct stat st;
+    if (stat(path, &st)) return -1;
+    return (long long)st.st_mtime;
+}
+
+static void free_cached_image(cached_image *ci)
+{
+    free(ci->data);
+    free(ci->path);
+    free(ci);
+}
+
+// removes an entry from the hash chain and the LRU list; it is freed now or
+// on its last release
+static void unlink_cached_image(cached_image *ci)
+{
+    cached_image **p = &buckets[hash_key(ci->path, ci->channels)];
+    while (*p != ci) p = &(*p)->hnext;
+    *p = ci->hnext;
+    if (ci->prev) ci->prev->next = ci->next;
+    else lru_front = ci->next;
+    if (ci->next) ci->next->prev = ci->prev;
+    else lru_back = ci->prev;
+    ci->linked = 0;
+    cache_used -= ci->bytes;
+    --cache_count;
+    if (!ci->refs) free_cached_image(ci);
+}
+
+static void push_front(cached_image *ci)
+{
+    ci->prev = 0;
+    ci->next = lru_front;
+    if (lru_front) lru_front->prev = ci;
+    lru_front = ci;
+    if (!lru_back) lru_back = ci;
+}
+
+static cached_image *find_cached_image(const char *path, int channels)
+{
+    cached_image *ci = buckets[hash_key(path, channels)];
+    while (ci && (ci->channels != channels || strcmp(ci->path, path))) ci = ci->hnext;
+    return ci;
+}
+
+void set_image_cache_size(size_t bytes)
+{
+    pthread_mutex_lock(&cache_mutex);
+    if (!buckets && bytes) buckets = (cached_image**)calloc(IMAGE_CACHE_BUCKETS, sizeof(cached_image*));
+    cache_cap = bytes;
+    while (lru_back && cache_used > cache_cap) unlink_cached_image(lru_back);
+    pthread_mutex_unlock(&cache_mutex);
+    if (bytes) printf(" Image cache: %d MB \n", (int)(bytes / (1024 * 1024)));
+}
+
+cached_image *image_cache_get(const char *path, int channels, long long mtime)
+{
+    if (!cache_cap) return NULL;
+    pthread_mutex_lock(&cache_mutex);
+    cached_image *ci = find_cached_image(path, channels);
+    if (ci && ci->mtime != mtime) {
+        unlink_cached_image(ci);
+        ci = 0;
+    }
+    if (ci) {
+        if (ci != lru_front) {
+            ci->prev->next = ci->next;
+            if (ci->next) ci->next->prev = ci->prev;
+            else lru_back = ci->prev;
+            push_front(ci);
+        }
+        ++ci->refs;
+        ++cache_hits;
+    }
+    else ++cache_misses;
+    pthread_mutex_unlock(&cache_mutex);
+    return ci;
+}
+
+void image_cache_release(cached_image *ci)
+{
+    pthread_mutex_lock(&cache_mutex);
+    if (--ci->refs == 0 && !ci->linked) free_cached_image(ci);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void image_cache_put(const char *path, int channels, long long mtime, int w, int h, int c, const unsigned char *data)
+{
+    size_t bytes = (size_t)w * h * c;
+    if (!cache_cap || bytes > cache_cap) return;
+
+    cached_image *ci = (cached_image*)calloc(1, sizeof(cached_image));
+    ci->data = (unsigned char*)malloc(bytes);
+    ci->path = (char*)malloc(strlen(path) + 1);
+    if (!ci->data || !ci->path) {
+        free_cached_image(ci);
+        return;
+    }
+    memcpy(ci->data, data, bytes);
+    strcpy(ci->path, path);
+    ci->channels = channels;
+    ci->mtime = mtime;
+    ci->w = w;
+    ci->h = h;
+    ci->c = c;
+    ci->bytes = bytes;
+
+    pthread_mutex_lock(&cache_mutex);
+    if (find_cached_image(path, channels)) {
+        // another loader thread decoded it first
+        pthread_mutex_unlock(&cache_mutex);
+        free_cached_image(ci);
+        return;
+    }
+    while (lru_back && cache_used + bytes > cache_cap) unlink_cached_image(lru_back);
+    unsigned int k = hash_key(path, channels);
+    ci->hnext = buckets[k];
+    buckets[k] = ci;
+    push_front(ci);
+    ci->linked = 1;
+    cache_used += bytes;
+    ++cache_count;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void print_image_cache_stats()
+{
+    if (!cache_cap) return;
+    pthread_mutex_lock(&cache_mutex);
+    unsigned long long total = cache_hits + cache_misses;
+    printf(" Image cache: %d images, %d of %d MB, hit rate %.1f %% \n", cache_count,
+        (int)(cache_used / (1024 * 1024)), (int)(cache_cap / (1024 * 1024)), total ? 100. * cache_hits / total : 0.);
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,44 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+#include <stddef.h>
+
+// Process-wide cache of decoded 8-bit images (interleaved HWC), keyed by
+// path, requested channels and file mtime, with LRU eviction under a byte
+// cap. Disabled (size 0) by default; the loader threads share one cache.
+typedef struct cached_image {
+    int w, h, c;
+    unsigned char *data;
+    // private
+    char *path;
+    int channels;
+    long long mtime;
+    size_t bytes;
+    int refs;
+    int linked;
+    struct cached_image *prev, *next;   // LRU list, most recently used first
+    struct cached_image *hnext;         // hash chain
+} cached_image;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void set_image_cache_size(size_t bytes);
+
+// mtime of the file the pixels were decoded from; -1 if it does not exist
+// or the cache is disabled
+long long image_cache_mtime(const char *path);
+
+// returns a referenced entry or NULL on a miss; pair with image_cache_release()
+cached_image *image_cache_get(const char *path, int channels, long long mtime);
+void image_cache_release(cached_image *ci);
+
+// stores a copy of data; does nothing if the cache is disabled or the
+// image is bigger than the whole cap
+void image_cache_put(const char *path, int channels, long long mtime, int w, int h, int c, const unsigned char *data);
+
+void print_image_cache_stats();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
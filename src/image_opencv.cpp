@@ -2,6 +2,7 @@
 
 #ifdef OPENCV
 #include "utils.h"
+#include "image_cache.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -125,6 +126,45 @@ mat_cv *load_image_mat_cv(const char *filename, int flag)
 }
 // ----------------------------------------
 
+// Same as load_image_mat_cv(), but the decoded pixels go through the image cache.
+// buf/size hold the encoded file when it is already in memory (packed
+// datasets); otherwise buf is NULL and filename is read.
+mat_cv *load_image_mat_cached(const char *filename, const unsigned char *buf, size_t size, int flag)
+{
+    long long mtime = buf ? 0 : image_cache_mtime(filename);
+    cached_image *ci = image_cache_get(filename, flag, mtime);
+    if (ci) {
+        cv::Mat *mat_ptr = new cv::Mat(ci->h, ci->w, CV_8UC(ci->c));
+        memcpy(mat_ptr->data, ci->data, (size_t)ci->w * ci->h * ci->c);
+        image_cache_release(ci);
+        return (mat_cv *)mat_ptr;
+    }
+    cv::Mat *mat_ptr = NULL;
+    if (buf) {
+        try {
+            cv::Mat encoded(1, (int)size, CV_8UC1, (void *)buf);
+            cv::Mat mat = cv::imdecode(encoded, flag);
+            if (mat.empty()) {
+                cerr << "Cannot decode packed image " << filename << std::endl;
+                return NULL;
+            }
+            if (mat.channels() == 3) cv::cvtColor(mat, mat, cv::COLOR_RGB2BGR);
+            else if (mat.channels() == 4) cv::cvtColor(mat, mat, cv::COLOR_RGBA2BGRA);
+            mat_ptr = new cv::Mat(mat);
+        }
+        catch (...) {
+            cerr << "OpenCV exception: load_image_mat_cached \n";
+            return NULL;
+        }
+    }
+    else mat_ptr = (cv::Mat *)load_image_mat_cv(filename, flag);
+    if (mat_ptr && mat_ptr->isContinuous()) {
+        image_cache_put(filename, flag, mtime, mat_ptr->cols, mat_ptr->rows, mat_ptr->channels(), mat_ptr->data);
+    }
+    return (mat_cv *)mat_ptr;
+}
+// ----------------------------------------
+
 cv::Mat load_image_mat(char *filename, int channels)
 {
     int flag = cv::IMREAD_UNCHANGED;
@@ -665,6 +705,41 @@ double get_capture_frame_count_cv(cap_cv *cap)
 }
 // ----------------------------------------
 
+double get_capture_fps_cv(cap_cv *cap)
+{
+    try {
+        cv::VideoCapture &cpp_cap = *(cv::VideoCapture *)cap;
+#ifndef CV_VERSION_EPOCH    // OpenCV 3.x
+        return cpp_cap.get(cv::CAP_PROP_FPS);
+#else                        // OpenCV 2.x
+        return cpp_cap.get(CV_CAP_PROP_FPS);
+#endif
+    }
+    catch (...) {
+        cerr << " OpenCV exception: Can't get CAP_PROP_FPS of source videofile. \n";
+    }
+    return 0;
+}
+// ----------------------------------------
+
+// timestamp of the last frame read, some backends report 0 for every frame
+double get_capture_position_msec_cv(cap_cv *cap)
+{
+    try {
+        cv::VideoCapture &cpp_cap = *(cv::VideoCapture *)cap;
+#ifndef CV_VERSION_EPOCH    // OpenCV 3.x
+        return cpp_cap.get(cv::CAP_PROP_POS_MSEC);
+#else                        // OpenCV 2.x
+        return cpp_cap.get(CV_CAP_PROP_POS_MSEC);
+#endif
+    }
+    catch (...) {
+        cerr << " OpenCV exception: Can't get CAP_PROP_POS_MSEC of source videofile. \n";
+    }
+    return 0;
+}
+// ----------------------------------------
+
 int set_capture_property_cv(cap_cv *cap, int property_id, double value)
 {
     try {
@@ -766,10 +841,23 @@ image get_image_from_stream_resize(cap_cv *cap, int w, int h, int c, mat_cv** in
 
     *(cv::Mat **)in_img = src;
 
-    cv::Mat new_img = cv::Mat(h, w, CV_8UC(c));
-    cv::resize(*src, new_img, new_img.size(), 0, 0, cv::INTER_LINEAR);
-    if (c>1) cv::cvtColor(new_img, new_img, cv::COLOR_RGB2BGR);
-    image im = mat_to_image(new_img);
+    // w or h 0: the frame keeps its size
+    if (w <= 0 || h <= 0) {
+        w = src->cols;
+        h = src->rows;
+    }
+    image im;
+    if (src->depth() == CV_8U && src->channels() == c) {
+        // resize, BGR->RGB and normalize in one pass straight from the frame
+        im = make_image(w, h, c);
+        resize_bytes_into(src->data, src->cols, src->rows, c, (int)src->step, c > 1, im, 2);
+    }
+    else {
+        cv::Mat new_img = cv::Mat(h, w, CV_8UC(c));
+        cv::resize(*src, new_img, new_img.size(), 0, 0, cv::INTER_LINEAR);
+        if (c>1) cv::cvtColor(new_img, new_img, cv::COLOR_RGB2BGR);
+        im = mat_to_image(new_img);
+    }
 
     //show_image_cv(im, "im");
     //show_image_mat(*in_img, "in_img");
@@ -798,10 +886,17 @@ image get_image_from_stream_letterbox(cap_cv *cap, int w, int h, int c, mat_cv**
     *in_img = (mat_cv *)new cv::Mat(src->rows, src->cols, CV_8UC(c));
     cv::resize(*src, **in_img, (*in_img)->size(), 0, 0, cv::INTER_LINEAR);
 
-    if (c>1) cv::cvtColor(*src, *src, cv::COLOR_RGB2BGR);
-    image tmp = mat_to_image(*src);
-    image im = letterbox_image(tmp, w, h);
-    free_image(tmp);
+    image im;
+    if (src->depth() == CV_8U && src->channels() == c) {
+        im = make_image(w, h, c);
+        letterbox_bytes_into(src->data, src->cols, src->rows, c, (int)src->step, c > 1, im, 0);
+    }
+    else {
+        if (c>1) cv::cvtColor(*src, *src, cv::COLOR_RGB2BGR);
+        image tmp = mat_to_image(*src);
+        im = letterbox_image(tmp, w, h);
+        free_image(tmp);
+    }
     release_mat((mat_cv **)&src);
 
     //show_image_cv(im, "im");
@@ -810,6 +905,40 @@ image get_image_from_stream_letterbox(cap_cv *cap, int w, int h, int c, mat_cv**
 }
 // ----------------------------------------
 
+mat_cv *get_stream_frame_cv(cap_cv *cap, int retries)
+{
+    int i;
+    for (i = 0; i <= retries; ++i) {
+        cv::Mat *src = (cv::Mat *)get_capture_frame_cv(cap);
+        if (src->cols > 0 && src->rows > 0 && src->channels() > 0) return (mat_cv *)src;
+        delete src;
+    }
+    return NULL;
+}
+// ----------------------------------------
+
+void mat_to_image_resize_cv(mat_cv *mat, image dst, int letterbox)
+{
+    cv::Mat &src = *(cv::Mat *)mat;
+    cv::Mat converted;
+    const cv::Mat *bytes = &src;
+    if (src.depth() != CV_8U || src.channels() != dst.c) {
+        converted = src;
+        if (converted.channels() != dst.c) {
+            if (dst.c == 1) cv::cvtColor(converted, converted, converted.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+            else if (converted.channels() == 1) cv::cvtColor(converted, converted, cv::COLOR_GRAY2BGR);
+            else if (converted.channels() == 4) cv::cvtColor(converted, converted, cv::COLOR_BGRA2BGR);
+            else error("mat_to_image_resize_cv: unsupported number of channels");
+        }
+        if (converted.depth() != CV_8U) converted.convertTo(converted, CV_8U);
+        bytes = &converted;
+    }
+    // resize, BGR->RGB and normalize in one pass, sampled as letterbox_image() and cv::resize() did
+    if (letterbox) letterbox_bytes_into(bytes->data, bytes->cols, bytes->rows, dst.c, (int)bytes->step, dst.c > 1, dst, 0);
+    else resize_bytes_into(bytes->data, bytes->cols, bytes->rows, dst.c, (int)bytes->step, dst.c > 1, dst, 2);
+}
+// ----------------------------------------
+
 // ====================================================================
 // Image Saving
 // ====================================================================
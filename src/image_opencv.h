@@ -17,6 +17,7 @@ typedef struct write_cv write_cv;
 
 // cv::Mat
 mat_cv *load_image_mat_cv(const char *filename, int flag);
+mat_cv *load_image_mat_cached(const char *filename, const unsigned char *buf, size_t size, int flag);
 image load_image_cv(char *filename, int channels);
 image load_image_resize(char *filename, int w, int h, int c, image *im);
 int get_width_mat(mat_cv *mat);
@@ -71,6 +72,8 @@ mat_cv* get_capture_frame_cv(cap_cv *cap);
 int get_stream_fps_cpp_cv(cap_cv *cap);
 double get_capture_property_cv(cap_cv *cap, int property_id);
 double get_capture_frame_count_cv(cap_cv *cap);
+double get_capture_fps_cv(cap_cv *cap);
+double get_capture_position_msec_cv(cap_cv *cap);
 int set_capture_property_cv(cap_cv *cap, int property_id, double value);
 int set_capture_position_frame_cv(cap_cv *cap, int index);
 
@@ -78,6 +81,10 @@ int set_capture_position_frame_cv(cap_cv *cap, int index);
 image get_image_from_stream_cpp(cap_cv *cap);
 image get_image_from_stream_resize(cap_cv *cap, int w, int h, int c, mat_cv** in_img, int dont_close);
 image get_image_from_stream_letterbox(cap_cv *cap, int w, int h, int c, mat_cv** in_img, int dont_close);
+// next frame of the stream, skipping up to retries empty ones; NULL when the stream has ended
+mat_cv *get_stream_frame_cv(cap_cv *cap, int retries);
+// network input from a frame: resized or letterboxed to dst.w x dst.h, RGB, 0..1
+void mat_to_image_resize_cv(mat_cv *mat, image dst, int letterbox);
 
 
 // Image Saving
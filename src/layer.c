@@ -2,6 +2,13 @@
 #include "dark_cuda.h"
 #include <stdlib.h>
 
+// buffers loaded from .dsw point into the file mapping and must not be free()d
+int is_weights_mapped(layer l, const void *ptr)
+{
+    const char *p = (const char*)ptr;
+    return l.weights_map && p >= l.weights_map && p < l.weights_map + l.weights_map_size;
+}
+
 void free_sublayer(layer *l)
 {
     if (l) {
@@ -72,6 +79,10 @@ void free_layer(layer l)
     if (l.scale_updates)      free(l.scale_updates), l.scale_updates = NULL;
     if (l.weights)            free(l.weights), l.weights = NULL;
     if (l.weight_updates)     free(l.weight_updates), l.weight_updates = NULL;
+    if (l.winograd_weights)   free(l.winograd_weights), l.winograd_weights = NULL;
+    if (l.weights_int8)       free(l.weights_int8), l.weights_int8 = NULL;
+    if (l.weights_int8_scales) free(l.weights_int8_scales), l.weights_int8_scales = NULL;
+    if (l.weights_int8_sums)  free(l.weights_int8_sums), l.weights_int8_sums = NULL;
     if (l.align_bit_weights)  free(l.align_bit_weights);
     if (l.mean_arr)           free(l.mean_arr);
 #ifdef GPU
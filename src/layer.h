@@ -331,6 +331,7 @@ struct layer{
 };
 */
 //void free_layer(layer);
+int is_weights_mapped(layer l, const void *ptr);
 
 #ifdef __cplusplus
 }
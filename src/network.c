@@ -3,12 +3,18 @@
 #include <stdio.h>
 #include <time.h>
 #include <assert.h>
+#include <float.h>
+#include <stdarg.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #include "network.h"
 #include "image.h"
 #include "data.h"
 #include "utils.h"
 #include "blas.h"
+#include "gemm.h"
 
 #include "crop_layer.h"
 #include "connected_layer.h"
@@ -36,6 +42,7 @@
 #include "yolo_layer.h"
 #include "upsample_layer.h"
 #include "parser.h"
+#include "trace.h"
 
 load_args get_base_args(network *net)
 {
@@ -216,6 +223,26 @@ char *get_layer_string(LAYER_TYPE a)
             return "normalization";
         case BATCHNORM:
             return "batchnorm";
+        case SCALE_CHANNELS:
+            return "scale_channels";
+        case CONV_LSTM:
+            return "conv_lstm";
+        case YOLO:
+            return "yolo";
+        case ISEG:
+            return "iseg";
+        case REORG_OLD:
+            return "reorg_old";
+        case UPSAMPLE:
+            return "upsample";
+        case LOGXENT:
+            return "logxent";
+        case L2NORM:
+            return "l2norm";
+        case EMPTY:
+            return "empty";
+        case BLANK:
+            return "blank";
         default:
             break;
     }
@@ -250,9 +277,11 @@ void forward_network(network net, network_state state)
         if(l.delta && state.train){
             scal_cpu(l.outputs * l.batch, 0, l.delta, 1);
         }
-        //double time = get_time_point();
+        double time = net.layer_times ? get_time_point() : 0;
+        unsigned long long span = trace_begin();
         l.forward(l, state);
-        //printf("%d - Predicted in %lf milli-seconds.\n", i, ((double)get_time_point() - time) / 1000);
+        trace_end(get_layer_string(l.type), span);
+        if (net.layer_times) net.layer_times[i] = (get_time_point() - time) / 1000;
         state.input = l.output;
     }
 }
@@ -474,6 +503,56 @@ void set_batch_network(network *net, int b)
     recalculate_workspace_size(net); // recalculate workspace size
 }
 
+// Inference: only a batch larger than the outputs were allocated for reallocates them
+// (and the workspace and memory plan); a smaller one runs in the front of those buffers.
+void set_inference_batch(network *net, int b)
+{
+    if (net->batch == b) return;
+    if (b > net->allocated_batch) {
+        set_batch_network(net, b);
+        resize_network(net, net->w, net->h);
+        return;
+    }
+    net->batch = b;
+    int i;
+    for (i = 0; i < net->n; ++i) net->layers[i].batch = b;
+#ifdef CUDNN
+    // the descriptors carry the batch size, and cuDNN may pick algorithms that need more workspace
+    size_t allocated = 0, needed = 0;
+    for (i = 0; i < net->n; ++i) {
+        layer *l = &net->layers[i];
+        if (l->type == CONVOLUTIONAL) {
+            if (l->workspace_size > allocated) allocated = l->workspace_size;
+            cudnn_convolutional_setup(l, cudnn_fastest);
+            size_t const size = get_convolutional_workspace_size(*l);
+            if (size > needed) needed = size;
+        }
+        else if (l->type == MAXPOOL) {
+            cudnn_maxpool_setup(l);
+        }
+    }
+    if (needed > allocated) recalculate_workspace_size(net);
+#endif
+}
+
+static void resize_head_layer(layer *l)
+{
+    const int size = l->outputs * l->batch;
+    l->output = (float*)realloc(l->output, size * sizeof(float));
+    l->delta = (float*)realloc(l->delta, size * sizeof(float));
+    if (l->type == SOFTMAX) l->loss = (float*)realloc(l->loss, size * sizeof(float));
+#ifdef GPU
+    cuda_free(l->output_gpu);
+    cuda_free(l->delta_gpu);
+    l->output_gpu = cuda_make_array(l->output, size);
+    l->delta_gpu = cuda_make_array(l->delta, size);
+    if (l->type == SOFTMAX) {
+        cuda_free(l->loss_gpu);
+        l->loss_gpu = cuda_make_array(l->loss, size);
+    }
+#endif
+}
+
 int resize_network(network *net, int w, int h)
 {
 #ifdef GPU
@@ -494,6 +573,9 @@ int resize_network(network *net, int w, int h)
         }
     }
 #endif
+    // resize_*_layer() realloc the outputs, so give each layer its own buffer back first
+    const int memory_planned = net->output_arenas != NULL;
+    unplan_network_memory(net);
     int i;
     //if(w == net->w && h == net->h) return 0;
     net->w = w;
@@ -538,6 +620,27 @@ int resize_network(network *net, int w, int h)
             resize_normalization_layer(&l, w, h);
         }else if(l.type == COST){
             resize_cost_layer(&l, inputs);
+        }else if (l.type == DROPOUT) {
+            l.inputs = l.outputs = inputs;
+            l.out_w = w;
+            l.out_h = h;
+            resize_dropout_layer(&l, inputs);
+            l.output = net->layers[i - 1].output;
+            l.delta = net->layers[i - 1].delta;
+#ifdef GPU
+            l.output_gpu = net->layers[i - 1].output_gpu;
+            l.delta_gpu = net->layers[i - 1].delta_gpu;
+#endif
+        }else if (l.type == BLANK && i > 0 && net->layers[i - 1].fused_shortcut) {
+            // [shortcut] fused into the conv, see fuse_conv_shortcut()
+            l.w = l.out_w = w;
+            l.h = l.out_h = h;
+            l.outputs = l.inputs = inputs;
+            l.delta = (float*)realloc(l.delta, l.outputs * l.batch * sizeof(float));
+            l.output = net->layers[i - 1].output;
+        }else if ((l.type == CONNECTED || l.type == SOFTMAX) && l.inputs == inputs) {
+            // after a global [avgpool]: the size is the same, the buffers follow the batch
+            resize_head_layer(&l);
         }else{
             fprintf(stderr, "Resizing type %d \n", (int)l.type);
             error("Cannot resize this type of layer");
@@ -547,7 +650,6 @@ int resize_network(network *net, int w, int h)
         net->layers[i] = l;
         w = l.out_w;
         h = l.out_h;
-        if(l.type == AVGPOOL) break;
     }
 #ifdef GPU
     const int size = get_network_input_size(*net) * net->batch;
@@ -573,6 +675,8 @@ int resize_network(network *net, int w, int h)
     free(net->workspace);
     net->workspace = (float*)calloc(1, workspace_size);
 #endif
+    if (memory_planned) plan_network_memory(net);
+    net->allocated_batch = net->batch;
     //fprintf(stderr, " Done!\n");
     return 0;
 }
@@ -659,9 +763,14 @@ float *network_predict_ptr(network *net, float *input)
 float *network_predict(network net, float *input)
 {
 #ifdef GPU
-    if(gpu_index >= 0)  return network_predict_gpu(net, input);
+    if (gpu_index >= 0) {
+        unsigned long long span = trace_begin();
+        float *out = network_predict_gpu(net, input);
+        trace_end("network_predict", span);
+        return out;
+    }
 #endif
-
+    unsigned long long span = trace_begin();
     network_state state;
     state.net = net;
     state.index = 0;
@@ -671,6 +780,7 @@ float *network_predict(network net, float *input)
     state.delta = 0;
     forward_network(net, state);
     float *out = get_network_output(net);
+    trace_end("network_predict", span);
     return out;
 }
 
@@ -696,11 +806,14 @@ detection *make_network_boxes(network *net, float thresh, int *num)
     int i;
     int nboxes = num_detections(net, thresh);
     if (num) *num = nboxes;
-    detection* dets = (detection*)calloc(nboxes, sizeof(detection));
+    // one block: the detections, then their prob arrays, then the masks
+    int masks = l.coords > 4 ? l.coords - 4 : 0;
+    detection* dets = (detection*)calloc(1, nboxes*sizeof(detection) + nboxes*(l.classes + masks)*sizeof(float) + 1);
+    float *probs = (float*)(dets + nboxes);
     for (i = 0; i < nboxes; ++i) {
-        dets[i].prob = (float*)calloc(l.classes, sizeof(float));
-        if (l.coords > 4) {
-            dets[i].mask = (float*)calloc(l.coords - 4, sizeof(float));
+        dets[i].prob = probs + i*l.classes;
+        if (masks) {
+            dets[i].mask = probs + nboxes*l.classes + i*masks;
         }
     }
     return dets;
@@ -764,6 +877,205 @@ detection *get_network_boxes(network *net, int w, int h, float thresh, float hie
     return dets;
 }
 
+// makes room for n cleared detections after the first `used` ones, which are kept
+static void reserve_detection_buffer(detection_buffer *buf, int used, int n, int classes, int masks)
+{
+    int i;
+    int stride = classes + masks;
+    if (used + n > buf->size || stride != buf->stride) {
+        int size = used + n > buf->size ? used + n + (used + n) / 2 : buf->size;
+        detection *dets = (detection*)calloc(size + 1, sizeof(detection));
+        float *probs = (float*)calloc((size_t)size * stride + 1, sizeof(float));
+        if (used) {
+            memcpy(dets, buf->dets, used * sizeof(detection));
+            memcpy(probs, buf->probs, (size_t)used * stride * sizeof(float));
+        }
+        free(buf->dets);
+        free(buf->probs);
+        buf->dets = dets;
+        buf->probs = probs;
+        buf->size = size;
+        buf->stride = stride;
+    }
+    memset(buf->dets + used, 0, n * sizeof(detection));
+    memset(buf->probs + (size_t)used * stride, 0, (size_t)n * stride * sizeof(float));
+    for (i = 0; i < used + n; ++i) {
+        buf->dets[i].prob = buf->probs + i*stride;
+        if (masks) buf->dets[i].mask = buf->probs + i*stride + classes;
+    }
+}
+
+detection *get_network_boxes_into(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter, detection_buffer *buf)
+{
+    layer l = net->layers[net->n - 1];
+    if (!buf) {
+        if (!net->dets_arena) net->dets_arena = (detection_buffer*)calloc(1, sizeof(detection_buffer));
+        buf = net->dets_arena;
+    }
+    int nboxes = num_detections(net, thresh);
+    if (num) *num = nboxes;
+    reserve_detection_buffer(buf, 0, nboxes, l.classes, l.coords > 4 ? l.coords - 4 : 0);
+    fill_network_boxes(net, w, h, thresh, hier, map, relative, buf->dets, letter);
+    return buf->dets;
+}
+
+#define TILE_MAX_BATCH 16
+
+// number of tiles covering size with at least `overlap` pixels shared by neighbours
+static int tile_count(int size, int tile, int overlap)
+{
+    if (size <= tile) return 1;
+    return (size - overlap + tile - overlap - 1) / (tile - overlap);
+}
+
+// first pixel of tile i, the tiles are spread evenly from 0 to size - tile
+static int tile_offset(int i, int n, int size, int tile)
+{
+    if (n < 2) return 0;
+    return (int)((long long)i * (size - tile) / (n - 1));
+}
+
+// a tile owns the centres up to the middle of its overlap with each neighbour
+static void tile_owned_range(int i, int n, int size, int tile, float *lo, float *hi)
+{
+    *lo = i > 0 ? (tile_offset(i - 1, n, size, tile) + tile + tile_offset(i, n, size, tile)) / 2.f : -FLT_MAX;
+    *hi = i < n - 1 ? (tile_offset(i, n, size, tile) + tile + tile_offset(i + 1, n, size, tile)) / 2.f : FLT_MAX;
+}
+
+// copies the w x h window at (dx, dy) of im, padding outside of it with .5
+static void copy_tile(image im, int dx, int dy, int w, int h, int c, float *dst)
+{
+    int k, y;
+    for (k = 0; k < c; ++k) {
+        for (y = 0; y < h; ++y) {
+            float *row = dst + (k*h + y)*w;
+            int x = 0;
+            if (dy + y < im.h) {
+                int n = im.w - dx < w ? im.w - dx : w;
+                memcpy(row, im.data + (k*im.h + dy + y)*im.w + dx, n * sizeof(float));
+                x = n;
+            }
+            for (; x < w; ++x) row[x] = .5f;
+        }
+    }
+}
+
+// get_network_boxes() decodes the first image of a batch: moves the detection
+// layers `offset` images ahead and sets their batch
+static void shift_detection_batch(network *net, int offset, int batch)
+{
+    int k;
+    for (k = 0; k < net->n; ++k) {
+        layer *l = &net->layers[k];
+        if (l->type != YOLO && l->type != REGION && l->type != DETECTION) continue;
+        l->output += offset*l->outputs;
+        l->batch = batch;
+    }
+}
+
+detection *network_predict_tiled(network *net, image im, int overlap, float thresh, float hier, float nms, int *num, detection_buffer *buf)
+{
+    layer l = net->layers[net->n - 1];
+    const int masks = l.coords > 4 ? l.coords - 4 : 0;
+    const int stride = l.classes + masks;
+    if (!buf) {
+        if (!net->dets_arena) net->dets_arena = (detection_buffer*)calloc(1, sizeof(detection_buffer));
+        buf = net->dets_arena;
+    }
+    if (overlap <= 0) overlap = (net->w < net->h ? net->w : net->h) / 8;
+    const int overlap_x = overlap < net->w / 2 ? overlap : net->w / 2;
+    const int overlap_y = overlap < net->h / 2 ? overlap : net->h / 2;
+    const int nx = tile_count(im.w, net->w, overlap_x);
+    const int ny = tile_count(im.h, net->h, overlap_y);
+    const int ntiles = nx*ny;
+
+    const int batch = ntiles < TILE_MAX_BATCH ? ntiles : TILE_MAX_BATCH;
+    set_inference_batch(net, batch);
+    const size_t inputs = (size_t)net->w*net->h*net->c;
+    if (net->tiles_input_size < batch*inputs) {
+        free(net->tiles_input);
+        net->tiles_input = (float*)calloc(batch*inputs, sizeof(float));
+        net->tiles_input_size = batch*inputs;
+    }
+
+    int count = 0;
+    int first, b, i;
+    for (first = 0; first < ntiles; first += batch) {
+        const int n = ntiles - first < batch ? ntiles - first : batch;
+        for (b = 0; b < n; ++b) {
+            const int t = first + b;
+            copy_tile(im, tile_offset(t % nx, nx, im.w, net->w), tile_offset(t / nx, ny, im.h, net->h),
+                net->w, net->h, net->c, net->tiles_input + b*inputs);
+        }
+        network_predict(*net, net->tiles_input);
+
+        for (b = 0; b < n; ++b) {
+            const int t = first + b;
+            const int dx = tile_offset(t % nx, nx, im.w, net->w);
+            const int dy = tile_offset(t / nx, ny, im.h, net->h);
+            float lo_x, hi_x, lo_y, hi_y;
+            tile_owned_range(t % nx, nx, im.w, net->w, &lo_x, &hi_x);
+            tile_owned_range(t / nx, ny, im.h, net->h, &lo_y, &hi_y);
+
+            shift_detection_batch(net, b, 1);
+            int nboxes = num_detections(net, thresh);
+            reserve_detection_buffer(buf, count, nboxes, l.classes, masks);
+            fill_network_boxes(net, net->w, net->h, thresh, hier, 0, 1, buf->dets + count, 0);
+            shift_detection_batch(net, -b, batch);
+
+            // boxes cut by a seam have their centre in the neighbour's part of the overlap
+            detection *tile_dets = buf->dets + count;
+            for (i = 0; i < nboxes; ++i) {
+                detection *d = tile_dets + i;
+                const float cx = dx + d->bbox.x*net->w;
+                const float cy = dy + d->bbox.y*net->h;
+                if (cx < lo_x || cx >= hi_x || cy < lo_y || cy >= hi_y) continue;
+                detection *keep = buf->dets + count;
+                if (keep != d) {
+                    float *prob = keep->prob;
+                    float *mask = keep->mask;
+                    memcpy(prob, d->prob, stride * sizeof(float));
+                    *keep = *d;
+                    keep->prob = prob;
+                    keep->mask = mask;
+                }
+                keep->bbox.x = cx / im.w;
+                keep->bbox.y = cy / im.h;
+                keep->bbox.w = d->bbox.w*net->w / im.w;
+                keep->bbox.h = d->bbox.h*net->h / im.h;
+                ++count;
+            }
+        }
+    }
+    if (nms) do_nms_sort(buf->dets, count, l.classes, nms);
+    if (num) *num = count;
+    return buf->dets;
+}
+
+detection *get_network_boxes_batch_into(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter, detection_buffer *buf)
+{
+    const int batch = net->batch;
+    shift_detection_batch(net, b, 1);
+    detection *dets = get_network_boxes_into(net, w, h, thresh, hier, map, relative, num, letter, buf);
+    shift_detection_batch(net, -b, batch);
+    return dets;
+}
+
+void free_detection_buffer(detection_buffer *buf)
+{
+    free(buf->dets);
+    free(buf->probs);
+    buf->dets = NULL;
+    buf->probs = NULL;
+    buf->size = 0;
+}
+
+// make_network_boxes() allocates the detections with their prob and mask arrays as one block
+void free_network_boxes(detection *dets)
+{
+    free(dets);
+}
+
 void free_detections(detection *dets, int n)
 {
     int i;
@@ -783,46 +1095,61 @@ void free_detections(detection *dets, int n)
 // ]
 //},
 
-char *detection_to_json(detection *dets, int nboxes, int classes, char **names, long long int frame_id, char *filename)
+// appends to *buf at *len, growing it only when the text doesn't fit
+static void json_append(char **buf, size_t *size, size_t *len, const char *format, ...)
 {
-    const float thresh = 0.005; // function get_network_boxes() has already filtred dets by actual threshold
+    va_list args;
+    while (1) {
+        const size_t room = *size - *len;
+        va_start(args, format);
+        const int n = vsnprintf(*buf + *len, room, format, args);
+        va_end(args);
+        if (n < 0) error("detection_to_json: vsnprintf failed");
+        if ((size_t)n < room) {
+            *len += n;
+            return;
+        }
+        *size = *size * 2 > *len + n + 1 ? *size * 2 : *len + n + 1;
+        *buf = (char *)realloc(*buf, *size);
+        if (!*buf) error("detection_to_json: realloc failed");
+    }
+}
 
-    char *send_buf = (char *)calloc(1024, sizeof(char));
+size_t detection_to_json_into(detection *dets, int nboxes, int classes, char **names, long long int frame_id, char *filename, char **buf, size_t *size)
+{
+    const float thresh = 0.005; // function get_network_boxes() has already filtred dets by actual threshold
+    size_t len = 0;
+    if (!*buf || *size < 1024) {
+        *size = 1024 + (size_t)nboxes * 160;
+        *buf = (char *)realloc(*buf, *size);
+        if (!*buf) error("detection_to_json: realloc failed");
+    }
     if (filename) {
-        sprintf(send_buf, "{\n \"frame_id\":%lld, \n \"filename\":\"%s\", \n \"objects\": [ \n", frame_id, filename);
+        json_append(buf, size, &len, "{\n \"frame_id\":%lld, \n \"filename\":\"%s\", \n \"objects\": [ \n", frame_id, filename);
     }
     else {
-        sprintf(send_buf, "{\n \"frame_id\":%lld, \n \"objects\": [ \n", frame_id);
+        json_append(buf, size, &len, "{\n \"frame_id\":%lld, \n \"objects\": [ \n", frame_id);
     }
 
     int i, j;
-    int class_id = -1;
+    int first = 1;
     for (i = 0; i < nboxes; ++i) {
         for (j = 0; j < classes; ++j) {
-            int show = strncmp(names[j], "dont_show", 9);
-            if (dets[i].prob[j] > thresh && show)
-            {
-                if (class_id != -1) strcat(send_buf, ", \n");
-                class_id = j;
-                char *buf = (char *)calloc(2048, sizeof(char));
-                //sprintf(buf, "{\"image_id\":%d, \"category_id\":%d, \"bbox\":[%f, %f, %f, %f], \"score\":%f}",
-                //    image_id, j, dets[i].bbox.x, dets[i].bbox.y, dets[i].bbox.w, dets[i].bbox.h, dets[i].prob[j]);
-
-                sprintf(buf, "  {\"class_id\":%d, \"name\":\"%s\", \"relative_coordinates\":{\"center_x\":%f, \"center_y\":%f, \"width\":%f, \"height\":%f}, \"confidence\":%f}",
-                    j, names[j], dets[i].bbox.x, dets[i].bbox.y, dets[i].bbox.w, dets[i].bbox.h, dets[i].prob[j]);
-
-                int send_buf_len = strlen(send_buf);
-                int buf_len = strlen(buf);
-                int total_len = send_buf_len + buf_len + 100;
-                send_buf = (char *)realloc(send_buf, total_len * sizeof(char));
-                if (!send_buf) return 0;// exit(-1);
-                strcat(send_buf, buf);
-                free(buf);
-            }
+            if (dets[i].prob[j] <= thresh || !strncmp(names[j], "dont_show", 9)) continue;
+            json_append(buf, size, &len, "%s  {\"class_id\":%d, \"name\":\"%s\", \"relative_coordinates\":{\"center_x\":%f, \"center_y\":%f, \"width\":%f, \"height\":%f}, \"confidence\":%f}",
+                first ? "" : ", \n", j, names[j], dets[i].bbox.x, dets[i].bbox.y, dets[i].bbox.w, dets[i].bbox.h, dets[i].prob[j]);
+            first = 0;
         }
     }
-    //strcat(send_buf, "\n ] \n}, \n");
-    strcat(send_buf, "\n ] \n}");
+    json_append(buf, size, &len, "\n ] \n}");
+    return len;
+}
+
+char *detection_to_json(detection *dets, int nboxes, int classes, char **names, long long int frame_id, char *filename)
+{
+    char *send_buf = NULL;
+    size_t size = 0;
+    detection_to_json_into(dets, nboxes, classes, names, frame_id, filename, &send_buf, &size);
     return send_buf;
 }
 
@@ -985,7 +1312,16 @@ float network_accuracy_multi(network net, data d, int n)
 void free_network(network net)
 {
     int i;
+    unplan_network_memory(&net);
+    free_network_weights_map(&net);
+    free(net.tiles_input);
+    if (net.dets_arena) {
+        free_detection_buffer(net.dets_arena);
+        free(net.dets_arena);
+    }
     for (i = 0; i < net.n; ++i) {
+        // fused [shortcut], see fuse_conv_shortcut()
+        if (net.layers[i].type == BLANK && i > 0 && net.layers[i].output == net.layers[i - 1].output) net.layers[i].output = NULL;
         free_layer(net.layers[i]);
     }
     free(net.layers);
@@ -1053,15 +1389,61 @@ void fuse_conv_batchnorm(network net)
                 }
 #endif
             }
+#ifdef GPU
+            if (gpu_index < 0)
+#endif
+            winograd_transform_weights(l);
         }
         else {
             //printf(" Fusion skip layer type: %d \n", l->type);
         }
     }
+#ifdef GPU
+    if (gpu_index < 0)
+#endif
+    fuse_conv_shortcut(net);
 }
 
 void forward_blank_layer(layer l, network_state state) {}
 
+// is the output of layer j read by any layer other than j+1?
+static int is_output_reused(network net, int j)
+{
+    int i, k;
+    for (i = 0; i < net.n; ++i) {
+        layer l = net.layers[i];
+        if ((l.type == SHORTCUT || l.type == SCALE_CHANNELS) && l.index == j && i != j + 1) return 1;
+        if (l.type == ROUTE) {
+            for (k = 0; k < l.n; ++k) if (l.input_layers[k] == j) return 1;
+        }
+    }
+    return 0;
+}
+
+// CPU inference: conv + [shortcut] (linear, same shapes) -> conv, the add is done in the conv epilogue
+// and the shortcut becomes a BLANK layer whose output is the conv output
+void fuse_conv_shortcut(network net)
+{
+    int j, k;
+    for (j = 0; j + 1 < net.n; ++j) {
+        layer *l = &net.layers[j];
+        layer *sc = &net.layers[j + 1];
+        if (l->type != CONVOLUTIONAL || sc->type != SHORTCUT) continue;
+        if (l->batch_normalize || l->xnor || l->binary || !can_apply_conv_epilogue(l->activation)) continue;
+        if (sc->activation != LINEAR || sc->index == j || sc->w != sc->out_w || sc->h != sc->out_h || sc->c != sc->out_c) continue;
+        if (l->outputs != sc->outputs || is_output_reused(net, j)) continue;
+
+        float *sc_output = sc->output;
+        for (k = j + 1; k < net.n; ++k) {
+            if (net.layers[k].output == sc_output) net.layers[k].output = l->output;    // sc and dropout after it
+        }
+        free(sc_output);
+        l->fused_shortcut = 1;
+        sc->type = BLANK;
+        sc->forward = forward_blank_layer;
+    }
+}
+
 void calculate_binary_weights(network net)
 {
     int j;
@@ -1103,6 +1485,170 @@ void calculate_binary_weights(network net)
 
 }
 
+// layers which overwrite the whole l.output on each forward pass and keep no state in it
+static int is_output_shareable(layer l)
+{
+    switch (l.type) {
+    case CONVOLUTIONAL:
+    case CONNECTED:
+    case MAXPOOL:
+    case AVGPOOL:
+    case ROUTE:
+    case SHORTCUT:
+    case SCALE_CHANNELS:
+    case UPSAMPLE:
+    case REORG:
+    case REORG_OLD:
+    case ACTIVE:
+    case BATCHNORM:
+    case NORMALIZATION:
+    case CROP:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Inference only (CPU): assign layer outputs to a few shared arenas.
+// The output of layer i is live from its forward pass until the last layer that reads it:
+// the next layer (state.input), shortcut/scale_channels l.index (also a shortcut fused into the conv)
+// and route input_layers.
+// The network output and detection layers (read by get_network_boxes) keep their own buffers.
+void plan_network_memory(network *net)
+{
+#ifdef GPU
+    if (gpu_index >= 0) return;
+#endif
+    if (net->output_arenas) unplan_network_memory(net);
+
+    const int n = net->n;
+    int *owner = (int*)calloc(n, sizeof(int));        // dropout/empty layers alias the previous output
+    int *last_use = (int*)calloc(n, sizeof(int));
+    int *arena_of = (int*)calloc(n, sizeof(int));
+    size_t *arena_size = (size_t*)calloc(n, sizeof(size_t));
+    int *arena_free_at = (int*)calloc(n, sizeof(int));
+    int n_arenas = 0;
+    int i, k;
+
+    for (i = 0; i < n; ++i) {
+        layer l = net->layers[i];
+        owner[i] = (i > 0 && l.output == net->layers[i - 1].output) ? owner[i - 1] : i;
+        if (last_use[owner[i]] < i) last_use[owner[i]] = i;
+        if (i > 0 && last_use[owner[i - 1]] < i) last_use[owner[i - 1]] = i;
+        if (l.type == SHORTCUT || l.type == SCALE_CHANNELS) {
+            if (last_use[owner[l.index]] < i) last_use[owner[l.index]] = i;
+        }
+        if (l.type == CONVOLUTIONAL && l.fused_shortcut) {
+            const int index = net->layers[i + 1].index;
+            if (last_use[owner[index]] < i) last_use[owner[index]] = i;
+        }
+        if (l.type == ROUTE) {
+            for (k = 0; k < l.n; ++k) {
+                if (last_use[owner[l.input_layers[k]]] < i) last_use[owner[l.input_layers[k]]] = i;
+            }
+        }
+    }
+    for (i = n - 1; i > 0; --i) if (net->layers[i].type != COST) break;
+    last_use[owner[i]] = n;
+
+    size_t total_size = 0, planned_size = 0;
+    int planned = 0;
+    for (i = 0; i < n; ++i) {
+        layer l = net->layers[i];
+        arena_of[i] = -1;
+        if (owner[i] != i || !l.output || !is_output_shareable(l) || last_use[i] >= n) continue;
+        const size_t size = (size_t)l.outputs * l.batch;
+        total_size += size;
+        ++planned;
+
+        // best fit among the free arenas, otherwise grow the largest free one
+        int best = -1, largest = -1;
+        for (k = 0; k < n_arenas; ++k) {
+            if (arena_free_at[k] >= i) continue;
+            if (arena_size[k] >= size && (best < 0 || arena_size[k] < arena_size[best])) best = k;
+            if (largest < 0 || arena_size[k] > arena_size[largest]) largest = k;
+        }
+        if (best < 0) best = largest;
+        if (best < 0) best = n_arenas++;
+        if (arena_size[best] < size) arena_size[best] = size;
+        arena_free_at[best] = last_use[i];
+        arena_of[i] = best;
+    }
+
+    if (n_arenas > 0) {
+        net->output_arenas = (float**)calloc(n_arenas, sizeof(float*));
+        net->n_output_arenas = n_arenas;
+        for (k = 0; k < n_arenas; ++k) {
+            net->output_arenas[k] = (float*)calloc(arena_size[k], sizeof(float));
+            planned_size += arena_size[k];
+        }
+        for (i = 0; i < n; ++i) {
+            layer *l = &net->layers[i];
+            if (arena_of[owner[i]] < 0) continue;
+            if (owner[i] == i) free(l->output);
+            l->output = net->output_arenas[arena_of[owner[i]]];
+        }
+        net->output = get_network_output(*net);
+    }
+    fprintf(stderr, " Memory plan: %d layer outputs in %d arenas, %.1f MB -> %.1f MB \n",
+        planned, n_arenas, (float)total_size * sizeof(float) / (1024 * 1024), (float)planned_size * sizeof(float) / (1024 * 1024));
+
+    free(owner);
+    free(last_use);
+    free(arena_of);
+    free(arena_size);
+    free(arena_free_at);
+}
+
+// detach the layers from the shared arenas (l.output = NULL) and free the arenas
+void unplan_network_memory(network *net)
+{
+    int i, k;
+    if (!net->output_arenas) return;
+    for (i = 0; i < net->n; ++i) {
+        for (k = 0; k < net->n_output_arenas; ++k) {
+            if (net->layers[i].output == net->output_arenas[k]) net->layers[i].output = NULL;
+        }
+    }
+    for (k = 0; k < net->n_output_arenas; ++k) free(net->output_arenas[k]);
+    free(net->output_arenas);
+    net->output_arenas = NULL;
+    net->n_output_arenas = 0;
+}
+
+static void detach_from_weights_map(network *net, void **ptr)
+{
+    const char *p = (const char*)*ptr;
+    const char *map = (const char*)net->weights_map;
+    if (p >= map && p < map + net->weights_map_size) *ptr = NULL;
+}
+
+// layers loaded from .dsw point into the file mapping: detach them before free_layer()
+void free_network_weights_map(network *net)
+{
+    int i;
+    if (!net->weights_map) return;
+    for (i = 0; i < net->n; ++i) {
+        layer *l = &net->layers[i];
+        detach_from_weights_map(net, (void**)&l->biases);
+        detach_from_weights_map(net, (void**)&l->weights);
+        detach_from_weights_map(net, (void**)&l->scales);
+        detach_from_weights_map(net, (void**)&l->rolling_mean);
+        detach_from_weights_map(net, (void**)&l->rolling_variance);
+        detach_from_weights_map(net, (void**)&l->winograd_weights);
+        detach_from_weights_map(net, (void**)&l->weights_int8);
+        detach_from_weights_map(net, (void**)&l->weights_int8_scales);
+        detach_from_weights_map(net, (void**)&l->weights_int8_sums);
+    }
+#ifdef _WIN32
+    free(net->weights_map);
+#else
+    munmap(net->weights_map, net->weights_map_size);
+#endif
+    net->weights_map = NULL;
+    net->weights_map_size = 0;
+}
+
 void copy_cudnn_descriptors(layer src, layer *dst)
 {
 #ifdef CUDNN
@@ -143,6 +143,7 @@ void print_network(network net);
 void visualize_network(network net);
 int resize_network(network *net, int w, int h);
 void set_batch_network(network *net, int b);
+void set_inference_batch(network *net, int b);
 int get_network_input_size(network net);
 float get_network_cost(network net);
 //LIB_API layer* get_network_layer(network* net, int i);
@@ -162,7 +163,11 @@ float get_network_cost(network net);
 int get_network_nuisance(network net);
 int get_network_background(network net);
 //LIB_API void fuse_conv_batchnorm(network net);
+//LIB_API void fuse_conv_shortcut(network net);
 //LIB_API void calculate_binary_weights(network net);
+//LIB_API void plan_network_memory(network *net);
+//LIB_API void unplan_network_memory(network *net);
+//LIB_API void free_network_weights_map(network *net);
 network combine_train_valid_networks(network net_train, network net_map);
 void copy_weights_net(network net_train, network *net_map);
 void free_network_recurrent_state(network net);
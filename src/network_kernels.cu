@@ -55,10 +55,13 @@ void forward_network_gpu(network net, network_state state)
             fill_ongpu(l.outputs * l.batch, 0, l.delta_gpu, 1);
         }
         //printf("\n layer %d - type: %d - \n", i, l.type);
-        //start_timer();
+        double time = net.layer_times ? get_time_point() : 0;
         l.forward_gpu(l, state);
-        //CHECK_CUDA(cudaDeviceSynchronize());
-        //stop_timer_and_show();
+        if (net.layer_times) {
+            // the kernels are asynchronous: wait for this layer's to finish
+            CHECK_CUDA(cudaStreamSynchronize(get_cuda_stream()));
+            net.layer_times[i] = (get_time_point() - time) / 1000;
+        }
 
         if(net.wait_stream)
             cudaStreamSynchronize(get_cuda_stream());
@@ -2,6 +2,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #include "activation_layer.h"
 #include "activations.h"
@@ -16,6 +19,7 @@
 #include "crop_layer.h"
 #include "detection_layer.h"
 #include "dropout_layer.h"
+#include "gemm.h"
 #include "gru_layer.h"
 #include "list.h"
 #include "local_layer.h"
@@ -1011,6 +1015,7 @@ network parse_network_cfg_custom(char *filename, int batch, int time_steps)
         printf("\n Warning: width=%d and height=%d in cfg-file must be divisible by 32 for default networks Yolo v1/v2/v3!!! \n\n",
             net.w, net.h);
     }
+    net.allocated_batch = net.batch;
     return net;
 }
 
@@ -1221,6 +1226,173 @@ void save_weights(network net, char *filename)
     save_weights_upto(net, filename, net.n);
 }
 
+// INT8 model written by "detector calibrate": batch-norm is fused, every convolutional layer is
+// [int quantized][float biases[n]] and then either
+// [float input_scale][int input_zero_point][float weights_scales[n]][int8 weights[nweights]] or [float weights[nweights]]
+#define INT8_WEIGHTS_MAGIC 0x38515344   // "DSQ8"
+#define INT8_WEIGHTS_VERSION 1
+
+static void save_convolutional_weights_int8(layer l, FILE *fp)
+{
+    int quantized = (l.weights_int8 != NULL);
+    fwrite(&quantized, sizeof(int), 1, fp);
+    fwrite(l.biases, sizeof(float), l.n, fp);
+    if (quantized) {
+        const int size = l.nweights / l.n;
+        int8_t *weights = (int8_t*)calloc(l.nweights, sizeof(int8_t));
+        int i;
+        for (i = 0; i < l.nweights; ++i) weights[i] = (int8_t)roundf(l.weights[i] / l.weights_int8_scales[i / size]);
+        fwrite(&l.input_int8_scale, sizeof(float), 1, fp);
+        fwrite(&l.input_int8_zero_point, sizeof(int), 1, fp);
+        fwrite(l.weights_int8_scales, sizeof(float), l.n, fp);
+        fwrite(weights, sizeof(int8_t), l.nweights, fp);
+        free(weights);
+    }
+    else {
+        fwrite(l.weights, sizeof(float), l.nweights, fp);
+    }
+}
+
+void save_weights_int8(network net, char *filename)
+{
+    fprintf(stderr, "Saving INT8 weights to %s\n", filename);
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+
+    int magic = INT8_WEIGHTS_MAGIC;
+    int version = INT8_WEIGHTS_VERSION;
+    fwrite(&magic, sizeof(int), 1, fp);
+    fwrite(&version, sizeof(int), 1, fp);
+    fwrite(net.seen, sizeof(uint64_t), 1, fp);
+
+    int i;
+    for (i = 0; i < net.n; ++i) {
+        layer l = net.layers[i];
+        if (l.type == CONVOLUTIONAL && l.share_layer == NULL) {
+            if (l.batch_normalize) error("INT8 weights: call fuse_conv_batchnorm() first");
+            save_convolutional_weights_int8(l, fp);
+        }
+        else if (l.type == CONNECTED) save_connected_weights(l, fp);
+        else if (l.type == BATCHNORM) save_batchnorm_weights(l, fp);
+        else if (l.type == RNN || l.type == GRU || l.type == LSTM || l.type == CONV_LSTM || l.type == CRNN || l.type == LOCAL) {
+            error("INT8 weights: recurrent and local layers are not supported");
+        }
+    }
+    fclose(fp);
+}
+
+// .dsw - inference weights prepared by "detector export", loaded with a single mmap():
+// [dsw_header][dsw_layer x n] and then 64-byte aligned blocks. Batch-norm is fused into the
+// convolutional weights, Winograd and packed INT8 weights are stored as they are used in memory.
+#define DSW_MAGIC 0x31575344    // "DSW1"
+#define DSW_VERSION 1
+#define DSW_ALIGN 64
+
+enum { DSW_BIASES, DSW_WEIGHTS, DSW_SCALES, DSW_ROLLING_MEAN, DSW_ROLLING_VARIANCE,
+    DSW_WINOGRAD, DSW_INT8_WEIGHTS, DSW_INT8_SCALES, DSW_INT8_SUMS, DSW_BLOCKS };
+
+typedef struct dsw_header {
+    int32_t magic;
+    int32_t version;
+    int32_t n;
+    int32_t reserved;
+    uint64_t seen;
+} dsw_header;
+
+typedef struct dsw_layer {
+    int32_t type, n, c, size, nweights, outputs, inputs;   // checked against the cfg
+    int32_t input_int8_zero_point;
+    float input_int8_scale;
+    int32_t reserved;
+    uint64_t offset[DSW_BLOCKS];   // 0 - the block is absent
+    uint64_t bytes[DSW_BLOCKS];
+} dsw_layer;
+
+static void dsw_layer_blocks(layer l, void *data[DSW_BLOCKS], uint64_t bytes[DSW_BLOCKS])
+{
+    memset(data, 0, DSW_BLOCKS * sizeof(void*));
+    memset(bytes, 0, DSW_BLOCKS * sizeof(uint64_t));
+    if (l.type == CONVOLUTIONAL) {
+        data[DSW_BIASES] = l.biases, bytes[DSW_BIASES] = l.n * sizeof(float);
+        data[DSW_WEIGHTS] = l.weights, bytes[DSW_WEIGHTS] = l.nweights * sizeof(float);
+        if (l.winograd_weights) {
+            data[DSW_WINOGRAD] = l.winograd_weights, bytes[DSW_WINOGRAD] = (uint64_t)36 * l.n * l.c * sizeof(float);
+        }
+        if (l.weights_int8) {
+            data[DSW_INT8_WEIGHTS] = l.weights_int8, bytes[DSW_INT8_WEIGHTS] = int8_weights_size(l.n, l.c, l.size);
+            data[DSW_INT8_SCALES] = l.weights_int8_scales, bytes[DSW_INT8_SCALES] = l.n * sizeof(float);
+            data[DSW_INT8_SUMS] = l.weights_int8_sums, bytes[DSW_INT8_SUMS] = l.n * sizeof(int);
+        }
+    }
+    else if (l.type == CONNECTED) {
+        data[DSW_BIASES] = l.biases, bytes[DSW_BIASES] = l.outputs * sizeof(float);
+        data[DSW_WEIGHTS] = l.weights, bytes[DSW_WEIGHTS] = (uint64_t)l.outputs * l.inputs * sizeof(float);
+    }
+    if ((l.type == CONNECTED && l.batch_normalize) || l.type == BATCHNORM) {
+        const int n = (l.type == BATCHNORM) ? l.c : l.outputs;
+        data[DSW_SCALES] = l.scales, bytes[DSW_SCALES] = n * sizeof(float);
+        data[DSW_ROLLING_MEAN] = l.rolling_mean, bytes[DSW_ROLLING_MEAN] = n * sizeof(float);
+        data[DSW_ROLLING_VARIANCE] = l.rolling_variance, bytes[DSW_ROLLING_VARIANCE] = n * sizeof(float);
+    }
+}
+
+static uint64_t dsw_align(uint64_t offset)
+{
+    return (offset + DSW_ALIGN - 1) / DSW_ALIGN * DSW_ALIGN;
+}
+
+void save_weights_dsw(network net, char *filename)
+{
+    fprintf(stderr, "Saving .dsw weights to %s\n", filename);
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+
+    dsw_header header = { DSW_MAGIC, DSW_VERSION, net.n, 0, *net.seen };
+    dsw_layer *table = (dsw_layer*)calloc(net.n, sizeof(dsw_layer));
+    void *data[DSW_BLOCKS];
+    uint64_t offset = dsw_align(sizeof(dsw_header) + net.n * sizeof(dsw_layer));
+    int i, k;
+    for (i = 0; i < net.n; ++i) {
+        layer l = net.layers[i];
+        if (l.type == CONVOLUTIONAL && l.share_layer) continue;
+        if (l.type == CONVOLUTIONAL && l.batch_normalize) error(".dsw: call fuse_conv_batchnorm() first");
+        if (l.type == RNN || l.type == GRU || l.type == LSTM || l.type == CONV_LSTM || l.type == CRNN || l.type == LOCAL) {
+            error(".dsw: recurrent and local layers are not supported");
+        }
+        dsw_layer *t = &table[i];
+        t->type = l.type, t->n = l.n, t->c = l.c, t->size = l.size;
+        t->nweights = l.nweights, t->outputs = l.outputs, t->inputs = l.inputs;
+        t->input_int8_scale = l.input_int8_scale;
+        t->input_int8_zero_point = l.input_int8_zero_point;
+        dsw_layer_blocks(l, data, t->bytes);
+        for (k = 0; k < DSW_BLOCKS; ++k) {
+            if (!t->bytes[k]) continue;
+            t->offset[k] = offset;
+            offset = dsw_align(offset + t->bytes[k]);
+        }
+    }
+    fwrite(&header, sizeof(dsw_header), 1, fp);
+    fwrite(table, sizeof(dsw_layer), net.n, fp);
+
+    static const char zeros[DSW_ALIGN] = { 0 };
+    offset = sizeof(dsw_header) + net.n * sizeof(dsw_layer);
+    for (i = 0; i < net.n; ++i) {
+        layer l = net.layers[i];
+        if (l.type == CONVOLUTIONAL && l.share_layer) continue;
+        uint64_t bytes[DSW_BLOCKS];
+        dsw_layer_blocks(l, data, bytes);
+        for (k = 0; k < DSW_BLOCKS; ++k) {
+            if (!bytes[k]) continue;
+            fwrite(zeros, 1, table[i].offset[k] - offset, fp);
+            fwrite(data[k], 1, bytes[k], fp);
+            offset = table[i].offset[k] + bytes[k];
+        }
+    }
+    fwrite(zeros, 1, dsw_align(offset) - offset, fp);
+    free(table);
+    fclose(fp);
+}
+
 void transpose_matrix(float *a, int rows, int cols)
 {
     float* transpose = (float*)calloc(rows * cols, sizeof(float));
@@ -1347,10 +1519,140 @@ void load_convolutional_weights(layer l, FILE *fp)
 }
 
 
+static void load_convolutional_weights_int8(layer *l, FILE *fp)
+{
+    int quantized = 0;
+    fread(&quantized, sizeof(int), 1, fp);
+    fread(l->biases, sizeof(float), l->n, fp);
+    l->batch_normalize = 0;     // fused
+    if (quantized) {
+        float input_scale = 0;
+        int input_zero_point = 0;
+        float *scales = (float*)calloc(l->n, sizeof(float));
+        int8_t *weights = (int8_t*)calloc(l->nweights, sizeof(int8_t));
+        fread(&input_scale, sizeof(float), 1, fp);
+        fread(&input_zero_point, sizeof(int), 1, fp);
+        fread(scales, sizeof(float), l->n, fp);
+        fread(weights, sizeof(int8_t), l->nweights, fp);
+        make_convolutional_int8_weights(l, weights, scales, input_scale, input_zero_point);
+        free(weights);
+        free(scales);
+    }
+    else {
+        fread(l->weights, sizeof(float), l->nweights, fp);
+    }
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_convolutional_layer(*l);
+    }
+#endif
+}
+
+static void load_weights_int8_upto(network *net, FILE *fp, int cutoff)
+{
+    int version = 0;
+    uint64_t iseen = 0;
+    fread(&version, sizeof(int), 1, fp);
+    if (version != INT8_WEIGHTS_VERSION) error("INT8 weights: unknown version");
+    fread(&iseen, sizeof(uint64_t), 1, fp);
+    *net->seen = iseen;
+
+    int i;
+    for (i = 0; i < net->n && i < cutoff; ++i) {
+        layer *l = &net->layers[i];
+        if (l->dontload) continue;
+        if (l->type == CONVOLUTIONAL && l->share_layer == NULL) load_convolutional_weights_int8(l, fp);
+        if (l->type == CONNECTED) load_connected_weights(*l, fp, 0);
+        if (l->type == BATCHNORM) load_batchnorm_weights(*l, fp);
+    }
+}
+
+// layer weights point into the mapping (copy-on-write), so processes loading the same file share pages;
+// free_network() releases it with free_network_weights_map()
+static void load_weights_dsw_upto(network *net, char *filename, int cutoff)
+{
+    if (net->weights_map) error(".dsw: the network already has .dsw weights loaded");
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) file_error(filename);
+    fseek(fp, 0, SEEK_END);
+    const size_t file_size = ftell(fp);
+    if (file_size < sizeof(dsw_header)) error(".dsw: file is truncated");
+#ifdef _WIN32
+    char *map = (char*)calloc(1, file_size);
+    fseek(fp, 0, SEEK_SET);
+    if (fread(map, 1, file_size, fp) != file_size) error(".dsw: read error");
+#else
+    char *map = (char*)mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED) error(".dsw: mmap failed");
+#endif
+    fclose(fp);
+
+    dsw_header *header = (dsw_header*)map;
+    if (header->version != DSW_VERSION) error(".dsw: unknown version");
+    if (header->n != net->n) error(".dsw: the number of layers doesn't match the cfg-file");
+    if (sizeof(dsw_header) + header->n * sizeof(dsw_layer) > file_size) error(".dsw: file is truncated");
+    *net->seen = header->seen;
+    net->weights_map = map;
+    net->weights_map_size = file_size;
+
+    dsw_layer *table = (dsw_layer*)(map + sizeof(dsw_header));
+    void *data[DSW_BLOCKS];
+    void **fields[DSW_BLOCKS];
+    uint64_t bytes[DSW_BLOCKS];
+    int i, k;
+    for (i = 0; i < net->n && i < cutoff; ++i) {
+        layer *l = &net->layers[i];
+        dsw_layer *t = &table[i];
+        if (l->dontload) continue;
+        if (l->type == CONVOLUTIONAL && l->share_layer) continue;
+        for (k = 0; k < DSW_BLOCKS && !t->offset[k]; ++k);
+        if (k == DSW_BLOCKS) continue;  // no weights, e.g. a [shortcut] fused at export
+        if (t->type != l->type || t->n != l->n || t->c != l->c || t->size != l->size || t->nweights != l->nweights ||
+            t->outputs != l->outputs || t->inputs != l->inputs)
+        {
+            printf(" .dsw layer %d doesn't match the cfg-file \n", i);
+            error(".dsw: wrong cfg-file");
+        }
+        fields[DSW_BIASES] = (void**)&l->biases;
+        fields[DSW_WEIGHTS] = (void**)&l->weights;
+        fields[DSW_SCALES] = (void**)&l->scales;
+        fields[DSW_ROLLING_MEAN] = (void**)&l->rolling_mean;
+        fields[DSW_ROLLING_VARIANCE] = (void**)&l->rolling_variance;
+        fields[DSW_WINOGRAD] = (void**)&l->winograd_weights;
+        fields[DSW_INT8_WEIGHTS] = (void**)&l->weights_int8;
+        fields[DSW_INT8_SCALES] = (void**)&l->weights_int8_scales;
+        fields[DSW_INT8_SUMS] = (void**)&l->weights_int8_sums;
+        for (k = 0; k < DSW_BLOCKS; ++k) {
+            if (!t->offset[k]) continue;
+            if (t->offset[k] + t->bytes[k] > file_size) error(".dsw: file is truncated");
+            if (*fields[k] && !is_weights_mapped(*l, *fields[k])) free(*fields[k]);
+            *fields[k] = map + t->offset[k];
+        }
+        l->weights_map = map;
+        l->weights_map_size = file_size;
+        dsw_layer_blocks(*l, data, bytes);
+        for (k = 0; k < DSW_BLOCKS; ++k) {
+            if (bytes[k] != t->bytes[k]) error(".dsw: wrong block size");
+        }
+        if (l->type == CONVOLUTIONAL) {
+            l->batch_normalize = 0;     // fused
+            l->input_int8_scale = t->input_int8_scale;
+            l->input_int8_zero_point = t->input_int8_zero_point;
+        }
+#ifdef GPU
+        if (gpu_index >= 0) {
+            if (l->type == CONVOLUTIONAL) push_convolutional_layer(*l);
+            if (l->type == CONNECTED) push_connected_layer(*l);
+            if (l->type == BATCHNORM) push_batchnorm_layer(*l);
+        }
+#endif
+    }
+}
+
 void load_weights_upto(network *net, char *filename, int cutoff)
 {
 #ifdef GPU
-    if(net->gpu_index >= 0){
+    if(net->gpu_index >= 0 && net->gpu_index != cuda_get_device()){
         cuda_set_device(net->gpu_index);
     }
 #endif
@@ -1363,6 +1665,18 @@ void load_weights_upto(network *net, char *filename, int cutoff)
     int minor;
     int revision;
     fread(&major, sizeof(int), 1, fp);
+    if (major == DSW_MAGIC) {
+        fclose(fp);
+        load_weights_dsw_upto(net, filename, cutoff);
+        fprintf(stderr, "Done! (.dsw)\n");
+        return;
+    }
+    if (major == INT8_WEIGHTS_MAGIC) {
+        load_weights_int8_upto(net, fp, cutoff);
+        fprintf(stderr, "Done! (INT8)\n");
+        fclose(fp);
+        return;
+    }
     fread(&minor, sizeof(int), 1, fp);
     fread(&revision, sizeof(int), 1, fp);
     if ((major * 10 + minor) >= 2) {
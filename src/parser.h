@@ -10,6 +10,8 @@ network parse_network_cfg_custom(char *filename, int batch, int time_steps);
 void save_network(network net, char *filename);
 void save_weights(network net, char *filename);
 void save_weights_upto(network net, char *filename, int cutoff);
+void save_weights_int8(network net, char *filename);
+void save_weights_dsw(network net, char *filename);
 void save_weights_double(network net, char *filename);
 void load_weights(network *net, char *filename);
 void load_weights_upto(network *net, char *filename, int cutoff);
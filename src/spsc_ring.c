@@ -0,0 +1,89 @@
+#include "spsc_ring.h"
+#include "utils.h"
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#include <time.h>
+#endif
+
+#if defined(__GNUC__)
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else   // MSVC: volatile reads and writes are acquire and release (/volatile:ms)
+#define load_acquire(p) (*(p))
+#define store_release(p, v) (*(p) = (v))
+#endif
+
+// a frame takes milliseconds, so after a short spin it is cheaper to give the core
+// to the other stages than to burn it
+void spsc_ring_wait(int *spins)
+{
+    ++*spins;
+    if (*spins < 64) return;
+#ifdef _WIN32
+    if (*spins < 128) SwitchToThread();
+    else Sleep(1);
+#else
+    if (*spins < 128) sched_yield();
+    else {
+        struct timespec ts = { 0, 100000 };
+        nanosleep(&ts, 0);
+    }
+#endif
+}
+
+void spsc_ring_init(spsc_ring *r, int capacity)
+{
+    unsigned int n = 1;
+    while (n < (unsigned int)capacity) n *= 2;
+    r->items = (void**)calloc(n, sizeof(void*));
+    if (!r->items) error("spsc_ring: calloc failed");
+    r->mask = n - 1;
+    r->head = 0;
+    r->tail = 0;
+}
+
+void spsc_ring_free(spsc_ring *r)
+{
+    free(r->items);
+    r->items = NULL;
+}
+
+int spsc_ring_try_push(spsc_ring *r, void *item)
+{
+    const unsigned int tail = r->tail;
+    if (tail - load_acquire(&r->head) > r->mask) return 0;
+    r->items[tail & r->mask] = item;
+    store_release(&r->tail, tail + 1);
+    return 1;
+}
+
+void *spsc_ring_try_pop(spsc_ring *r)
+{
+    const unsigned int head = r->head;
+    if (head == load_acquire(&r->tail)) return NULL;
+    void *item = r->items[head & r->mask];
+    store_release(&r->head, head + 1);
+    return item;
+}
+
+void spsc_ring_push(spsc_ring *r, void *item)
+{
+    int spins = 0;
+    while (!spsc_ring_try_push(r, item)) spsc_ring_wait(&spins);
+}
+
+void *spsc_ring_pop(spsc_ring *r)
+{
+    int spins = 0;
+    void *item;
+    while (!(item = spsc_ring_try_pop(r))) spsc_ring_wait(&spins);
+    return item;
+}
+
+int spsc_ring_size(spsc_ring *r)
+{
+    return (int)(load_acquire(&r->tail) - load_acquire(&r->head));
+}
@@ -0,0 +1,40 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+// Bounded queue of pointers between exactly one producer thread and one
+// consumer thread. Push and pop take no locks; the blocking variants spin
+// for a moment and then sleep in short steps while the ring is full/empty.
+// Items must not be NULL.
+typedef struct spsc_ring {
+    void **items;
+    unsigned int mask;          // capacity - 1, the capacity is a power of two
+    char pad0[64];
+    volatile unsigned int head; // items popped so far, written by the consumer
+    char pad1[64];
+    volatile unsigned int tail; // items pushed so far, written by the producer
+    char pad2[64];
+} spsc_ring;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// capacity is rounded up to a power of two
+void spsc_ring_init(spsc_ring *r, int capacity);
+void spsc_ring_free(spsc_ring *r);
+
+// return 0 / NULL instead of waiting
+int spsc_ring_try_push(spsc_ring *r, void *item);
+void *spsc_ring_try_pop(spsc_ring *r);
+
+void spsc_ring_push(spsc_ring *r, void *item);
+void *spsc_ring_pop(spsc_ring *r);
+
+int spsc_ring_size(spsc_ring *r);
+
+// one step of the wait of the blocking variants, for a thread polling several rings;
+// spins starts at 0 and is reset when the wait is over
+void spsc_ring_wait(int *spins);
+#ifdef __cplusplus
+}
+#endif
+#endif
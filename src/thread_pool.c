@@ -0,0 +1,216 @@
+#include "thread_pool.h"
+#include "utils.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+typedef struct pool_task {
+    pool_task_func func;
+    void *arg;
+    pool_group *group;
+} pool_task;
+
+// ring buffer, grown on demand
+typedef struct pool_deque {
+    pthread_mutex_t mutex;
+    pool_task *tasks;
+    int head;
+    int count;
+    int capacity;
+} pool_deque;
+
+typedef struct pool_worker {
+    thread_pool *pool;
+    int index;
+} pool_worker;
+
+struct thread_pool {
+    int n;
+    pthread_t *threads;
+    pool_worker *workers;
+    pool_deque *deques;
+    pthread_mutex_t mutex;  // guards queued, next and stop
+    pthread_cond_t wake;
+    int queued;
+    int next;
+    int stop;
+};
+
+int get_num_cpus()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+#endif
+}
+
+static void deque_push_back(pool_deque *d, pool_task t)
+{
+    pthread_mutex_lock(&d->mutex);
+    if (d->count == d->capacity) {
+        int i;
+        int capacity = d->capacity ? 2 * d->capacity : 16;
+        pool_task *tasks = (pool_task*)calloc(capacity, sizeof(pool_task));
+        if (!tasks) error("thread_pool: calloc failed");
+        for (i = 0; i < d->count; ++i) tasks[i] = d->tasks[(d->head + i) % d->capacity];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->capacity = capacity;
+    }
+    d->tasks[(d->head + d->count) % d->capacity] = t;
+    ++d->count;
+    pthread_mutex_unlock(&d->mutex);
+}
+
+// oldest first, for the owner and for thieves alike: tasks of the batch the
+// trainer waits on run before those of the batch loaded ahead
+static int deque_pop(pool_deque *d, pool_task *t)
+{
+    int found = 0;
+    pthread_mutex_lock(&d->mutex);
+    if (d->count) {
+        *t = d->tasks[d->head];
+        d->head = (d->head + 1) % d->capacity;
+        --d->count;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return found;
+}
+
+static void *pool_worker_loop(void *ptr)
+{
+    pool_worker w = *(pool_worker*)ptr;
+    thread_pool *p = w.pool;
+    trace_thread_name("pool worker");
+    while (1) {
+        pthread_mutex_lock(&p->mutex);
+        while (!p->queued && !p->stop) pthread_cond_wait(&p->wake, &p->mutex);
+        if (!p->queued) {
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+        // reserve one task; it is already in some deque, but another worker
+        // may take it first, so keep scanning until one turns up
+        --p->queued;
+        pthread_mutex_unlock(&p->mutex);
+
+        pool_task t;
+        int i = 0;
+        while (!deque_pop(&p->deques[w.index], &t)) {
+            i = (i + 1) % p->n;
+            if (i != w.index && deque_pop(&p->deques[i], &t)) break;
+        }
+
+        t.func(t.arg, w.index);
+
+        if (t.group) {
+            pthread_mutex_lock(&t.group->mutex);
+            if (--t.group->pending == 0) pthread_cond_broadcast(&t.group->done);
+            pthread_mutex_unlock(&t.group->mutex);
+        }
+    }
+    return 0;
+}
+
+thread_pool *make_thread_pool(int n)
+{
+    int i;
+    if (n < 1) n = 1;
+    thread_pool *p = (thread_pool*)calloc(1, sizeof(thread_pool));
+    p->n = n;
+    p->threads = (pthread_t*)calloc(n, sizeof(pthread_t));
+    p->workers = (pool_worker*)calloc(n, sizeof(pool_worker));
+    p->deques = (pool_deque*)calloc(n, sizeof(pool_deque));
+    pthread_mutex_init(&p->mutex, 0);
+    pthread_cond_init(&p->wake, 0);
+    for (i = 0; i < n; ++i) pthread_mutex_init(&p->deques[i].mutex, 0);
+    for (i = 0; i < n; ++i) {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        if (pthread_create(&p->threads[i], 0, pool_worker_loop, &p->workers[i])) error("Thread creation failed");
+    }
+    return p;
+}
+
+// runs every task already submitted, then stops the workers
+void free_thread_pool(thread_pool *p)
+{
+    int i;
+    if (!p) return;
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->mutex);
+    for (i = 0; i < p->n; ++i) pthread_join(p->threads[i], 0);
+    for (i = 0; i < p->n; ++i) {
+        pthread_mutex_destroy(&p->deques[i].mutex);
+        free(p->deques[i].tasks);
+    }
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->mutex);
+    free(p->deques);
+    free(p->workers);
+    free(p->threads);
+    free(p);
+}
+
+int thread_pool_size(thread_pool *p)
+{
+    return p->n;
+}
+
+void thread_pool_submit(thread_pool *p, pool_task_func func, void *arg, pool_group *group)
+{
+    pool_task t;
+    t.func = func;
+    t.arg = arg;
+    t.group = group;
+    if (group) {
+        pthread_mutex_lock(&group->mutex);
+        ++group->pending;
+        pthread_mutex_unlock(&group->mutex);
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    int w = p->next;
+    p->next = (p->next + 1) % p->n;
+    pthread_mutex_unlock(&p->mutex);
+
+    deque_push_back(&p->deques[w], t);
+
+    pthread_mutex_lock(&p->mutex);
+    ++p->queued;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+void pool_group_init(pool_group *g)
+{
+    pthread_mutex_init(&g->mutex, 0);
+    pthread_cond_init(&g->done, 0);
+    g->pending = 0;
+}
+
+void pool_group_wait(pool_group *g)
+{
+    pthread_mutex_lock(&g->mutex);
+    while (g->pending) pthread_cond_wait(&g->done, &g->mutex);
+    pthread_mutex_unlock(&g->mutex);
+}
+
+void pool_group_free(pool_group *g)
+{
+    pthread_cond_destroy(&g->done);
+    pthread_mutex_destroy(&g->mutex);
+}
@@ -0,0 +1,37 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+#include <pthread.h>
+
+// Persistent pool of worker threads. Each worker owns a deque of tasks:
+// it runs its own tasks oldest-first and steals the oldest task of the
+// other deques when it runs dry, so a few slow images do not stall a batch.
+typedef void (*pool_task_func)(void *arg, int worker);
+
+typedef struct thread_pool thread_pool;
+
+// Completion counter for a set of submitted tasks. Owned by the caller.
+typedef struct pool_group {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    int pending;
+} pool_group;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+thread_pool *make_thread_pool(int n);
+void free_thread_pool(thread_pool *p);
+int thread_pool_size(thread_pool *p);
+int get_num_cpus();
+
+// group may be NULL for fire-and-forget tasks
+void thread_pool_submit(thread_pool *p, pool_task_func func, void *arg, pool_group *group);
+
+void pool_group_init(pool_group *g);
+void pool_group_wait(pool_group *g);
+void pool_group_free(pool_group *g);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
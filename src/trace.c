@@ -0,0 +1,256 @@
+#include "trace.h"
+#include "utils.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define TRACE_DEFAULT_EVENTS (1 << 16)
+
+typedef struct trace_event {
+    const char *name;
+    unsigned long long start, end;  // ns, steady clock
+    int tid;
+} trace_event;
+
+// written only by the thread which holds it; when that thread exits the
+// buffer, with its spans, is handed to the next new thread
+typedef struct trace_buffer {
+    trace_event *events;
+    volatile unsigned long long head;   // spans written so far, the ring keeps the last trace_mask+1
+    int tid;
+    int lane;       // index in lanes[], -1 - unnamed thread
+    int in_use;
+    struct trace_buffer *next;
+} trace_buffer;
+
+typedef struct trace_lane {
+    char *name;
+    int tid;
+    int live;
+} trace_lane;
+
+static volatile int trace_on;
+static char *trace_filename;
+static unsigned long long trace_mask;
+static unsigned long long trace_origin;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer *volatile buffers;
+static trace_lane *lanes;
+static int nlanes;
+static int next_tid;
+
+static unsigned long long now_ns()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (unsigned long long)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void release_trace_buffer(void *ptr)
+{
+    trace_buffer *b = (trace_buffer*)ptr;
+    pthread_mutex_lock(&trace_mutex);
+    if (b->lane >= 0) lanes[b->lane].live = 0;
+    b->in_use = 0;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static trace_buffer *get_trace_buffer()
+{
+    trace_buffer *b = (trace_buffer*)pthread_getspecific(trace_key);
+    if (b) return b;
+    pthread_mutex_lock(&trace_mutex);
+    for (b = buffers; b && b->in_use; b = b->next);
+    if (!b) {
+        b = (trace_buffer*)calloc(1, sizeof(trace_buffer));
+        b->events = (trace_event*)calloc(trace_mask + 1, sizeof(trace_event));
+        if (!b->events) error("trace: can't allocate the span buffer");
+        b->next = buffers;
+        buffers = b;    // published fully initialized, trace_dump() may walk the list without the lock
+    }
+    b->in_use = 1;
+    b->tid = ++next_tid;
+    b->lane = -1;
+    pthread_mutex_unlock(&trace_mutex);
+    pthread_setspecific(trace_key, b);
+    return b;
+}
+
+int trace_enabled()
+{
+    return trace_on;
+}
+
+unsigned long long trace_begin()
+{
+    return trace_on ? now_ns() : 0;
+}
+
+void trace_end(const char *name, unsigned long long start)
+{
+    if (!start) return;
+    const unsigned long long end = now_ns();
+    trace_buffer *b = get_trace_buffer();
+    trace_event *e = b->events + (b->head & trace_mask);
+    e->name = name;
+    e->start = start;
+    e->end = end;
+    e->tid = b->tid;
+    ++b->head;
+}
+
+void trace_thread_name(const char *name)
+{
+    int i;
+    if (!trace_on) return;
+    trace_buffer *b = get_trace_buffer();
+    pthread_mutex_lock(&trace_mutex);
+    if (b->lane >= 0) lanes[b->lane].live = 0;
+    for (i = 0; i < nlanes; ++i) {
+        if (!lanes[i].live && !strcmp(lanes[i].name, name)) break;
+    }
+    if (i == nlanes) {
+        lanes = (trace_lane*)realloc(lanes, (nlanes + 1) * sizeof(trace_lane));
+        if (!lanes) error("trace: realloc failed");
+        lanes[i].name = (char*)calloc(strlen(name) + 1, sizeof(char));
+        strcpy(lanes[i].name, name);
+        lanes[i].tid = ++next_tid;
+        ++nlanes;
+    }
+    lanes[i].live = 1;
+    b->lane = i;
+    b->tid = lanes[i].tid;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static void write_trace()
+{
+    int i;
+    FILE *fp = fopen(trace_filename, "w");
+    if (!fp) {
+        fprintf(stderr, " Can't write the trace to %s \n", trace_filename);
+        return;
+    }
+    const int pid = getpid();
+    int first = 1;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (i = 0; i < nlanes; ++i) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", pid, lanes[i].tid, lanes[i].name);
+        first = 0;
+    }
+    trace_buffer *b;
+    for (b = buffers; b; b = b->next) {
+        const unsigned long long head = b->head;
+        unsigned long long k = head > trace_mask + 1 ? head - trace_mask - 1 : 0;
+        for (; k < head; ++k) {
+            const trace_event e = b->events[k & trace_mask];
+            if (!e.name || e.start < trace_origin || e.end < e.start) continue;    // being overwritten
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                first ? "" : ",\n", e.name, pid, e.tid, (e.start - trace_origin) / 1000., (e.end - e.start) / 1000.);
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+void trace_dump()
+{
+    if (!trace_filename) return;
+    pthread_mutex_lock(&trace_mutex);
+    write_trace();
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+#ifdef _WIN32
+static volatile sig_atomic_t trace_signal;
+#else
+static int trace_pipe[2];
+#endif
+
+// only async-signal-safe calls here: the file is written by trace_signal_thread()
+static void trace_signal_handler(int sig)
+{
+#ifdef _WIN32
+    trace_signal = sig;
+#else
+    const unsigned char c = (unsigned char)sig;
+    const int err = errno;
+    if (write(trace_pipe[1], &c, 1) < 0) {}
+    errno = err;
+#endif
+}
+
+static void *trace_signal_thread(void *ptr)
+{
+    for (;;) {
+        int sig;
+#ifdef _WIN32
+        while (!trace_signal) Sleep(10);
+        sig = trace_signal;
+        trace_signal = 0;
+#else
+        unsigned char c;
+        if (read(trace_pipe[0], &c, 1) != 1) continue;
+        sig = c;
+#endif
+        trace_dump();
+#ifdef SIGUSR1
+        if (sig == SIGUSR1) continue;
+#endif
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+    return 0;
+}
+
+void trace_init(const char *filename, int events_per_thread)
+{
+    if (trace_on) return;
+    unsigned long long n = 1;
+    while (n < (unsigned long long)(events_per_thread > 0 ? events_per_thread : TRACE_DEFAULT_EVENTS)) n *= 2;
+    trace_mask = n - 1;
+    trace_filename = (char*)calloc(strlen(filename) + 1, sizeof(char));
+    strcpy(trace_filename, filename);
+    if (pthread_key_create(&trace_key, release_trace_buffer)) error("pthread_key_create failed");
+    trace_origin = now_ns();
+    trace_on = 1;
+    trace_thread_name("main");
+
+    atexit(trace_dump);
+#ifndef _WIN32
+    if (pipe(trace_pipe)) error("trace: pipe failed");
+    fcntl(trace_pipe[1], F_SETFL, O_NONBLOCK);
+#endif
+    pthread_t signal_thread;
+    if (pthread_create(&signal_thread, 0, trace_signal_thread, 0)) error("trace: pthread_create failed");
+    pthread_detach(signal_thread);
+    signal(SIGINT, trace_signal_handler);
+    signal(SIGTERM, trace_signal_handler);
+#ifdef SIGUSR1
+    signal(SIGUSR1, trace_signal_handler);
+#endif
+    printf(" Tracing to %s, %d spans per thread \n", trace_filename, (int)n);
+}
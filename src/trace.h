@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Spans recorded into per-thread ring buffers and written as Chrome
+// trace_event JSON (chrome://tracing, ui.perfetto.dev). Off until
+// trace_init(); then the file is written at exit, on SIGINT/SIGTERM and,
+// without stopping the process, on SIGUSR1.
+//
+//   unsigned long long t = trace_begin();
+//   ...
+//   trace_end("forward", t);
+//
+// Span names are not copied: pass string literals or other static strings.
+#ifdef __cplusplus
+extern "C" {
+#endif
+// events_per_thread is rounded up to a power of two, 0 - the default;
+// when a ring is full the oldest spans of that thread are overwritten
+void trace_init(const char *filename, int events_per_thread);
+int trace_enabled();
+
+// returns 0 if tracing is off, and trace_end() then does nothing
+unsigned long long trace_begin();
+void trace_end(const char *name, unsigned long long start);
+
+// names the calling thread's row in the viewer; threads which take the name
+// of one that has exited continue its row (e.g. the per-frame demo threads)
+void trace_thread_name(const char *name);
+
+// writes everything recorded so far, may be called any number of times
+void trace_dump();
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -330,6 +330,8 @@ int main(int argc, char *argv[])
                 bool use_zed_camera = false;
 
                 track_kalman_t track_kalman;
+                bool const use_motility_tracker = false;    // true - sperm tracks, CASA motility printed at the end of a video
+                track_motility_t motility_tracker;
 
 #ifdef ZED_STEREO
                 sl::InitParameters init_params;
@@ -530,6 +532,13 @@ int main(int argc, char *argv[])
                                 result_vec = track_kalman.predict();
                             }
                         }
+                        // track ID and motility by frame time
+                        else if (use_motility_tracker) {
+                            if (detection_data.new_detection) {
+                                double const frame_time = detection_data.frame_id / (double)std::max(1, video_fps);
+                                result_vec = motility_tracker.update(result_vec, frame_time);
+                            }
+                        }
                         // track ID by using custom function
                         else {
                             int frame_story = std::max(5, current_fps_cap.load());
@@ -632,6 +641,15 @@ int main(int argc, char *argv[])
                 if (t_write.joinable()) t_write.join();
                 if (t_network.joinable()) t_network.join();
 
+                if (use_motility_tracker) {
+                    motility_tracker.finish();
+                    for (auto &m : motility_tracker.motility()) {
+                        std::cout << " track_id = " << m.track_id << ", points = " << m.points << std::fixed << std::setprecision(1)
+                            << ", VCL = " << m.vcl << ", VSL = " << m.vsl << ", VAP = " << m.vap << std::setprecision(2)
+                            << ", ALH = " << m.alh << ", LIN = " << m.lin << ", STR = " << m.str << ", WOB = " << m.wob << std::endl;
+                    }
+                }
+
                 break;
 
             }
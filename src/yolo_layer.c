@@ -6,6 +6,7 @@
 #include "utils.h"
 
 #include <stdio.h>
+#include <math.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
@@ -238,13 +239,17 @@ void forward_yolo_layer(const layer l, network_state state)
     memcpy(l.output, state.input, l.outputs*l.batch * sizeof(float));
 
 #ifndef GPU
-    for (b = 0; b < l.batch; ++b) {
-        for (n = 0; n < l.n; ++n) {
-            int index = entry_index(l, b, n*l.w*l.h, 0);
-            activate_array(l.output + index, 2 * l.w*l.h, LOGISTIC);        // x,y,
-            scal_add_cpu(2 * l.w*l.h, l.scale_x_y, -0.5*(l.scale_x_y - 1), l.output + index, 1);    // scale x,y
-            index = entry_index(l, b, n*l.w*l.h, 4);
-            activate_array(l.output + index, (1 + l.classes)*l.w*l.h, LOGISTIC);
+    // at inference the output keeps the raw logits: get_yolo_detections()
+    // activates only the anchors whose objectness passes the threshold
+    if (state.train) {
+        for (b = 0; b < l.batch; ++b) {
+            for (n = 0; n < l.n; ++n) {
+                int index = entry_index(l, b, n*l.w*l.h, 0);
+                activate_array(l.output + index, 2 * l.w*l.h, LOGISTIC);        // x,y,
+                scal_add_cpu(2 * l.w*l.h, l.scale_x_y, -0.5*(l.scale_x_y - 1), l.output + index, 1);    // scale x,y
+                index = entry_index(l, b, n*l.w*l.h, 4);
+                activate_array(l.output + index, (1 + l.classes)*l.w*l.h, LOGISTIC);
+            }
         }
     }
 #endif
@@ -446,14 +451,52 @@ void correct_yolo_boxes(detection *dets, int n, int w, int h, int netw, int neth
     }
 }
 
+#ifdef GPU
+// forward_yolo_layer_gpu() has already activated the whole output
+#define YOLO_RAW_OUTPUT 0
+#else
+#define YOLO_RAW_OUTPUT 1
+#endif
+
+// raw - the output holds logits, see forward_yolo_layer()
+static inline float yolo_logistic(int raw, float x) { return raw ? logistic_activate(x) : x; }
+static inline float yolo_scale_xy(layer l, int raw, float x) { return raw ? logistic_activate(x)*l.scale_x_y + (float)(-0.5*(l.scale_x_y - 1)) : x; }
+
+// Logit of thresh, lowered by a margin: raw objectness at or below it can't
+// pass, the rest is activated and compared with thresh exactly.
+static float yolo_objectness_cut(int raw, float thresh)
+{
+    if (!raw) return thresh;
+    if (thresh <= 0) return -INFINITY;
+    if (thresh >= 1) return INFINITY;
+    float logit = logf(thresh / (1 - thresh));
+    return logit - .01f - .001f*fabsf(logit);
+}
+
 int yolo_num_detections(layer l, float thresh)
 {
     int i, n;
     int count = 0;
+    const int raw = YOLO_RAW_OUTPUT;
+    if (l.batch == 2) {
+        // the objectness get_yolo_detections() will see after avg_flipped_yolo()
+        for (i = 0; i < l.w*l.h; ++i){
+            const int mirror = i - i % l.w + (l.w - 1 - i % l.w);
+            for(n = 0; n < l.n; ++n){
+                float v = yolo_logistic(raw, l.output[entry_index(l, 0, n*l.w*l.h + i, 4)]);
+                float flip = yolo_logistic(raw, l.output[entry_index(l, 1, n*l.w*l.h + mirror, 4)]);
+                float avg = (v + flip)/2.;
+                if (avg > thresh) ++count;
+            }
+        }
+        return count;
+    }
+    float cut = yolo_objectness_cut(raw, thresh);
     for (i = 0; i < l.w*l.h; ++i){
         for(n = 0; n < l.n; ++n){
             int obj_index  = entry_index(l, 0, n*l.w*l.h + i, 4);
-            if(l.output[obj_index] > thresh){
+            float v = l.output[obj_index];
+            if(v > cut && yolo_logistic(raw, v) > thresh){
                 ++count;
             }
         }
@@ -461,10 +504,23 @@ int yolo_num_detections(layer l, float thresh)
     return count;
 }
 
+// averages the activated outputs, as with the GPU forward
 void avg_flipped_yolo(layer l)
 {
     int i,j,n,z;
     float *flip = l.output + l.outputs;
+#if YOLO_RAW_OUTPUT
+    int b;
+    for (b = 0; b < 2; ++b) {
+        for (n = 0; n < l.n; ++n) {
+            int index = entry_index(l, b, n*l.w*l.h, 0);
+            activate_array(l.output + index, 2 * l.w*l.h, LOGISTIC);        // x,y,
+            scal_add_cpu(2 * l.w*l.h, l.scale_x_y, -0.5*(l.scale_x_y - 1), l.output + index, 1);    // scale x,y
+            index = entry_index(l, b, n*l.w*l.h, 4);
+            activate_array(l.output + index, (1 + l.classes)*l.w*l.h, LOGISTIC);
+        }
+    }
+#endif
     for (j = 0; j < l.h; ++j) {
         for (i = 0; i < l.w/2; ++i) {
             for (n = 0; n < l.n; ++n) {
@@ -493,23 +549,32 @@ int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh,
     int i,j,n;
     float *predictions = l.output;
     if (l.batch == 2) avg_flipped_yolo(l);
+    const int raw = YOLO_RAW_OUTPUT && l.batch != 2;
     int count = 0;
+    int stride = l.w*l.h;
+    float cut = yolo_objectness_cut(raw, thresh);
     for (i = 0; i < l.w*l.h; ++i){
         int row = i / l.w;
         int col = i % l.w;
         for(n = 0; n < l.n; ++n){
             int obj_index  = entry_index(l, 0, n*l.w*l.h + i, 4);
-            float objectness = predictions[obj_index];
             //if(objectness <= thresh) continue;    // incorrect behavior for Nan values
+            if (!(predictions[obj_index] > cut)) continue;
+            float objectness = yolo_logistic(raw, predictions[obj_index]);
             if (objectness > thresh) {
                 //printf("\n objectness = %f, thresh = %f, i = %d, n = %d \n", objectness, thresh, i, n);
                 int box_index = entry_index(l, 0, n*l.w*l.h + i, 0);
-                dets[count].bbox = get_yolo_box(predictions, l.biases, l.mask[n], box_index, col, row, l.w, l.h, netw, neth, l.w*l.h);
+                box b;
+                b.x = (col + yolo_scale_xy(l, raw, predictions[box_index])) / l.w;
+                b.y = (row + yolo_scale_xy(l, raw, predictions[box_index + stride])) / l.h;
+                b.w = exp(predictions[box_index + 2*stride]) * l.biases[2*l.mask[n]] / netw;
+                b.h = exp(predictions[box_index + 3*stride]) * l.biases[2*l.mask[n]+1] / neth;
+                dets[count].bbox = b;
                 dets[count].objectness = objectness;
                 dets[count].classes = l.classes;
                 for (j = 0; j < l.classes; ++j) {
                     int class_index = entry_index(l, 0, n*l.w*l.h + i, 4 + 1 + j);
-                    float prob = objectness*predictions[class_index];
+                    float prob = objectness*yolo_logistic(raw, predictions[class_index]);
                     dets[count].prob[j] = (prob > thresh) ? prob : 0;
                 }
                 ++count;
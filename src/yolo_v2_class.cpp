@@ -125,8 +125,40 @@ struct detector_gpu_t {
     float* predictions[NFRAMES];
     int demo_index;
     unsigned int *track_id;
+    float *batch_input;         // network input of detect() and detect_batch(), reused between calls
+    size_t batch_input_size;
 };
 
+static std::vector<bbox_t> detections_to_bboxes(detection *dets, int nboxes, int classes, float thresh, int w, int h)
+{
+    std::vector<bbox_t> bbox_vec;
+
+    for (int i = 0; i < nboxes; ++i) {
+        box b = dets[i].bbox;
+        int const obj_id = max_index(dets[i].prob, classes);
+        float const prob = dets[i].prob[obj_id];
+
+        if (prob > thresh)
+        {
+            bbox_t bbox;
+            bbox.x = std::max((double)0, (b.x - b.w / 2.)*w);
+            bbox.y = std::max((double)0, (b.y - b.h / 2.)*h);
+            bbox.w = b.w*w;
+            bbox.h = b.h*h;
+            bbox.obj_id = obj_id;
+            bbox.prob = prob;
+            bbox.track_id = 0;
+            bbox.frames_counter = 0;
+            bbox.x_3d = NAN;
+            bbox.y_3d = NAN;
+            bbox.z_3d = NAN;
+
+            bbox_vec.push_back(bbox);
+        }
+    }
+    return bbox_vec;
+}
+
 LIB_API Detector::Detector(std::string cfg_filename, std::string weight_filename, int gpu_id) : cur_gpu_id(gpu_id)
 {
     wait_stream = 0;
@@ -157,6 +189,7 @@ LIB_API Detector::Detector(std::string cfg_filename, std::string weight_filename
     set_batch_network(&net, 1);
     net.gpu_index = cur_gpu_id;
     fuse_conv_batchnorm(net);
+    plan_network_memory(&net);
 
     layer l = net.layers[net.n - 1];
     int j;
@@ -180,6 +213,7 @@ LIB_API Detector::~Detector()
     //layer l = detector_gpu.net.layers[detector_gpu.net.n - 1];
 
     free(detector_gpu.track_id);
+    free(detector_gpu.batch_input);
 
     free(detector_gpu.avg);
     for (int j = 0; j < NFRAMES; ++j) free(detector_gpu.predictions[j]);
@@ -214,9 +248,13 @@ LIB_API int Detector::get_net_color_depth() const {
 
 LIB_API std::vector<bbox_t> Detector::detect(std::string image_filename, float thresh, bool use_mean)
 {
-    std::shared_ptr<image_t> image_ptr(new image_t, [](image_t *img) { if (img->data) free(img->data); delete img; });
-    *image_ptr = load_image(image_filename);
-    return detect(*image_ptr, thresh, use_mean);
+    int w, h, c;
+    unsigned char *data = stbi_load(image_filename.c_str(), &w, &h, &c, 3);
+    if (!data)
+        throw std::runtime_error("file not found");
+    std::vector<bbox_t> bbox_vec = detect_resampled(data, w, h, 3, w * 3, false, 0, thresh, use_mean);
+    free(data);
+    return bbox_vec;
 }
 
 static image load_image_stb(char *filename, int channels)
@@ -263,6 +301,43 @@ LIB_API void Detector::free_image(image_t m)
     }
 }
 
+// grows the network input kept in detector_gpu for detect() and detect_batch()
+static float *get_detector_input(detector_gpu_t &detector_gpu, size_t size)
+{
+    if (detector_gpu.batch_input_size < size) {
+        free(detector_gpu.batch_input);
+        detector_gpu.batch_input = (float *)calloc(size, sizeof(float));
+        detector_gpu.batch_input_size = size;
+    }
+    return detector_gpu.batch_input;
+}
+
+// runs the network on the input filled by detect()/detect_bytes(); boxes are in im_w x im_h pixels
+static std::vector<bbox_t> detect_input(detector_gpu_t &detector_gpu, int im_w, int im_h, float thresh, float nms, bool use_mean)
+{
+    network &net = detector_gpu.net;
+    layer l = net.layers[net.n - 1];
+
+    float *prediction = network_predict(net, detector_gpu.batch_input);
+
+    if (use_mean) {
+        memcpy(detector_gpu.predictions[detector_gpu.demo_index], prediction, l.outputs * sizeof(float));
+        mean_arrays(detector_gpu.predictions, NFRAMES, l.outputs, detector_gpu.avg);
+        l.output = detector_gpu.avg;
+        detector_gpu.demo_index = (detector_gpu.demo_index + 1) % NFRAMES;
+    }
+    //get_region_boxes(l, 1, 1, thresh, detector_gpu.probs, detector_gpu.boxes, 0, 0);
+    //if (nms) do_nms_sort(detector_gpu.boxes, detector_gpu.probs, l.w*l.h*l.n, l.classes, nms);
+
+    int nboxes = 0;
+    int letterbox = 0;
+    float hier_thresh = 0.5;
+    detection *dets = get_network_boxes_into(&net, im_w, im_h, thresh, hier_thresh, 0, 1, &nboxes, letterbox, NULL);
+    if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+
+    return detections_to_bboxes(dets, nboxes, l.classes, thresh, im_w, im_h);
+}
+
 LIB_API std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use_mean)
 {
     detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
@@ -284,64 +359,161 @@ LIB_API std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use
     im.w = img.w;
 
     image sized;
+    sized.w = net.w;
+    sized.h = net.h;
+    sized.c = im.c;
+    sized.data = get_detector_input(detector_gpu, (size_t)net.w*net.h*im.c);
 
-    if (net.w == im.w && net.h == im.h) {
-        sized = make_image(im.w, im.h, im.c);
+    set_inference_batch(&net, 1);
+    if (net.w == im.w && net.h == im.h)
         memcpy(sized.data, im.data, im.w*im.h*im.c * sizeof(float));
-    }
     else
-        sized = resize_image(im, net.w, net.h);
+        resize_image_into(im, sized);
 
-    layer l = net.layers[net.n - 1];
+    std::vector<bbox_t> bbox_vec = detect_input(detector_gpu, im.w, im.h, thresh, nms, use_mean);
 
-    float *X = sized.data;
+#ifdef GPU
+    if (cur_gpu_id != old_gpu_index)
+        cudaSetDevice(old_gpu_index);
+#endif
 
-    float *prediction = network_predict(net, X);
+    return bbox_vec;
+}
 
-    if (use_mean) {
-        memcpy(detector_gpu.predictions[detector_gpu.demo_index], prediction, l.outputs * sizeof(float));
-        mean_arrays(detector_gpu.predictions, NFRAMES, l.outputs, detector_gpu.avg);
-        l.output = detector_gpu.avg;
-        detector_gpu.demo_index = (detector_gpu.demo_index + 1) % NFRAMES;
+LIB_API std::vector<bbox_t> Detector::detect_bytes(const unsigned char *data, int w, int h, int c, int step, bool bgr, float thresh, bool use_mean)
+{
+    return detect_resampled(data, w, h, c, step, bgr, 2, thresh, use_mean);
+}
+
+std::vector<bbox_t> Detector::detect_resampled(const unsigned char *data, int w, int h, int c, int step, bool bgr, int filter,
+    float thresh, bool use_mean)
+{
+    detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+    network &net = detector_gpu.net;
+    if (data == NULL)
+        throw std::runtime_error("Image is empty");
+    if (c < net.c)
+        throw std::runtime_error("Image has a wrong number of channels");
+#ifdef GPU
+    int old_gpu_index;
+    cudaGetDevice(&old_gpu_index);
+    if (cur_gpu_id != old_gpu_index)
+        cudaSetDevice(net.gpu_index);
+
+    net.wait_stream = wait_stream;    // 1 - wait CUDA-stream, 0 - not to wait
+#endif
+
+    image sized;
+    sized.w = net.w;
+    sized.h = net.h;
+    sized.c = net.c;
+    sized.data = get_detector_input(detector_gpu, (size_t)net.w*net.h*net.c);
+
+    set_inference_batch(&net, 1);
+    resize_bytes_into(data, w, h, c, step, bgr, sized, filter);
+
+    std::vector<bbox_t> bbox_vec = detect_input(detector_gpu, w, h, thresh, nms, use_mean);
+
+#ifdef GPU
+    if (cur_gpu_id != old_gpu_index)
+        cudaSetDevice(old_gpu_index);
+#endif
+
+    return bbox_vec;
+}
+
+// all images go through the network in one batch, the boxes are returned per image
+LIB_API std::vector<std::vector<bbox_t>> Detector::detect_batch(std::vector<image_t> imgs, float thresh)
+{
+    detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+    network &net = detector_gpu.net;
+    std::vector<std::vector<bbox_t>> result(imgs.size());
+    if (imgs.empty()) return result;
+    for (auto &img : imgs) {
+        if (img.data == NULL) throw std::runtime_error("Image is empty");
+        if (img.c != net.c) throw std::runtime_error("Image has a wrong number of channels");
     }
-    //get_region_boxes(l, 1, 1, thresh, detector_gpu.probs, detector_gpu.boxes, 0, 0);
-    //if (nms) do_nms_sort(detector_gpu.boxes, detector_gpu.probs, l.w*l.h*l.n, l.classes, nms);
+#ifdef GPU
+    int old_gpu_index;
+    cudaGetDevice(&old_gpu_index);
+    if (cur_gpu_id != old_gpu_index)
+        cudaSetDevice(net.gpu_index);
 
-    int nboxes = 0;
-    int letterbox = 0;
+    net.wait_stream = wait_stream;    // 1 - wait CUDA-stream, 0 - not to wait
+#endif
+
+    const int batch = imgs.size();
+    const size_t input_size = (size_t)net.w*net.h*net.c;
+    set_inference_batch(&net, batch);
+    get_detector_input(detector_gpu, batch*input_size);
+
+    // the same preprocessing as detect(), so both give the same boxes
+    for (int b = 0; b < batch; ++b) {
+        image im;
+        im.c = imgs[b].c;
+        im.data = imgs[b].data;
+        im.h = imgs[b].h;
+        im.w = imgs[b].w;
+
+        image sized;
+        sized.w = net.w;
+        sized.h = net.h;
+        sized.c = net.c;
+        sized.data = detector_gpu.batch_input + b*input_size;
+        if (net.w == im.w && net.h == im.h)
+            memcpy(sized.data, im.data, input_size * sizeof(float));
+        else
+            resize_image_into(im, sized);
+    }
+
+    network_predict(net, detector_gpu.batch_input);
+
+    layer l = net.layers[net.n - 1];
     float hier_thresh = 0.5;
-    detection *dets = get_network_boxes(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes, letterbox);
-    if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+    int letterbox = 0;
+    for (int b = 0; b < batch; ++b) {
+        int nboxes = 0;
+        detection *dets = get_network_boxes_batch_into(&net, b, imgs[b].w, imgs[b].h, thresh, hier_thresh, 0, 1, &nboxes, letterbox, NULL);
+        if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+        result[b] = detections_to_bboxes(dets, nboxes, l.classes, thresh, imgs[b].w, imgs[b].h);
+    }
 
-    std::vector<bbox_t> bbox_vec;
+#ifdef GPU
+    if (cur_gpu_id != old_gpu_index)
+        cudaSetDevice(old_gpu_index);
+#endif
 
-    for (int i = 0; i < nboxes; ++i) {
-        box b = dets[i].bbox;
-        int const obj_id = max_index(dets[i].prob, l.classes);
-        float const prob = dets[i].prob[obj_id];
+    return result;
+}
 
-        if (prob > thresh)
-        {
-            bbox_t bbox;
-            bbox.x = std::max((double)0, (b.x - b.w / 2.)*im.w);
-            bbox.y = std::max((double)0, (b.y - b.h / 2.)*im.h);
-            bbox.w = b.w*im.w;
-            bbox.h = b.h*im.h;
-            bbox.obj_id = obj_id;
-            bbox.prob = prob;
-            bbox.track_id = 0;
-            bbox.frames_counter = 0;
-            bbox.x_3d = NAN;
-            bbox.y_3d = NAN;
-            bbox.z_3d = NAN;
+LIB_API std::vector<bbox_t> Detector::detect_tiled(image_t img, float thresh, int overlap)
+{
+    detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+    network &net = detector_gpu.net;
+    if (img.data == NULL)
+        throw std::runtime_error("Image is empty");
+    if (img.c != net.c)
+        throw std::runtime_error("Image has a wrong number of channels");
+#ifdef GPU
+    int old_gpu_index;
+    cudaGetDevice(&old_gpu_index);
+    if (cur_gpu_id != old_gpu_index)
+        cudaSetDevice(net.gpu_index);
 
-            bbox_vec.push_back(bbox);
-        }
-    }
+    net.wait_stream = wait_stream;    // 1 - wait CUDA-stream, 0 - not to wait
+#endif
 
-    free_detections(dets, nboxes);
-    if(sized.data)
-        free(sized.data);
+    image im;
+    im.c = img.c;
+    im.data = img.data;
+    im.h = img.h;
+    im.w = img.w;
+
+    layer l = net.layers[net.n - 1];
+    float hier_thresh = 0.5;
+    int nboxes = 0;
+    detection *dets = network_predict_tiled(&net, im, overlap, thresh, hier_thresh, nms, &nboxes, NULL);
+    std::vector<bbox_t> bbox_vec = detections_to_bboxes(dets, nboxes, l.classes, thresh, im.w, im.h);
 
 #ifdef GPU
     if (cur_gpu_id != old_gpu_index)